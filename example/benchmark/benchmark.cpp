@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the latency effect of the socket options of mhttpd::Server. For
+ * every configuration a server is started on the loopback interface and
+ * queried by a single client, one connection per request, reporting the
+ * time to the first and to the last byte of the response.
+ */
+
+#include <mhttpd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 18080
+
+static size_t bodySize = 16384;
+
+struct Configuration {
+    const char* name;
+    unsigned deferAccept;
+    unsigned fastOpen;
+    bool noDelay;
+    bool cork;
+};
+
+static const Configuration configurations[] = {
+    { "none", 0, 0, false, false },
+    { "nodelay", 0, 0, true, false },
+    { "nodelay+cork", 0, 0, true, true },
+    { "nodelay+cork+defer", 1, 0, true, true },
+    { "nodelay+cork+fastopen", 0, 256, true, true },
+    { "all", 1, 256, true, true }
+};
+
+static void handle(const mhttpd::Request&, mhttpd::Response& r) {
+    /* a header followed by a body too big to be buffered along with it */
+    r.statusCode = 200;
+    r.statusMessage = "OK";
+    r.contentType = "text/plain";
+    r.write(std::string(bodySize, 'x').data(), bodySize);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Query the server once.
+ * @param first microseconds until the first byte of the response
+ * @param last microseconds until the end of the response
+ */
+static bool query(unsigned port, bool fastOpen, double& first, double& last) {
+    static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    struct sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const double start = now();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    ssize_t sent;
+    if (fastOpen) {
+        /* connect and send the request along with the SYN, given a cookie */
+        sent = sendto(fd, request, sizeof(request) - 1, MSG_FASTOPEN, (struct sockaddr*) &addr, sizeof(addr));
+    } else if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        sent = send(fd, request, sizeof(request) - 1, 0);
+    } else {
+        sent = -1;
+    }
+
+    if (sent != sizeof(request) - 1) {
+        close(fd);
+        return false;
+    }
+
+    char buffer[65536];
+    size_t received = 0;
+    first = 0;
+    for (;;) {
+        const ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+        if (bytes <= 0) {
+            break;
+        }
+
+        if (received == 0) {
+            first = now() - start;
+        }
+        received += bytes;
+    }
+
+    last = now() - start;
+    close(fd);
+    return received > bodySize;
+}
+
+static double percentile(std::vector<double>& values, double p) {
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+}
+
+static void run(const Configuration& configuration, unsigned port, unsigned requests) {
+    std::fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        mhttpd::Server server(handle);
+        server.deferAccept = configuration.deferAccept;
+        server.fastOpen = configuration.fastOpen;
+        server.noDelay = configuration.noDelay;
+        server.cork = configuration.cork;
+
+        char endpoint[32];
+        std::sprintf(endpoint, "127.0.0.1:%u", port);
+        if (!server.listen(endpoint)) {
+            std::exit(1);
+        }
+        std::exit(server.start());
+    }
+
+    /* wait for the server to come up */
+    double first;
+    double last;
+    for (unsigned i = 0; i < 100 && !query(port, false, first, last); ++i) {
+        usleep(10000);
+    }
+
+    std::vector<double> firsts;
+    std::vector<double> lasts;
+    for (unsigned i = 0; i < requests; ++i) {
+        if (query(port, configuration.fastOpen > 0, first, last)) {
+            firsts.push_back(first);
+            lasts.push_back(last);
+        }
+    }
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+
+    if (firsts.empty()) {
+        std::printf("%-24s failed\n", configuration.name);
+        return;
+    }
+
+    std::printf("%-24s %8u %10.0f %10.0f %10.0f %10.0f\n", configuration.name, static_cast<unsigned>(firsts.size()), percentile(firsts, 0.5), percentile(firsts, 0.99), percentile(lasts, 0.5), percentile(lasts, 0.99));
+}
+
+int main(int argc, char* argv[]) {
+    unsigned requests = 2000;
+    if (argc > 1) {
+        requests = std::strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        bodySize = std::strtoul(argv[2], NULL, 10);
+    }
+
+    std::ifstream sysctl("/proc/sys/net/ipv4/tcp_fastopen");
+    int fastOpen = 0;
+    if (!(sysctl >> fastOpen) || (fastOpen & 3) != 3) {
+        std::printf("note: TCP Fast Open needs net.ipv4.tcp_fastopen=3 to take effect\n");
+    }
+
+    std::printf("%u requests, %u bytes body, times in microseconds\n", requests, static_cast<unsigned>(bodySize));
+    std::printf("%-24s %8s %10s %10s %10s %10s\n", "options", "ok", "first p50", "first p99", "last p50", "last p99");
+    for (size_t i = 0; i < sizeof(configurations) / sizeof(configurations[0]); ++i) {
+        run(configurations[i], PORT + i, requests);
+    }
+
+    return 0;
+}
@@ -28,9 +28,24 @@
 
 #define PORT 8080
 
+static void echo(const mhttpd::Request& q, mhttpd::Response& r) {
+    mhttpd::WebSocket ws(q, r);
+    std::string message;
+    mhttpd::WebSocket::Type type;
+
+    while (ws.receive(message, type)) {
+        ws.send(message, type);
+    }
+}
+
 static void handle(const mhttpd::Request& q, mhttpd::Response& r) {
     mhttpd::Log() << q.type << " " << q.path;
 
+    if (q.fields.count("Upgrade") && q.fields.find("Upgrade")->second == "websocket") {
+        echo(q, r);
+        return;
+    }
+
     r.statusCode = 200;
     r.statusMessage = "OK";
     r.contentType = "text/html; charset=ISO-8859-1";
@@ -41,7 +56,7 @@ static void handle(const mhttpd::Request& q, mhttpd::Response& r) {
     r << " </head>\n";
     r << " <body>\n";
     r << "  <h1>mhttpd demo</h1>\n";
-    r << "  <p>Your IP and port: " << q.ip[0] << "." << q.ip[1] << "." << q.ip[2] << "." << q.ip[3] << ":" << q.port << "</p>\n";
+    r << "  <p>Your address and port: " << q.address << ":" << q.port << "</p>\n";
     r << "  <p>Your request was of type " << q.type << "</p>\n";
     r << "  <p>Your request version was " << q.version << "</p>\n";
     r << "  <p>Your request path was " << mhttpd::htmlspecialchars(q.path) << "</p>\n";
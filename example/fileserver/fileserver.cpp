@@ -38,6 +38,13 @@
 
 const char* basepath;
 
+#ifdef EMBEDDED
+/* generated by mhttpd-embed, see Makefile */
+extern const mhttpd::Asset assets[];
+extern const size_t assets_count;
+static const mhttpd::Assets embedded(assets, assets_count);
+#endif
+
 static bool endsWith(const std::string& path, const std::string& suffix) {
     if (suffix.length() > path.length()) {
         return false;
@@ -95,10 +102,10 @@ static bool handle(const std::string& path, mhttpd::Response& r) {
         r.statusCode = 200;
         r.statusMessage = "OK";
 
-        std::ifstream file(path.c_str());
-        int i;
-        while ((i = file.get()) != std::char_traits<char>::eof()) {
-            r.put(i);
+        std::ifstream file(path.c_str(), std::ios::binary);
+        char buffer[65536];
+        while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+            r.write(buffer, file.gcount());
         }
 
         return true;
@@ -128,6 +135,12 @@ static bool handle(const std::string& path, mhttpd::Response& r) {
 static void handle(const mhttpd::Request& q, mhttpd::Response& r) {
     mhttpd::Log(q) << q.type << " " << q.path;
 
+#ifdef EMBEDDED
+    if (embedded.serve(q, r)) {
+        return;
+    }
+#endif
+
     if (q.type != "GET") {
         /* defaults to 501 / not implemented */
         return;
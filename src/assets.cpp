@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>       /* errno */
+#include <cstring>      /* std::strcmp(), std::strlen() */
+#include <sstream>      /* std::stringstream */
+
+#include <sys/uio.h>    /* writev() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Write all of two buffers, the header and the body, with as few system calls as possible. */
+static bool assets_send(int sock, const char* header, size_t headerLength, const unsigned char* body, size_t length) {
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char*>(header);
+    iov[0].iov_len = headerLength;
+    iov[1].iov_base = const_cast<unsigned char*>(body);
+    iov[1].iov_len = length;
+
+    struct iovec* next = iov;
+    int remaining = length ? 2 : 1;
+    while (remaining > 0) {
+        const ssize_t bytes = writev(sock, next, remaining);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        size_t written = bytes;
+        while (remaining > 0 && written >= next->iov_len) {
+            written -= next->iov_len;
+            ++next;
+            --remaining;
+        }
+
+        if (remaining > 0) {
+            next->iov_base = static_cast<char*>(next->iov_base) + written;
+            next->iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+Assets::Assets(const Asset* assets, size_t count) :
+        assets(assets), count(count) {
+}
+
+const Asset* Assets::find(const std::string& path) const {
+    size_t low = 0;
+    size_t high = count;
+
+    /* the table is sorted by mhttpd-embed */
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const int order = std::strcmp(assets[middle].path, path.c_str());
+        if (order == 0) {
+            return &assets[middle];
+        }
+
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return NULL;
+}
+
+bool Assets::serve(const Request& request, Response& response) const {
+    if (request.type != "GET" && request.type != "HEAD") {
+        return false;
+    }
+
+    const Asset* asset = find(request.path.empty() || request.path[request.path.size() - 1] == '/' ? request.path + "index.html" : request.path);
+    if (asset == NULL) {
+        return false;
+    }
+
+    std::map<std::string, std::string>::const_iterator it = request.fields.find("If-None-Match");
+    if (it != request.fields.end() && (it->second.find(asset->etag) != std::string::npos || it->second == "*")) {
+        response.statusCode = 304;
+        response.statusMessage = "Not Modified";
+        response.contentType = asset->contentType;
+        response.fields["ETag"] = asset->etag;
+        return true;
+    }
+
+    it = request.fields.find("Accept-Encoding");
+    const bool gzip = asset->gzipBody && it != request.fields.end() && it->second.find("gzip") != std::string::npos;
+    const bool head = request.type == "HEAD";
+
+    if (Access::of(response).sink == NULL && !Access::of(response).headerSent) {
+        /* plain HTTP/1.x: the precomputed header and the body in one go */
+        const char* header = gzip ? asset->gzipHeader : asset->header;
+        Access::of(response).headerSent = true;
+        Access::of(response).failed = !assets_send(Access::of(response).sock, header, std::strlen(header), gzip ? asset->gzipBody : asset->body, head ? 0 : gzip ? asset->gzipLength : asset->length);
+        return true;
+    }
+
+    /* e.g. a HTTP/2 stream: fill in the response as usual */
+    std::stringstream length;
+    length << (gzip ? asset->gzipLength : asset->length);
+    response.statusCode = 200;
+    response.statusMessage = "OK";
+    response.contentType = asset->contentType;
+    response.fields["Content-Length"] = length.str();
+    response.fields["ETag"] = asset->etag;
+    if (asset->gzipBody) {
+        response.fields["Vary"] = "Accept-Encoding";
+    }
+    if (gzip) {
+        response.fields["Content-Encoding"] = "gzip";
+    }
+
+    if (!head) {
+        response.write(reinterpret_cast<const char*>(gzip ? asset->gzipBody : asset->body), gzip ? asset->gzipLength : asset->length);
+    }
+
+    return true;
+}
+
+} /* namespace mhttpd */
@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>    /* std::find(), std::transform() */
+#include <cctype>       /* tolower() */
+#include <cstdlib>      /* std::strtoul() */
+#include <ctime>        /* std::time() */
+#include <deque>        /* std::deque */
+#include <map>          /* std::map */
+#include <sstream>      /* std::stringstream */
+#include <vector>       /* std::vector */
+
+#include <strings.h>    /* strcasecmp() */
+#include <sys/socket.h> /* shutdown() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Answers of the server process to MESSAGE_LOOKUP. */
+enum Lookup {
+    /** Serve the attached response. */
+    CACHE_HIT,
+
+    /** Serve the attached, expired response, then run the handler and store the result. */
+    CACHE_REFRESH,
+
+    /** Run the handler, store the result and serve it. */
+    CACHE_MISS,
+
+    /** Run the handler without storing the result. */
+    CACHE_BYPASS
+};
+
+/** Space needed in a message besides the response. */
+static const size_t cache_overhead = 1024;
+
+/** Cached response, as seen by the server process. */
+struct Entry {
+    Entry() :
+            expires(0), stale(0), owner(-1) {
+    }
+
+    /** Serialized response, empty if there is none yet. */
+    std::string response;
+
+    /** Time the response expires. */
+    time_t expires;
+
+    /** Time the response may no longer be served while refreshing it. */
+    time_t stale;
+
+    /** Channel of the worker computing the response, -1 if none. */
+    int owner;
+
+    /** Channels of workers waiting for the response. */
+    std::deque<int> waiters;
+};
+
+/** Entries of one cache in the server process. */
+class Store {
+public:
+    Store(const Cache& cache) :
+            cache(cache), size(0) {
+    }
+
+    const Cache& cache;
+
+    std::map<std::string, Entry> entries;
+
+    /** Sum of the sizes of all responses. */
+    size_t size;
+
+    /** Replace the response of an entry. */
+    void assign(Entry& entry, const std::string& response) {
+        size -= entry.response.size();
+        entry.response = response;
+        size += entry.response.size();
+    }
+
+    /** Drop entries nobody is interested in anymore and make room. */
+    void evict(time_t now) {
+        std::map<std::string, Entry>::iterator it = entries.begin();
+        while (it != entries.end()) {
+            Entry& entry = it->second;
+            if (entry.owner < 0 && entry.waiters.empty() && entry.stale <= now) {
+                size -= entry.response.size();
+                entries.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+
+        /* micro caches are small, a linear search for the oldest is fine */
+        while (size > cache.maxSize) {
+            std::map<std::string, Entry>::iterator oldest = entries.end();
+            for (it = entries.begin(); it != entries.end(); ++it) {
+                if (!it->second.response.empty() && (oldest == entries.end() || it->second.stale < oldest->second.stale)) {
+                    oldest = it;
+                }
+            }
+
+            if (oldest == entries.end()) {
+                break;
+            }
+
+            assign(oldest->second, std::string());
+            if (oldest->second.owner < 0 && oldest->second.waiters.empty()) {
+                entries.erase(oldest);
+            }
+        }
+    }
+};
+
+/** Entry a channel is owner of or waiting for. A worker may own several, e.g. nested cached routes, but waits for one at most. */
+struct Pending {
+    size_t store;
+
+    std::string key;
+};
+
+/** All stores, by id. Caches are usually global, so avoid initialization order issues. */
+static std::vector<Store*>& cache_registry() {
+    static std::vector<Store*> registry;
+    return registry;
+}
+
+static std::multimap<int, Pending> cache_pending;
+
+/** Find the pending entry of a channel for a key, cache_pending.end() if there is none. */
+static std::multimap<int, Pending>::iterator findpending(int channel, size_t store, const std::string& key) {
+    std::pair<std::multimap<int, Pending>::iterator, std::multimap<int, Pending>::iterator> range = cache_pending.equal_range(channel);
+    for (std::multimap<int, Pending>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second.store == store && it->second.key == key) {
+            return it;
+        }
+    }
+
+    return cache_pending.end();
+}
+
+static void cachereply(int channel, Lookup status, const std::string& response) {
+    std::string reply(1, MESSAGE_LOOKUP);
+    putnumber(reply, status);
+    putstring(reply, response);
+    supervisorreply(channel, reply);
+}
+
+static Store* findstore(unsigned long id) {
+    if (id >= cache_registry().size()) {
+        return NULL;
+    }
+
+    return cache_registry()[id];
+}
+
+void cachelookup(const std::string& message, int channel) {
+    size_t pos = 1;
+    unsigned long id;
+    std::string key;
+    Store* store;
+
+    if (!getnumber(message, pos, id) || !getstring(message, pos, key) || (store = findstore(id)) == NULL) {
+        cachereply(channel, CACHE_BYPASS, std::string());
+        return;
+    }
+
+    const time_t now = std::time(NULL);
+    Entry& entry = store->entries[key];
+    Pending pending = { id, key };
+
+    if (!entry.response.empty() && now < entry.expires) {
+        cachereply(channel, CACHE_HIT, entry.response);
+    } else if (!entry.response.empty() && now < entry.stale) {
+        if (entry.owner < 0) {
+            entry.owner = channel;
+            cache_pending.insert(std::make_pair(channel, pending));
+            cachereply(channel, CACHE_REFRESH, entry.response);
+        } else {
+            cachereply(channel, CACHE_HIT, entry.response);
+        }
+    } else if (entry.owner < 0) {
+        entry.owner = channel;
+        cache_pending.insert(std::make_pair(channel, pending));
+        cachereply(channel, CACHE_MISS, std::string());
+    } else if (entry.owner == channel) {
+        /* the worker computing the response asks again, it would wait for itself */
+        cachereply(channel, CACHE_BYPASS, std::string());
+    } else {
+        /* coalesce, answered once the owner stores the response */
+        entry.waiters.push_back(channel);
+        cache_pending.insert(std::make_pair(channel, pending));
+    }
+}
+
+void cachestore(const std::string& message, int channel) {
+    size_t pos = 1;
+    unsigned long id;
+    std::string key;
+    unsigned long ttl;
+    unsigned long stale;
+    unsigned long cacheable;
+    std::string response;
+    Store* store;
+
+    if (!getnumber(message, pos, id) || !getstring(message, pos, key) || !getnumber(message, pos, ttl) || !getnumber(message, pos, stale) || !getnumber(message, pos, cacheable) || !getstring(message, pos, response) || (store = findstore(id)) == NULL) {
+        return;
+    }
+
+    /* only the worker the key was handed to by cachelookup() may store it */
+    std::multimap<int, Pending>::iterator pending = findpending(channel, id, key);
+    if (pending == cache_pending.end()) {
+        return;
+    }
+
+    std::map<std::string, Entry>::iterator it = store->entries.find(key);
+    if (it == store->entries.end() || it->second.owner != channel) {
+        return;
+    }
+
+    const time_t now = std::time(NULL);
+    Entry& entry = it->second;
+    entry.owner = -1;
+    cache_pending.erase(pending);
+
+    if (cacheable) {
+        store->assign(entry, response);
+        entry.expires = now + ttl;
+        entry.stale = entry.expires + stale;
+    }
+
+    /* waiters share the response even if it is not stored, it is empty if withheld */
+    while (!entry.waiters.empty()) {
+        const int waiter = entry.waiters.front();
+        entry.waiters.pop_front();
+        std::multimap<int, Pending>::iterator waiting = findpending(waiter, id, key);
+        if (waiting != cache_pending.end()) {
+            cache_pending.erase(waiting);
+        }
+        cachereply(waiter, response.empty() ? CACHE_BYPASS : CACHE_HIT, response);
+    }
+
+    store->evict(now);
+}
+
+void cachecancel(int channel) {
+    std::pair<std::multimap<int, Pending>::iterator, std::multimap<int, Pending>::iterator> range = cache_pending.equal_range(channel);
+    for (std::multimap<int, Pending>::iterator pending = range.first; pending != range.second; ++pending) {
+        Store* store = findstore(pending->second.store);
+        if (store == NULL || store->entries.count(pending->second.key) == 0) {
+            continue;
+        }
+
+        /* entries the worker owns were answered with CACHE_MISS already, find the one it waits for */
+        std::deque<int>& waiters = store->entries[pending->second.key].waiters;
+        std::deque<int>::iterator waiter = std::find(waiters.begin(), waiters.end(), channel);
+        if (waiter != waiters.end()) {
+            waiters.erase(waiter);
+            cache_pending.erase(pending);
+            cachereply(channel, CACHE_BYPASS, std::string());
+            return;
+        }
+    }
+
+    /* answered already, the worker receives that answer instead */
+}
+
+void cacheclosed(int channel) {
+    std::pair<std::multimap<int, Pending>::iterator, std::multimap<int, Pending>::iterator> range = cache_pending.equal_range(channel);
+    std::vector<Pending> pendings;
+    for (std::multimap<int, Pending>::iterator it = range.first; it != range.second; ++it) {
+        pendings.push_back(it->second);
+    }
+    cache_pending.erase(range.first, range.second);
+
+    for (std::vector<Pending>::const_iterator pending = pendings.begin(); pending != pendings.end(); ++pending) {
+        Store* store = findstore(pending->store);
+        if (store == NULL || store->entries.count(pending->key) == 0) {
+            continue;
+        }
+
+        Entry& entry = store->entries[pending->key];
+        if (entry.owner == channel) {
+            /* the worker died computing the response, let the next one try */
+            entry.owner = -1;
+            if (!entry.waiters.empty()) {
+                entry.owner = entry.waiters.front();
+                entry.waiters.pop_front();
+                cachereply(entry.owner, CACHE_MISS, std::string());
+            }
+        } else {
+            for (std::deque<int>::iterator it = entry.waiters.begin(); it != entry.waiters.end(); ++it) {
+                if (*it == channel) {
+                    entry.waiters.erase(it);
+                    break;
+                }
+            }
+        }
+
+        store->evict(std::time(NULL));
+    }
+}
+
+/** Collects a response as HTTP/1.1 message. */
+class Capture: public Sink {
+public:
+    Capture() :
+            statusCode(0), personal(false) {
+    }
+
+    void header(const Response& response) {
+        statusCode = response.statusCode;
+
+        std::stringstream stream;
+        stream << response.version << " " << response.statusCode << " " << response.statusMessage << "\r\n";
+        stream << "Content-Type: " << response.contentType << "\r\n";
+        stream << "Connection: Close\r\n";
+
+        for (std::map<std::string, std::string>::const_iterator it = response.fields.begin(); it != response.fields.end(); ++it) {
+            if (strcasecmp(it->first.c_str(), "Content-Length") == 0) {
+                continue;
+            }
+
+            std::string value = it->second;
+            std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+
+            if (strcasecmp(it->first.c_str(), "Set-Cookie") == 0 || (strcasecmp(it->first.c_str(), "Cache-Control") == 0 && (value.find("no-store") != std::string::npos || value.find("private") != std::string::npos))) {
+                /* meant for a single client */
+                personal = true;
+            }
+
+            if (strcasecmp(it->first.c_str(), "Vary") == 0) {
+                /* depends on request fields the key does not cover, e.g. gzip for some clients only */
+                personal = true;
+            }
+
+            stream << it->first << ": " << it->second << "\r\n";
+        }
+
+        head = stream.str();
+    }
+
+    void body(const char* buffer, size_t length) {
+        data.append(buffer, length);
+    }
+
+    void finish() {
+    }
+
+    /** The whole response, with a Content-Length so clients need not wait for the end of the connection. */
+    std::string message() const {
+        std::stringstream stream;
+        stream << head << "Content-Length: " << data.size() << "\r\n\r\n";
+        return stream.str() + data;
+    }
+
+    /** Check if the response may be served to other clients, too. */
+    bool shareable() const {
+        return !personal;
+    }
+
+    /** Check for a status code that is cacheable by default, see RFC 7231 section 6.1. */
+    bool cacheable() const {
+        if (personal) {
+            return false;
+        }
+
+        switch (statusCode) {
+        case 200:
+        case 203:
+        case 204:
+        case 300:
+        case 301:
+        case 404:
+        case 405:
+        case 410:
+        case 414:
+        case 501:
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+private:
+    unsigned statusCode;
+
+    /** Set if the response must not be served to other clients. */
+    bool personal;
+
+    std::string head;
+
+    std::string data;
+};
+
+/**
+ * Wait for the answer to a lookup. A worker that waited too long withdraws;
+ * the server process then answers with CACHE_BYPASS, unless the answer is on
+ * its way already.
+ * @param timeout in milliseconds, -1 to wait forever
+ */
+static bool cachereceive(std::string& reply, int& fd, int timeout) {
+    if (supervisorreceive(reply, fd, timeout)) {
+        return true;
+    }
+
+    return supervisorsend(std::string(1, MESSAGE_CANCEL)) && supervisorreceive(reply, fd);
+}
+
+/** Answer a request with a serialized response. */
+static void replay(const std::string& message, Response& response) {
+    const size_t end = message.find("\r\n\r\n");
+
+    if (Access::of(response).sink == NULL) {
+        /* plain HTTP/1.x, the message can be sent as is */
+        Access::of(response).headerSent = true;
+        Access::of(response).write(message.data(), message.size());
+        Access::of(response).flush(response);
+        shutdown(Access::of(response).sock, SHUT_WR);
+        return;
+    }
+
+    size_t pos = message.find("\r\n");
+    const std::string status = message.substr(0, pos);
+    const size_t first = status.find(' ');
+    const size_t second = status.find(' ', first + 1);
+    response.statusCode = std::strtoul(status.substr(first + 1, second - first - 1).c_str(), NULL, 10);
+    response.statusMessage = second == std::string::npos ? std::string() : status.substr(second + 1);
+
+    while (pos < end) {
+        const size_t next = message.find("\r\n", pos + 2);
+        const std::string line = message.substr(pos + 2, next - pos - 2);
+        const size_t colon = line.find(": ");
+        const std::string name = line.substr(0, colon);
+        pos = next;
+
+        if (colon == std::string::npos || name == "Connection") {
+            continue;
+        }
+
+        if (name == "Content-Type") {
+            response.contentType = line.substr(colon + 2);
+        } else {
+            response.fields[name] = line.substr(colon + 2);
+        }
+    }
+
+    response.write(message.data() + end + 4, message.size() - end - 4);
+
+    /* end the stream now, the handler may still be busy refreshing the entry */
+    Access::of(response).flush(response);
+    Access::of(response).sink->finish();
+    Access::of(response).sink = NULL;
+}
+
+/** Per route settings. */
+struct Route {
+    unsigned ttl;
+
+    unsigned stale;
+};
+
+class Cache::Implementation: public Store {
+public:
+    Implementation(const Cache& cache, handler_t handler) :
+            Store(cache), handler(handler), id(cache_registry().size()) {
+        cache_registry().push_back(this);
+    }
+
+    ~Implementation() {
+        cache_registry()[id] = NULL;
+    }
+
+    const handler_t handler;
+
+    /** Index in cache_registry, identifies the cache in messages. */
+    const size_t id;
+
+    /** Routes by path prefix. */
+    std::map<std::string, Route> routes;
+
+    /** Find the route with the longest prefix of path. */
+    const Route* find(const std::string& path) const {
+        const Route* route = NULL;
+        size_t length = 0;
+
+        for (std::map<std::string, Route>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+            if (it->first.size() >= length && path.compare(0, it->first.size(), it->first) == 0) {
+                route = &it->second;
+                length = it->first.size();
+            }
+        }
+
+        return route;
+    }
+
+    /** Run the handler and hand the result to the server process. */
+    std::string compute(const Request& request, const std::string& key, const Route& route) const {
+        Capture capture;
+        {
+            Response response(-1);
+            Access::of(response).sink = &capture;
+            handler(request, response);
+        }
+
+        std::string message = capture.message();
+        const bool shareable = capture.shareable() && message.size() + key.size() + cache_overhead <= max_message;
+        const bool cacheable = shareable && capture.cacheable();
+
+        std::string store(1, MESSAGE_STORE);
+        putnumber(store, id);
+        putstring(store, key);
+        putnumber(store, route.ttl);
+        putnumber(store, route.stale);
+        putnumber(store, cacheable);
+        putstring(store, shareable ? message : std::string());
+        supervisorsend(store);
+
+        return message;
+    }
+};
+
+Cache::Cache(handler_t handler) :
+        maxSize(16 * 1024 * 1024), maxWait(10), implementation(new Implementation(*this, handler)) {
+}
+
+Cache::~Cache() {
+    delete implementation;
+}
+
+void Cache::route(const std::string& prefix, unsigned ttl, unsigned stale) {
+    Route route = { ttl, stale };
+    implementation->routes[prefix] = route;
+}
+
+void Cache::serve(const Request& request, Response& response) const {
+    const Route* route = implementation->find(request.path);
+
+    if (route == NULL || (request.type != "GET" && request.type != "HEAD")) {
+        implementation->handler(request, response);
+        return;
+    }
+
+    /* parameters are sorted by name already */
+    std::string key;
+    putstring(key, request.type);
+    putstring(key, request.path);
+    for (std::multimap<std::string, std::string>::const_iterator it = request.parameters.begin(); it != request.parameters.end(); ++it) {
+        putstring(key, it->first);
+        putstring(key, it->second);
+    }
+
+    std::string message(1, MESSAGE_LOOKUP);
+    putnumber(message, implementation->id);
+    putstring(message, key);
+
+    std::string reply;
+    std::string cached;
+    int fd = -1;
+    size_t pos = 1;
+    unsigned long status = CACHE_BYPASS;
+
+    if (key.size() + cache_overhead > max_message || !supervisorsend(message) || !cachereceive(reply, fd, maxWait ? static_cast<int>(maxWait * 1000) : -1) || !getnumber(reply, pos, status) || !getstring(reply, pos, cached)) {
+        /* no server process to ask, e.g. called outside of Server::start() */
+        status = CACHE_BYPASS;
+    }
+
+    switch (status) {
+    case CACHE_HIT:
+        replay(cached, response);
+        break;
+
+    case CACHE_REFRESH:
+        replay(cached, response);
+        implementation->compute(request, key, *route);
+        break;
+
+    case CACHE_MISS:
+        replay(implementation->compute(request, key, *route), response);
+        break;
+
+    default:
+        implementation->handler(request, response);
+        break;
+    }
+}
+
+} /* namespace mhttpd */
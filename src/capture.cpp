@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Traffic capture log. The file starts with the eight bytes "mhttpdc1",
+ * followed by records of a 20 byte header and optional data. All numbers are
+ * little endian:
+ *
+ *   offset  size  field
+ *        0     4  length of the data following the header
+ *        4     2  shard
+ *        6     1  type: 1 connection accepted, 2 data received, 3 closed
+ *        7     1  reserved, 0
+ *        8     4  connection, numbered per shard
+ *       12     8  nanoseconds since the capture was enabled
+ *
+ * Records of all processes are appended with a single system call each, so
+ * records of concurrent connections interleave, but are never torn.
+ */
+
+#include <cstdio>       /* std::perror() */
+
+#include <fcntl.h>      /* open() */
+#include <sys/uio.h>    /* writev() */
+#include <time.h>       /* clock_gettime() */
+#include <unistd.h>     /* write(), close() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+enum CaptureType {
+    CAPTURE_OPEN = 1, CAPTURE_DATA, CAPTURE_CLOSE
+};
+
+static const size_t capture_header = 20;
+
+/** Log file, -1 unless capturing. */
+static int capture_fd = -1;
+
+/** Time the capture was enabled, in nanoseconds. */
+static unsigned long capture_start = 0;
+
+static unsigned long capture_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/** Store a number as count bytes, little endian. */
+static void capture_put(unsigned char* output, unsigned long value, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        output[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static void capture_record(CaptureType type, unsigned long connection, const char* data, size_t length) {
+    if (capture_fd < 0) {
+        return;
+    }
+
+    unsigned char header[capture_header];
+    capture_put(header, length, 4);
+    capture_put(header + 4, Shard::current().index, 2);
+    header[6] = type;
+    header[7] = 0;
+    capture_put(header + 8, connection, 4);
+    capture_put(header + 12, capture_now() - capture_start, 8);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<char*>(data);
+    iov[1].iov_len = length;
+
+    /* O_APPEND, a single call keeps the record in one piece */
+    if (writev(capture_fd, iov, length ? 2 : 1) < 0) {
+        std::perror("capture failed");
+    }
+}
+
+bool Traffic::capture(const std::string& path) {
+    if (capture_fd >= 0) {
+        return true;
+    }
+
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::perror("open() failed");
+        return false;
+    }
+
+    if (write(fd, "mhttpdc1", 8) != 8) {
+        std::perror("write() failed");
+        close(fd);
+        return false;
+    }
+
+    capture_start = capture_now();
+    capture_fd = fd;
+    return true;
+}
+
+void captureopen(unsigned long connection) {
+    capture_record(CAPTURE_OPEN, connection, NULL, 0);
+}
+
+void capturedata(unsigned long connection, const char* data, size_t length) {
+    capture_record(CAPTURE_DATA, connection, data, length);
+}
+
+void captureclose(unsigned long connection) {
+    capture_record(CAPTURE_CLOSE, connection, NULL, 0);
+}
+
+} /* namespace mhttpd */
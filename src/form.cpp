@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>       /* std::perror() */
+#include <cstdlib>      /* std::strtoul(), mkstemp() */
+#include <cstring>      /* std::memcmp() */
+#include <vector>       /* std::vector */
+
+#include <unistd.h>     /* write(), close(), unlink() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Bytes read from the client at once. */
+static const size_t form_block = 65536;
+
+/** Maximum size of the header of a part. */
+static const size_t form_max_header = 16384;
+
+/**
+ * Substring search with the Boyer-Moore-Horspool algorithm. The delimiter
+ * between parts is searched in every byte of the body, and the skip table
+ * lets the search jump up to the length of the delimiter ahead at a time.
+ */
+class Horspool {
+public:
+    Horspool(const std::string& needle) :
+            needle(needle) {
+        for (size_t i = 0; i < 256; ++i) {
+            skip[i] = needle.size();
+        }
+
+        for (size_t i = 0; i + 1 < needle.size(); ++i) {
+            skip[static_cast<unsigned char>(needle[i])] = needle.size() - 1 - i;
+        }
+    }
+
+    /** Find the needle, returns std::string::npos if not found. */
+    size_t find(const char* haystack, size_t length) const {
+        const size_t n = needle.size();
+        const unsigned char last = needle[n - 1];
+
+        for (size_t pos = 0; pos + n <= length;) {
+            const unsigned char c = haystack[pos + n - 1];
+            if (c == last && std::memcmp(haystack + pos, needle.data(), n - 1) == 0) {
+                return pos;
+            }
+            pos += skip[c];
+        }
+
+        return std::string::npos;
+    }
+
+    const std::string needle;
+
+private:
+    size_t skip[256];
+};
+
+/** Get a parameter of a header field value, e.g. name from 'form-data; name="a"'. */
+static std::string fieldparameter(const std::string& value, const std::string& parameter) {
+    size_t pos = 0;
+
+    while ((pos = value.find(';', pos)) != std::string::npos) {
+        pos = value.find_first_not_of(" \t", pos + 1);
+        if (pos == std::string::npos) {
+            break;
+        }
+
+        const size_t equals = value.find('=', pos);
+        if (equals == std::string::npos) {
+            break;
+        }
+
+        std::string name = value.substr(pos, equals - pos);
+        for (std::string::iterator it = name.begin(); it != name.end(); ++it) {
+            *it = (*it >= 'A' && *it <= 'Z') ? *it - 'A' + 'a' : *it;
+        }
+
+        std::string result;
+        pos = equals + 1;
+        if (pos < value.size() && value[pos] == '"') {
+            /* quoted string, see RFC 7230 section 3.2.6 */
+            for (pos += 1; pos < value.size() && value[pos] != '"'; ++pos) {
+                if (value[pos] == '\\' && pos + 1 < value.size()) {
+                    pos += 1;
+                }
+                result += value[pos];
+            }
+        } else {
+            const size_t end = value.find(';', pos);
+            result = value.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+            result.erase(result.find_last_not_of(" \t") + 1);
+        }
+
+        if (name == parameter) {
+            return result;
+        }
+    }
+
+    return std::string();
+}
+
+class Form::Implementation {
+public:
+    Implementation(const Request& request) :
+            request(const_cast<Request&>(request)), remaining(0), callback(NULL), context(NULL), fd(-1) {
+    }
+
+    ~Implementation() {
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        for (std::vector<File>::const_iterator it = files.begin(); it != files.end(); ++it) {
+            if (!it->path.empty()) {
+                unlink(it->path.c_str());
+            }
+        }
+    }
+
+    /** The parser fills in the parameters of the request. */
+    Request& request;
+
+    /** Body bytes not read yet. */
+    size_t remaining;
+
+    callback_t callback;
+
+    void* context;
+
+    std::vector<File> files;
+
+    /** Temporary file of the current part, -1 if none. */
+    int fd;
+
+    /** Read the next block of the body, returns false at the end. */
+    bool fill(std::string& buffer) {
+        if (remaining == 0) {
+            return false;
+        }
+
+        char block[form_block];
+        const size_t bytes = request.read(block, remaining < sizeof(block) ? remaining : sizeof(block));
+        if (bytes == 0 || bytes == static_cast<size_t>(-1)) {
+            remaining = 0;
+            return false;
+        }
+
+        buffer.append(block, bytes);
+        remaining -= bytes;
+        return true;
+    }
+
+    bool urlencoded(const Form& form) {
+        std::string buffer;
+        std::string pair;
+
+        while (fill(buffer)) {
+            size_t pos = 0;
+            size_t end;
+
+            while ((end = buffer.find('&', pos)) != std::string::npos) {
+                pair.append(buffer, pos, end - pos);
+                parseparameters(pair, request.parameters);
+                pair.clear();
+                pos = end + 1;
+            }
+
+            pair.append(buffer, pos, std::string::npos);
+            buffer.clear();
+            if (pair.size() > form.maxFieldSize) {
+                return false;
+            }
+        }
+
+        parseparameters(pair, request.parameters);
+        return true;
+    }
+
+    bool multipart(const Form& form, const std::string& boundary) {
+        /* the leading line break lets the first delimiter match like all others */
+        const Horspool delimiter("\r\n--" + boundary);
+        std::string buffer("\r\n");
+        size_t pos = 0;
+        bool more = true;
+
+        enum {
+            PREAMBLE, DELIMITER, HEADER, FIELD, UPLOAD
+        } state = PREAMBLE;
+
+        std::string name;
+        std::string value;
+
+        for (;;) {
+            bool progress = false;
+
+            if (state == PREAMBLE || state == FIELD || state == UPLOAD) {
+                const size_t length = buffer.size() - pos;
+                const size_t found = delimiter.find(buffer.data() + pos, length);
+                const size_t keep = delimiter.needle.size() - 1;
+
+                /* everything before the delimiter, or that cannot be part of one, is data */
+                const size_t data = found != std::string::npos ? found : (length > keep ? length - keep : 0);
+                if (data > 0) {
+                    if (state == FIELD) {
+                        value.append(buffer, pos, data);
+                        if (value.size() > form.maxFieldSize) {
+                            return false;
+                        }
+                    } else if (state == UPLOAD && !emit(buffer.data() + pos, data)) {
+                        return false;
+                    }
+                    pos += data;
+                    progress = true;
+                }
+
+                if (found != std::string::npos) {
+                    if (state == FIELD) {
+                        request.parameters.insert(std::make_pair(name, value));
+                    } else if (state == UPLOAD && !finish()) {
+                        return false;
+                    }
+
+                    pos += delimiter.needle.size();
+                    state = DELIMITER;
+                    progress = true;
+                }
+            } else if (state == DELIMITER) {
+                /* "--" ends the body, otherwise skip to the end of the line */
+                if (buffer.size() - pos >= 2 && buffer.compare(pos, 2, "--") == 0) {
+                    return true;
+                }
+
+                const size_t end = buffer.find("\r\n", pos);
+                if (end != std::string::npos) {
+                    pos = end + 2;
+                    state = HEADER;
+                    progress = true;
+                } else if (buffer.size() - pos > form_max_header) {
+                    return false;
+                }
+            } else if (state == HEADER) {
+                const size_t end = buffer.find("\r\n\r\n", pos - 2);
+                if (end != std::string::npos) {
+                    File file;
+                    if (!header(buffer.substr(pos - 2, end - pos + 2), file)) {
+                        return false;
+                    }
+
+                    pos = end + 4;
+                    name = file.name;
+                    value.clear();
+                    state = FIELD;
+
+                    if (!file.filename.empty() || !file.contentType.empty()) {
+                        request.parameters.insert(std::make_pair(file.name, file.filename));
+                        if (!start(form, file)) {
+                            return false;
+                        }
+                        state = UPLOAD;
+                    }
+                    progress = true;
+                } else if (buffer.size() - pos > form_max_header) {
+                    return false;
+                }
+            }
+
+            if (!progress) {
+                if (!more) {
+                    /* body ended before the closing delimiter */
+                    return false;
+                }
+
+                /* drop what was processed, keeping memory use bounded */
+                const size_t drop = state == HEADER ? pos - 2 : pos;
+                buffer.erase(0, drop);
+                pos -= drop;
+                more = fill(buffer);
+            }
+        }
+    }
+
+private:
+    /** Parse the header of a part, starting with "\r\n". */
+    bool header(const std::string& block, File& file) {
+        size_t pos = 0;
+        std::string disposition;
+
+        while (pos < block.size()) {
+            /* each line starts with the line break of the previous one */
+            const size_t end = block.find("\r\n", pos + 2);
+            const std::string line = block.substr(pos + 2, end == std::string::npos ? std::string::npos : end - pos - 2);
+            pos = end == std::string::npos ? block.size() : end;
+
+            const size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+
+            std::string key = line.substr(0, colon);
+            for (std::string::iterator it = key.begin(); it != key.end(); ++it) {
+                *it = (*it >= 'A' && *it <= 'Z') ? *it - 'A' + 'a' : *it;
+            }
+
+            const size_t start = line.find_first_not_of(" \t", colon + 1);
+            const std::string value = start == std::string::npos ? std::string() : line.substr(start);
+
+            if (key == "content-disposition") {
+                disposition = value;
+            } else if (key == "content-type") {
+                file.contentType = value;
+            }
+        }
+
+        if (disposition.compare(0, 9, "form-data") != 0) {
+            return false;
+        }
+
+        file.name = fieldparameter(disposition, "name");
+        file.filename = fieldparameter(disposition, "filename");
+        file.size = 0;
+
+        /* only parts with a file name are files, other content types are still fields */
+        if (file.filename.empty() && disposition.find("filename") == std::string::npos) {
+            file.contentType.clear();
+        }
+
+        return true;
+    }
+
+    bool start(const Form& form, File& file) {
+        if (callback == NULL) {
+            std::string path = form.directory + "/mhttpd-upload-XXXXXX";
+            std::vector<char> name(path.begin(), path.end());
+            name.push_back('\0');
+
+            fd = mkstemp(&name[0]);
+            if (fd < 0) {
+                std::perror("mkstemp() failed");
+                return false;
+            }
+            file.path = &name[0];
+        }
+
+        files.push_back(file);
+        return true;
+    }
+
+    bool emit(const char* data, size_t length) {
+        File& file = files.back();
+        file.size += length;
+
+        if (callback) {
+            return callback(file, data, length, context);
+        }
+
+        while (length > 0) {
+            const ssize_t bytes = write(fd, data, length);
+            if (bytes < 0) {
+                std::perror("write() failed");
+                return false;
+            }
+            data += bytes;
+            length -= bytes;
+        }
+
+        return true;
+    }
+
+    bool finish() {
+        if (callback) {
+            return callback(files.back(), NULL, 0, context);
+        }
+
+        close(fd);
+        fd = -1;
+        return true;
+    }
+};
+
+Form::Form(const Request& request) :
+        maxFieldSize(1024 * 1024), directory("/tmp"), implementation(new Implementation(request)) {
+}
+
+Form::~Form() {
+    delete implementation;
+}
+
+bool Form::parse() {
+    return parse(NULL, NULL);
+}
+
+bool Form::parse(callback_t callback, void* context) {
+    const Request& request = implementation->request;
+    std::map<std::string, std::string>::const_iterator it;
+
+    implementation->callback = callback;
+    implementation->context = context;
+
+    if ((it = request.fields.find("Content-Length")) != request.fields.end()) {
+        implementation->remaining = std::strtoul(it->second.c_str(), NULL, 10);
+    } else if (Access::of(request).sock < 0) {
+        /* HTTP/2, the body is buffered completely */
+        implementation->remaining = Access::of(request).input.size() - Access::of(request).inputPos;
+    }
+
+    if ((it = request.fields.find("Content-Type")) == request.fields.end()) {
+        return false;
+    }
+
+    const std::string& type = it->second;
+    if (type.compare(0, 33, "application/x-www-form-urlencoded") == 0) {
+        return implementation->urlencoded(*this);
+    }
+
+    if (type.compare(0, 19, "multipart/form-data") == 0) {
+        const std::string boundary = fieldparameter(type, "boundary");
+        if (boundary.empty() || boundary.size() > 70) {
+            return false;
+        }
+        return implementation->multipart(*this, boundary);
+    }
+
+    return false;
+}
+
+const std::vector<Form::File>& Form::files() const {
+    return implementation->files;
+}
+
+} /* namespace mhttpd */
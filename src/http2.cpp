@@ -0,0 +1,1375 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>    /* std::min() */
+#include <cstdio>       /* BUFSIZ */
+#include <cstring>      /* std::memcmp() */
+#include <deque>        /* std::deque */
+#include <map>          /* std::map */
+#include <sstream>      /* std::stringstream */
+#include <vector>       /* std::vector */
+
+#include <netdb.h>      /* send(), recv() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/* frame types, see RFC 7540 section 6 */
+enum {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+/* frame flags, see RFC 7540 section 6 */
+enum {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20
+};
+
+/* settings, see RFC 7540 section 6.5.2 */
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+    SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+/* error codes, see RFC 7540 section 7 */
+enum {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9
+};
+
+/** Connection preface sent by the client, see RFC 7540 section 3.5. */
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/** Largest frame payload we accept, the protocol default. */
+static const size_t max_frame_size = 16384;
+
+/** Initial flow control window, the protocol default. */
+static const long initial_window_size = 65535;
+
+/** Maximum number of streams the client may open concurrently. */
+static const size_t max_concurrent_streams = 100;
+
+/** Maximum size of a header block, including CONTINUATION frames. */
+static const size_t max_header_block = 65536;
+
+/** Maximum size of a decoded header list, see RFC 7540 section 6.5.2. */
+static const size_t max_header_list = 65536;
+
+/** Maximum size of a request body, bodies are buffered completely. */
+static const size_t max_body = 1024 * 1024;
+
+/**
+ * Maximum size of the request bodies of a connection buffered at the same
+ * time. Flow control credit is only given back within this limit.
+ */
+static const size_t max_buffered = 4 * max_body;
+
+/** Size of the HPACK dynamic table for decoding, the protocol default. */
+static const size_t header_table_size = 4096;
+
+/** HPACK static table, see RFC 7541 appendix A. */
+static const char* const static_table[][2] = {
+    {"", ""},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""}
+};
+
+static const size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]) - 1;
+
+/** Codes of one length in the canonical HPACK huffman code. */
+struct HuffmanLength {
+    unsigned length;
+    unsigned first;
+    unsigned index;
+    unsigned count;
+};
+
+/** Symbols of the HPACK huffman code, sorted by code, see RFC 7541 appendix B. */
+static const unsigned char huffman_symbols[256] = {
+    0x30, 0x31, 0x32, 0x61, 0x63, 0x65, 0x69, 0x6f, 0x73, 0x74, 0x20, 0x25, 0x2d, 0x2e, 0x2f, 0x33,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3d, 0x41, 0x5f, 0x62, 0x64, 0x66, 0x67, 0x68, 0x6c, 0x6d,
+    0x6e, 0x70, 0x72, 0x75, 0x3a, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c,
+    0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x59, 0x6a, 0x6b, 0x71, 0x76,
+    0x77, 0x78, 0x79, 0x7a, 0x26, 0x2a, 0x2c, 0x3b, 0x58, 0x5a, 0x21, 0x22, 0x28, 0x29, 0x3f, 0x27,
+    0x2b, 0x7c, 0x23, 0x3e, 0x00, 0x24, 0x40, 0x5b, 0x5d, 0x7e, 0x5e, 0x7d, 0x3c, 0x60, 0x7b, 0x5c,
+    0xc3, 0xd0, 0x80, 0x82, 0x83, 0xa2, 0xb8, 0xc2, 0xe0, 0xe2, 0x99, 0xa1, 0xa7, 0xac, 0xb0, 0xb1,
+    0xb3, 0xd1, 0xd8, 0xd9, 0xe3, 0xe5, 0xe6, 0x81, 0x84, 0x85, 0x86, 0x88, 0x92, 0x9a, 0x9c, 0xa0,
+    0xa3, 0xa4, 0xa9, 0xaa, 0xad, 0xb2, 0xb5, 0xb9, 0xba, 0xbb, 0xbd, 0xbe, 0xc4, 0xc6, 0xe4, 0xe8,
+    0xe9, 0x01, 0x87, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8f, 0x93, 0x95, 0x96, 0x97, 0x98, 0x9b, 0x9d,
+    0x9e, 0xa5, 0xa6, 0xa8, 0xae, 0xaf, 0xb4, 0xb6, 0xb7, 0xbc, 0xbf, 0xc5, 0xe7, 0xef, 0x09, 0x8e,
+    0x90, 0x91, 0x94, 0x9f, 0xab, 0xce, 0xd7, 0xe1, 0xec, 0xed, 0xc7, 0xcf, 0xea, 0xeb, 0xc0, 0xc1,
+    0xc8, 0xc9, 0xca, 0xcd, 0xd2, 0xd5, 0xda, 0xdb, 0xee, 0xf0, 0xf2, 0xf3, 0xff, 0xcb, 0xcc, 0xd3,
+    0xd4, 0xd6, 0xdd, 0xde, 0xdf, 0xf1, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe,
+    0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x0b, 0x0c, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14,
+    0x15, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x7f, 0xdc, 0xf9, 0x0a, 0x0d, 0x16
+};
+
+/** First code and symbol index per code length. */
+static const HuffmanLength huffman_lengths[] = {
+    {5, 0x00000000, 0, 10},
+    {6, 0x00000014, 10, 26},
+    {7, 0x0000005c, 36, 32},
+    {8, 0x000000f8, 68, 6},
+    {10, 0x000003f8, 74, 5},
+    {11, 0x000007fa, 79, 3},
+    {12, 0x00000ffa, 82, 2},
+    {13, 0x00001ff8, 84, 6},
+    {14, 0x00003ffc, 90, 2},
+    {15, 0x00007ffc, 92, 3},
+    {19, 0x0007fff0, 95, 3},
+    {20, 0x000fffe6, 98, 8},
+    {21, 0x001fffdc, 106, 13},
+    {22, 0x003fffd2, 119, 26},
+    {23, 0x007fffd8, 145, 29},
+    {24, 0x00ffffea, 174, 12},
+    {25, 0x01ffffec, 186, 4},
+    {26, 0x03ffffe0, 190, 15},
+    {27, 0x07ffffde, 205, 19},
+    {28, 0x0fffffe2, 224, 29},
+    {30, 0x3ffffffc, 253, 3}
+};
+
+typedef std::pair<std::string, std::string> Field;
+
+static bool huffmandecode(const std::string& in, std::string& out) {
+    const size_t lengths = sizeof(huffman_lengths) / sizeof(huffman_lengths[0]);
+    unsigned code = 0;
+    unsigned bits = 0;
+    size_t entry = 0;
+
+    for (size_t i = 0; i < in.size(); ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            code = (code << 1) | ((in[i] >> bit) & 1);
+            bits += 1;
+
+            while (entry < lengths && huffman_lengths[entry].length < bits) {
+                entry += 1;
+            }
+
+            if (entry < lengths && huffman_lengths[entry].length == bits && code - huffman_lengths[entry].first < huffman_lengths[entry].count) {
+                out += static_cast<char>(huffman_symbols[huffman_lengths[entry].index + code - huffman_lengths[entry].first]);
+                code = 0;
+                bits = 0;
+                entry = 0;
+            } else if (bits >= 30) {
+                /* EOS or invalid code */
+                return false;
+            }
+        }
+    }
+
+    /* padding must be a prefix of EOS, at most 7 bits */
+    return bits < 8 && code == (1u << bits) - 1;
+}
+
+/** HPACK decoder, see RFC 7541. */
+class Hpack {
+public:
+    Hpack() :
+            size(0), maxSize(header_table_size) {
+    }
+
+    /**
+     * Decode a header block. Fails once the decoded list grows beyond
+     * max_header_list, as indexed fields make it much larger than the block.
+     */
+    bool decode(const std::string& block, std::vector<Field>& fields) {
+        size_t pos = 0;
+        size_t listed = 0;
+
+        while (pos < block.size()) {
+            const unsigned char c = block[pos];
+            size_t index;
+            Field field;
+
+            if (c & 0x80) {
+                /* indexed header field */
+                if (!integer(block, pos, 7, index) || !lookup(index, field) || !append(fields, field, listed)) {
+                    return false;
+                }
+            } else if (c & 0x40) {
+                /* literal header field with incremental indexing */
+                if (!literal(block, pos, 6, field)) {
+                    return false;
+                }
+                insert(field);
+                if (!append(fields, field, listed)) {
+                    return false;
+                }
+            } else if (c & 0x20) {
+                /* dynamic table size update */
+                if (!integer(block, pos, 5, index) || index > header_table_size) {
+                    return false;
+                }
+                maxSize = index;
+                evict(0);
+            } else {
+                /* literal header field without indexing / never indexed */
+                if (!literal(block, pos, 4, field) || !append(fields, field, listed)) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+private:
+    /** Dynamic table, newest entry first. */
+    std::deque<Field> table;
+
+    /** Size of the dynamic table, see RFC 7541 section 4.1. */
+    size_t size;
+
+    /** Maximum size of the dynamic table. */
+    size_t maxSize;
+
+    static bool integer(const std::string& block, size_t& pos, unsigned prefix, size_t& value) {
+        const size_t mask = (1u << prefix) - 1;
+
+        if (pos >= block.size()) {
+            return false;
+        }
+
+        value = static_cast<unsigned char>(block[pos++]) & mask;
+        if (value < mask) {
+            return true;
+        }
+
+        for (unsigned shift = 0; shift < 28; shift += 7) {
+            if (pos >= block.size()) {
+                return false;
+            }
+
+            const unsigned char c = block[pos++];
+            value += static_cast<size_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static bool string(const std::string& block, size_t& pos, std::string& value) {
+        if (pos >= block.size()) {
+            return false;
+        }
+
+        const bool huffman = block[pos] & 0x80;
+        size_t length;
+        if (!integer(block, pos, 7, length) || length > block.size() - pos) {
+            return false;
+        }
+
+        std::string raw = block.substr(pos, length);
+        pos += length;
+
+        value.clear();
+        if (!huffman) {
+            value.swap(raw);
+            return true;
+        }
+
+        return huffmandecode(raw, value);
+    }
+
+    bool literal(const std::string& block, size_t& pos, unsigned prefix, Field& field) {
+        size_t index;
+        if (!integer(block, pos, prefix, index)) {
+            return false;
+        }
+
+        if (index == 0) {
+            if (!string(block, pos, field.first)) {
+                return false;
+            }
+        } else {
+            if (!lookup(index, field)) {
+                return false;
+            }
+        }
+
+        return string(block, pos, field.second);
+    }
+
+    /** Append a decoded field, unless the header list grows too large. */
+    static bool append(std::vector<Field>& fields, const Field& field, size_t& listed) {
+        /* size of a field, see RFC 7541 section 4.1 */
+        listed += field.first.size() + field.second.size() + 32;
+        if (listed > max_header_list) {
+            return false;
+        }
+
+        fields.push_back(field);
+        return true;
+    }
+
+        bool lookup(size_t index, Field& field) const {
+        if (index == 0) {
+            return false;
+        }
+
+        if (index <= static_table_size) {
+            field.first = static_table[index][0];
+            field.second = static_table[index][1];
+            return true;
+        }
+
+        index -= static_table_size + 1;
+        if (index >= table.size()) {
+            return false;
+        }
+
+        field = table[index];
+        return true;
+    }
+
+    void insert(const Field& field) {
+        const size_t entry = field.first.size() + field.second.size() + 32;
+        evict(entry);
+
+        if (entry <= maxSize) {
+            table.push_front(field);
+            size += entry;
+        }
+    }
+
+    /** Evict entries until there is room for an entry of the given size. */
+    void evict(size_t entry) {
+        while (!table.empty() && size + entry > maxSize) {
+            size -= table.back().first.size() + table.back().second.size() + 32;
+            table.pop_back();
+        }
+    }
+};
+
+/** Append a HPACK integer, see RFC 7541 section 5.1. */
+static void encodeinteger(std::string& out, unsigned char first, unsigned prefix, size_t value) {
+    const size_t mask = (1u << prefix) - 1;
+
+    if (value < mask) {
+        out += static_cast<char>(first | value);
+        return;
+    }
+
+    out += static_cast<char>(first | mask);
+    value -= mask;
+    while (value >= 0x80) {
+        out += static_cast<char>(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+/** Append a HPACK string literal without huffman coding. */
+static void encodestring(std::string& out, const std::string& value) {
+    encodeinteger(out, 0x00, 7, value.size());
+    out += value;
+}
+
+/** Append a header field as "literal header field without indexing". */
+static void encodefield(std::string& out, const std::string& name, const std::string& value) {
+    for (size_t i = 1; i <= static_table_size; ++i) {
+        if (name == static_table[i][0]) {
+            encodeinteger(out, 0x00, 4, i);
+            encodestring(out, value);
+            return;
+        }
+    }
+
+    out += '\0';
+    encodestring(out, name);
+    encodestring(out, value);
+}
+
+/** Decode base64url, as used by the HTTP2-Settings field. */
+static bool base64urldecode(const std::string& in, std::string& out) {
+    unsigned value = 0;
+    int bits = 0;
+
+    for (size_t i = 0; i < in.size(); ++i) {
+        const char c = in[i];
+        unsigned digit;
+
+        if (c >= 'A' && c <= 'Z') {
+            digit = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            digit = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            digit = c - '0' + 52;
+        } else if (c == '-' || c == '+') {
+            digit = 62;
+        } else if (c == '_' || c == '/') {
+            digit = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return false;
+        }
+
+        value = (value << 6) | digit;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>((value >> bits) & 0xff);
+        }
+    }
+
+    return true;
+}
+
+/** Convert a lower case HTTP/2 field name to the usual HTTP/1.x spelling. */
+static std::string canonicalname(const std::string& name) {
+    std::string result = name;
+    bool upper = true;
+
+    for (size_t i = 0; i < result.size(); ++i) {
+        if (upper && result[i] >= 'a' && result[i] <= 'z') {
+            result[i] = result[i] - 'a' + 'A';
+        }
+        upper = result[i] == '-';
+    }
+
+    return result;
+}
+
+static std::string lowercase(const std::string& name) {
+    std::string result = name;
+
+    for (size_t i = 0; i < result.size(); ++i) {
+        if (result[i] >= 'A' && result[i] <= 'Z') {
+            result[i] = result[i] - 'A' + 'a';
+        }
+    }
+
+    return result;
+}
+
+static unsigned long readuint(const std::string& s, size_t pos, size_t bytes) {
+    unsigned long value = 0;
+
+    for (size_t i = 0; i < bytes; ++i) {
+        value = (value << 8) | static_cast<unsigned char>(s[pos + i]);
+    }
+
+    return value;
+}
+
+static void writeuint(std::string& s, unsigned long value, size_t bytes) {
+    for (size_t i = bytes; i > 0; --i) {
+        s += static_cast<char>((value >> (8 * (i - 1))) & 0xff);
+    }
+}
+
+class Http2 {
+public:
+    Http2(int sock, const Request& peer, handler_t handler) :
+            sock(sock), peer(peer), handler(handler), alive(true), goaway(false), lastStream(0), continuation(0), active(0), sendWindow(initial_window_size), receiveWindow(initial_window_size), peerWindow(initial_window_size), peerFrameSize(max_frame_size), buffered(0), owed(0), input(Access::of(peer).input, Access::of(peer).inputPos), inputPos(0) {
+    }
+
+    void serve(const Request* upgrade, const std::string& settings) {
+        if (upgrade) {
+            static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+            std::string decoded;
+
+            if (!base64urldecode(settings, decoded) || decoded.size() % 6 != 0) {
+                return;
+            }
+
+            if (!sendAll(switching, sizeof(switching) - 1)) {
+                return;
+            }
+
+            sendSettings();
+            if (!applySettings(decoded)) {
+                return;
+            }
+
+            char preface[sizeof(client_preface) - 1];
+            if (!receive(preface, sizeof(preface)) || std::memcmp(preface, client_preface, sizeof(preface)) != 0) {
+                return;
+            }
+
+            /* the upgrade request becomes stream 1, half-closed (remote) */
+            lastStream = 1;
+            Stream& stream = streams[1];
+            stream.sendWindow = peerWindow;
+            stream.headersDone = true;
+            stream.ended = true;
+            dispatch(1, upgrade);
+            streams.erase(1);
+        } else {
+            sendSettings();
+        }
+
+        while (alive) {
+            while (alive && ready.empty()) {
+                if (goaway && streams.empty()) {
+                    return;
+                }
+
+                if (!readFrame()) {
+                    alive = false;
+                }
+            }
+
+            if (!alive) {
+                break;
+            }
+
+            const unsigned id = ready.front();
+            ready.pop_front();
+            if (streams.count(id)) {
+                dispatch(id, NULL);
+                discard(streams[id]);
+                streams.erase(id);
+            }
+        }
+    }
+
+    /** Send the header of a response on a stream. */
+    void sendHeaders(unsigned id, const Response& response) {
+        std::map<unsigned, Stream>::iterator stream = streams.find(id);
+        if (!alive || stream == streams.end() || stream->second.reset) {
+            return;
+        }
+
+        std::string block;
+        std::stringstream code;
+        code << response.statusCode;
+
+        size_t status = 0;
+        for (size_t i = 8; i <= 14; ++i) {
+            if (code.str() == static_table[i][1]) {
+                status = i;
+            }
+        }
+
+        if (status) {
+            encodeinteger(block, 0x80, 7, status);
+        } else {
+            encodeinteger(block, 0x00, 4, 8);
+            encodestring(block, code.str());
+        }
+
+        encodefield(block, "content-type", response.contentType);
+
+        for (std::map<std::string, std::string>::const_iterator it = response.fields.begin(); it != response.fields.end(); ++it) {
+            const std::string name = lowercase(it->first);
+
+            /* connection specific fields are not allowed, see RFC 7540 section 8.1.2.2 */
+            if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade" || name == "content-type") {
+                continue;
+            }
+
+            /* a field per value of fields that cannot be combined, see Response::fields */
+            size_t begin = 0;
+            for (size_t end; (end = it->second.find('\n', begin)) != std::string::npos; begin = end + 1) {
+                encodefield(block, name, it->second.substr(begin, end - begin));
+            }
+            encodefield(block, name, it->second.substr(begin));
+        }
+
+        size_t offset = 0;
+        unsigned char type = FRAME_HEADERS;
+        do {
+            const size_t chunk = std::min(block.size() - offset, peerFrameSize);
+            const unsigned char flags = offset + chunk == block.size() ? FLAG_END_HEADERS : 0;
+            sendFrame(type, flags, id, block.data() + offset, chunk);
+            type = FRAME_CONTINUATION;
+            offset += chunk;
+        } while (offset < block.size());
+    }
+
+    /** Send body data on a stream, waiting for flow control credit as needed. */
+    void sendData(unsigned id, const char* buffer, size_t length, bool end) {
+        while (alive) {
+            std::map<unsigned, Stream>::iterator stream = streams.find(id);
+            if (stream == streams.end() || stream->second.reset) {
+                return;
+            }
+
+            if (length == 0) {
+                if (end) {
+                    sendFrame(FRAME_DATA, FLAG_END_STREAM, id, NULL, 0);
+                }
+                return;
+            }
+
+            const long window = std::min(sendWindow, stream->second.sendWindow);
+            if (window <= 0) {
+                /* wait for WINDOW_UPDATE, serving other frames meanwhile */
+                if (!readFrame()) {
+                    alive = false;
+                }
+                continue;
+            }
+
+            const size_t chunk = std::min(std::min(length, static_cast<size_t>(window)), peerFrameSize);
+            const unsigned char flags = (chunk == length && end) ? FLAG_END_STREAM : 0;
+            sendFrame(FRAME_DATA, flags, id, buffer, chunk);
+            sendWindow -= chunk;
+            stream->second.sendWindow -= chunk;
+            buffer += chunk;
+            length -= chunk;
+
+            if (length == 0) {
+                return;
+            }
+        }
+    }
+
+private:
+    struct Stream {
+        Stream() :
+                sendWindow(0), receiveWindow(initial_window_size), headersDone(false), ended(false), reset(false) {
+        }
+
+        /** Header block, collected from HEADERS and CONTINUATION frames. */
+        std::string block;
+
+        /** Decoded header fields. */
+        std::vector<Field> fields;
+
+        /** Request body. */
+        std::string body;
+
+        /** Flow control window for sending. */
+        long sendWindow;
+
+        /** Flow control window for receiving, as granted to the client. */
+        long receiveWindow;
+
+        /** Set once the request header is complete. */
+        bool headersDone;
+
+        /** Set once the client sent END_STREAM. */
+        bool ended;
+
+        /** Set if the client reset the stream while it was being answered. */
+        bool reset;
+    };
+
+    const int sock;
+
+    const Request& peer;
+
+    const handler_t handler;
+
+    /** Cleared on connection errors. */
+    bool alive;
+
+    /** Set once the client sent GOAWAY. */
+    bool goaway;
+
+    /** Highest stream id opened by the client. */
+    unsigned lastStream;
+
+    /** Stream expecting a CONTINUATION frame, 0 if none. */
+    unsigned continuation;
+
+    /** Stream currently answered, 0 if none. */
+    unsigned active;
+
+    /** Connection flow control window for sending. */
+    long sendWindow;
+
+    /** Connection flow control window for receiving, as granted to the client. */
+    long receiveWindow;
+
+    /** Initial flow control window for new streams, set by the client. */
+    long peerWindow;
+
+    /** Maximum frame payload the client accepts. */
+    size_t peerFrameSize;
+
+    /** Request body data buffered for streams not served yet. */
+    size_t buffered;
+
+    /** Connection flow control credit held back, see credit(). */
+    size_t owed;
+
+    Hpack hpack;
+
+    std::map<unsigned, Stream> streams;
+
+    /** Streams with complete requests, in order of completion. */
+    std::deque<unsigned> ready;
+
+    /** Data received, but not consumed yet. */
+    std::string input;
+
+    /** Read position in input. */
+    size_t inputPos;
+
+    /** Read exactly length bytes, reading ahead in blocks to save system calls. */
+    bool receive(char* buffer, size_t length) {
+        size_t offset = 0;
+        while (offset < length) {
+            if (inputPos == input.size()) {
+                char block[BUFSIZ];
+                ssize_t bytes = recv(sock, block, sizeof(block), 0);
+                if (bytes <= 0) {
+                    /* closed / timeout / another error */
+                    return false;
+                }
+                capturedata(trace_request, block, bytes);
+                input.assign(block, bytes);
+                inputPos = 0;
+            }
+
+            const size_t bytes = input.copy(buffer + offset, length - offset, inputPos);
+            inputPos += bytes;
+            offset += bytes;
+        }
+
+        return true;
+    }
+
+    bool sendAll(const char* buffer, size_t length) {
+        size_t offset = 0;
+        while (offset < length) {
+            ssize_t bytes = send(sock, buffer + offset, length - offset, 0);
+            if (bytes < 0) {
+                alive = false;
+                return false;
+            }
+            offset += bytes;
+        }
+
+        return true;
+    }
+
+    void sendFrame(unsigned char type, unsigned char flags, unsigned id, const char* payload, size_t length) {
+        if (!alive) {
+            return;
+        }
+
+        std::string frame;
+        frame.reserve(9 + length);
+        writeuint(frame, length, 3);
+        frame += static_cast<char>(type);
+        frame += static_cast<char>(flags);
+        writeuint(frame, id & 0x7fffffff, 4);
+        frame.append(payload, length);
+        sendAll(frame.data(), frame.size());
+    }
+
+    void sendSettings() {
+        std::string payload;
+        writeuint(payload, SETTINGS_MAX_CONCURRENT_STREAMS, 2);
+        writeuint(payload, max_concurrent_streams, 4);
+        writeuint(payload, SETTINGS_MAX_HEADER_LIST_SIZE, 2);
+        writeuint(payload, max_header_list, 4);
+        sendFrame(FRAME_SETTINGS, 0, 0, payload.data(), payload.size());
+    }
+
+    void sendWindowUpdate(unsigned id, size_t increment) {
+        std::string payload;
+        writeuint(payload, increment, 4);
+        sendFrame(FRAME_WINDOW_UPDATE, 0, id, payload.data(), payload.size());
+    }
+
+    /**
+     * Account for length bytes of DATA frames received on the connection and
+     * give flow control credit back, as far as buffered bodies allow.
+     */
+    void credit(size_t length) {
+        owed += length;
+        if (owed > 0 && buffered + initial_window_size <= max_buffered) {
+            sendWindowUpdate(0, owed);
+            receiveWindow += owed;
+            owed = 0;
+        }
+    }
+
+    /** Drop the buffered body of a stream that is not going to be served. */
+    void discard(Stream& stream) {
+        buffered -= stream.body.size();
+        std::string().swap(stream.body);
+        credit(0);
+    }
+
+    void sendReset(unsigned id, unsigned long code) {
+        std::string payload;
+        writeuint(payload, code, 4);
+        sendFrame(FRAME_RST_STREAM, 0, id, payload.data(), payload.size());
+    }
+
+    /** Connection error, see RFC 7540 section 5.4.1. */
+    bool fail(unsigned long code) {
+        std::string payload;
+        writeuint(payload, lastStream, 4);
+        writeuint(payload, code, 4);
+        sendFrame(FRAME_GOAWAY, 0, 0, payload.data(), payload.size());
+        alive = false;
+        return false;
+    }
+
+    bool applySettings(const std::string& payload) {
+        for (size_t pos = 0; pos + 6 <= payload.size(); pos += 6) {
+            const unsigned long key = readuint(payload, pos, 2);
+            const unsigned long value = readuint(payload, pos + 2, 4);
+
+            switch (key) {
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > 0x7fffffff) {
+                    return fail(H2_FLOW_CONTROL_ERROR);
+                }
+
+                /* adjust all stream windows, see RFC 7540 section 6.9.2 */
+                for (std::map<unsigned, Stream>::iterator it = streams.begin(); it != streams.end(); ++it) {
+                    it->second.sendWindow += static_cast<long>(value) - peerWindow;
+                }
+                peerWindow = value;
+                break;
+
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < 16384 || value > 16777215) {
+                    return fail(H2_PROTOCOL_ERROR);
+                }
+                peerFrameSize = value;
+                break;
+
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return fail(H2_PROTOCOL_ERROR);
+                }
+                break;
+
+            default:
+                /* we never push and never index outgoing fields */
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    bool readFrame() {
+        char header[9];
+        if (!receive(header, sizeof(header))) {
+            return false;
+        }
+
+        const std::string h(header, sizeof(header));
+        const size_t length = readuint(h, 0, 3);
+        const unsigned char type = h[3];
+        const unsigned char flags = h[4];
+        const unsigned id = readuint(h, 5, 4) & 0x7fffffff;
+
+        if (length > max_frame_size) {
+            return fail(H2_FRAME_SIZE_ERROR);
+        }
+
+        std::string payload(length, '\0');
+        if (length && !receive(&payload[0], length)) {
+            return false;
+        }
+
+        if (continuation && (type != FRAME_CONTINUATION || id != continuation)) {
+            return fail(H2_PROTOCOL_ERROR);
+        }
+
+        switch (type) {
+        case FRAME_DATA:
+            return onData(flags, id, payload);
+
+        case FRAME_HEADERS:
+            return onHeaders(flags, id, payload);
+
+        case FRAME_CONTINUATION:
+            if (id != continuation) {
+                return fail(H2_PROTOCOL_ERROR);
+            }
+
+            if (flags & FLAG_END_HEADERS) {
+                continuation = 0;
+            }
+
+            return onBlock(flags, id, payload);
+
+        case FRAME_PRIORITY:
+            return id != 0 || fail(H2_PROTOCOL_ERROR);
+
+        case FRAME_RST_STREAM:
+            if (id == 0 || length != 4) {
+                return fail(H2_PROTOCOL_ERROR);
+            }
+
+            if (streams.count(id)) {
+                if (id == active) {
+                    streams[id].reset = true;
+                } else {
+                    discard(streams[id]);
+                    streams.erase(id);
+                }
+            }
+
+            return true;
+
+        case FRAME_SETTINGS:
+            if (id != 0) {
+                return fail(H2_PROTOCOL_ERROR);
+            }
+
+            if (flags & FLAG_ACK) {
+                return true;
+            }
+
+            if (length % 6 != 0) {
+                return fail(H2_FRAME_SIZE_ERROR);
+            }
+
+            if (!applySettings(payload)) {
+                return false;
+            }
+
+            sendFrame(FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            return true;
+
+        case FRAME_PUSH_PROMISE:
+            /* clients must not push */
+            return fail(H2_PROTOCOL_ERROR);
+
+        case FRAME_PING:
+            if (id != 0 || length != 8) {
+                return fail(H2_FRAME_SIZE_ERROR);
+            }
+
+            if (!(flags & FLAG_ACK)) {
+                sendFrame(FRAME_PING, FLAG_ACK, 0, payload.data(), payload.size());
+            }
+
+            return true;
+
+        case FRAME_GOAWAY:
+            goaway = true;
+            return true;
+
+        case FRAME_WINDOW_UPDATE:
+            return onWindowUpdate(id, payload);
+
+        default:
+            /* unknown frame types must be ignored */
+            return true;
+        }
+    }
+
+    /** Remove padding of DATA and HEADERS frames. */
+    bool unpad(unsigned char flags, std::string& payload) {
+        if (!(flags & FLAG_PADDED)) {
+            return true;
+        }
+
+        if (payload.empty() || static_cast<unsigned char>(payload[0]) >= payload.size()) {
+            return fail(H2_PROTOCOL_ERROR);
+        }
+
+        payload = payload.substr(1, payload.size() - 1 - static_cast<unsigned char>(payload[0]));
+        return true;
+    }
+
+    bool onData(unsigned char flags, unsigned id, std::string& payload) {
+        if (id == 0) {
+            return fail(H2_PROTOCOL_ERROR);
+        }
+
+        /* the whole frame counts against flow control, see RFC 7540 section 6.1 */
+        const size_t length = payload.size();
+
+        if (static_cast<long>(length) > receiveWindow) {
+            /* sent beyond the window granted, see RFC 7540 section 6.9.1 */
+            return fail(H2_FLOW_CONTROL_ERROR);
+        }
+        receiveWindow -= length;
+
+        if (!unpad(flags, payload)) {
+            return false;
+        }
+
+        std::map<unsigned, Stream>::iterator stream = streams.find(id);
+        if (stream == streams.end() || !stream->second.headersDone || stream->second.ended) {
+            if (id > lastStream) {
+                return fail(H2_PROTOCOL_ERROR);
+            }
+
+            sendReset(id, H2_STREAM_CLOSED);
+            credit(length);
+            return true;
+        }
+
+        if (static_cast<long>(length) > stream->second.receiveWindow) {
+            sendReset(id, H2_FLOW_CONTROL_ERROR);
+            discard(stream->second);
+            streams.erase(stream);
+            credit(length);
+            return true;
+        }
+
+        if (stream->second.body.size() + payload.size() > max_body) {
+            sendReset(id, H2_REFUSED_STREAM);
+            discard(stream->second);
+            streams.erase(stream);
+            credit(length);
+            return true;
+        }
+
+        /* credit for the body is given back once it is consumed, see dispatch() */
+        stream->second.body += payload;
+        stream->second.receiveWindow -= length;
+        buffered += payload.size();
+        credit(length);
+
+        /* let the stream send one byte more than max_body, to have a body too large refused */
+        const long allowance = max_body + 1 - stream->second.body.size();
+        if (flags & FLAG_END_STREAM) {
+            stream->second.ended = true;
+            ready.push_back(id);
+        } else if (allowance > stream->second.receiveWindow) {
+            const long increment = std::min(static_cast<long>(length), allowance - stream->second.receiveWindow);
+            sendWindowUpdate(id, increment);
+            stream->second.receiveWindow += increment;
+        }
+
+        return true;
+    }
+
+    bool onHeaders(unsigned char flags, unsigned id, std::string& payload) {
+        if (id == 0 || id % 2 == 0) {
+            return fail(H2_PROTOCOL_ERROR);
+        }
+
+        if (!unpad(flags, payload)) {
+            return false;
+        }
+
+        if (flags & FLAG_PRIORITY) {
+            if (payload.size() < 5) {
+                return fail(H2_FRAME_SIZE_ERROR);
+            }
+            payload.erase(0, 5);
+        }
+
+        std::map<unsigned, Stream>::iterator stream = streams.find(id);
+        if (stream == streams.end()) {
+            if (id <= lastStream) {
+                return fail(H2_PROTOCOL_ERROR);
+            }
+
+            lastStream = id;
+            stream = streams.insert(std::make_pair(id, Stream())).first;
+            stream->second.sendWindow = peerWindow;
+        } else if (!stream->second.headersDone || stream->second.ended || !(flags & FLAG_END_STREAM)) {
+            /* trailers must end the stream */
+            return fail(H2_PROTOCOL_ERROR);
+        }
+
+        if (flags & FLAG_END_STREAM) {
+            stream->second.ended = true;
+        }
+
+        if (!(flags & FLAG_END_HEADERS)) {
+            continuation = id;
+        }
+
+        return onBlock(flags, id, payload);
+    }
+
+    /** Collect a header block fragment, decode it once complete. */
+    bool onBlock(unsigned char flags, unsigned id, const std::string& payload) {
+        Stream& stream = streams[id];
+
+        if (stream.block.size() + payload.size() > max_header_block) {
+            return fail(H2_PROTOCOL_ERROR);
+        }
+
+        stream.block += payload;
+        if (!(flags & FLAG_END_HEADERS)) {
+            return true;
+        }
+
+        std::vector<Field> fields;
+        if (!hpack.decode(stream.block, fields)) {
+            return fail(H2_COMPRESSION_ERROR);
+        }
+        stream.block.clear();
+
+        if (stream.headersDone) {
+            /* trailers are ignored */
+            ready.push_back(id);
+            return true;
+        }
+
+        stream.headersDone = true;
+        stream.fields.swap(fields);
+
+        if (streams.size() > max_concurrent_streams) {
+            sendReset(id, H2_REFUSED_STREAM);
+            streams.erase(id);
+            return true;
+        }
+
+        if (stream.ended) {
+            ready.push_back(id);
+        }
+
+        return true;
+    }
+
+    bool onWindowUpdate(unsigned id, const std::string& payload) {
+        if (payload.size() != 4) {
+            return fail(H2_FRAME_SIZE_ERROR);
+        }
+
+        const long increment = readuint(payload, 0, 4) & 0x7fffffff;
+
+        if (id == 0) {
+            if (increment == 0 || increment > 0x7fffffff - sendWindow) {
+                return fail(increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+            }
+
+            sendWindow += increment;
+            return true;
+        }
+
+        std::map<unsigned, Stream>::iterator stream = streams.find(id);
+        if (stream == streams.end()) {
+            return true;
+        }
+
+        if (increment == 0 || increment > 0x7fffffff - stream->second.sendWindow) {
+            sendReset(id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+            stream->second.reset = true;
+            if (id != active) {
+                discard(stream->second);
+                streams.erase(stream);
+            }
+            return true;
+        }
+
+        stream->second.sendWindow += increment;
+        return true;
+    }
+
+    /** Run the handler for a complete request. */
+    void dispatch(unsigned id, const Request* upgrade) {
+        Request request(-1);
+        std::string authority;
+
+        request.address = peer.address;
+        request.ip[0] = peer.ip[0];
+        request.ip[1] = peer.ip[1];
+        request.ip[2] = peer.ip[2];
+        request.ip[3] = peer.ip[3];
+        request.port = peer.port;
+
+        if (upgrade) {
+            request.type = upgrade->type;
+            request.path = upgrade->path;
+            request.fields = upgrade->fields;
+            request.parameters = upgrade->parameters;
+            Access::of(request).target = Access::of(*upgrade).target;
+        } else {
+            Stream& stream = streams[id];
+            std::string path;
+
+            for (std::vector<Field>::const_iterator it = stream.fields.begin(); it != stream.fields.end(); ++it) {
+                if (it->first == ":method") {
+                    request.type = it->second;
+                } else if (it->first == ":path") {
+                    path = it->second;
+                } else if (it->first == ":authority") {
+                    request.fields["Host"] = it->second;
+                } else if (it->first[0] == ':') {
+                    /* :scheme and unknown pseudo fields */
+                    continue;
+                } else {
+                    const std::string name = canonicalname(it->first);
+                    if (request.fields.count(name)) {
+                        /* cookie crumbs, see RFC 7540 section 8.1.2.5 */
+                        request.fields[name] += name == "Cookie" ? "; " : ", ";
+                    }
+                    request.fields[name] += it->second;
+                }
+            }
+
+            if (request.type.empty() || path.empty()) {
+                sendReset(id, H2_PROTOCOL_ERROR);
+                return;
+            }
+
+            Access::of(request).target = path;
+
+            size_t pos;
+            if ((pos = path.find('?')) != std::string::npos) {
+                parseparameters(path.substr(pos + 1, std::string::npos), request.parameters);
+                path.erase(pos);
+            }
+
+            request.path = urldecode(path);
+            buffered -= stream.body.size();
+            Access::of(request).input.swap(stream.body);
+            credit(0);
+        }
+
+        request.version = "HTTP/2.0";
+
+        StreamSink sink(*this, id);
+        active = id;
+        {
+            Response response(-1);
+            response.version = request.version;
+            Access::of(response).sink = &sink;
+            const unsigned long begin = tracebegin();
+            MHTTPD_PROBE2(handler_start, trace_request, request.path.c_str());
+            handler(request, response);
+            tracespan(TRACE_HANDLER, trace_request, begin);
+            MHTTPD_PROBE2(handler_done, trace_request, response.statusCode);
+        }
+        active = 0;
+    }
+
+    /** Routes a response to a stream of this connection. */
+    class StreamSink: public Sink {
+    public:
+        StreamSink(Http2& connection, unsigned id) :
+                connection(connection), id(id) {
+        }
+
+        void header(const Response& response) {
+            connection.sendHeaders(id, response);
+        }
+
+        void body(const char* buffer, size_t length) {
+            connection.sendData(id, buffer, length, false);
+        }
+
+        void finish() {
+            connection.sendData(id, NULL, 0, true);
+        }
+
+    private:
+        Http2& connection;
+
+        const unsigned id;
+    };
+};
+
+void http2(int sock, const Request* upgrade, const std::string& settings, const Request& peer, handler_t handler) {
+    Http2 connection(sock, peer, handler);
+    connection.serve(upgrade, settings);
+}
+
+} /* namespace mhttpd */
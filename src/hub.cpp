@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>       /* errno */
+#include <cstdio>       /* BUFSIZ */
+#include <deque>        /* std::deque */
+#include <map>          /* std::map */
+#include <set>          /* std::set */
+#include <vector>       /* std::vector */
+
+#include <fcntl.h>      /* fcntl() */
+#include <sys/socket.h> /* send(), recv() */
+#include <unistd.h>     /* close() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Serialized event, shared by all subscribers it is queued for. */
+struct Event {
+    Event(const std::string& data, size_t references) :
+            data(data), references(references) {
+    }
+
+    const std::string data;
+
+    size_t references;
+};
+
+static void release(Event* event) {
+    if (--event->references == 0) {
+        delete event;
+    }
+}
+
+static EventHub::Policy hub_policy = EventHub::DROP;
+
+static size_t hub_max_queued = 1024 * 1024;
+
+class Subscriber;
+
+/** Subscribers by channel. */
+static std::map<std::string, std::set<Subscriber*> > hub_channels;
+
+/**
+ * Connection handed over to the hub. Subscribers that stop reading are
+ * dropped after the write timeout.
+ */
+class Subscriber: public Watcher, public Timer {
+public:
+    Subscriber(int fd, const std::string& channel) :
+            Watcher(fd), channel(channel), offset(0), queued(0) {
+        hub_channels[channel].insert(this);
+    }
+
+    ~Subscriber() {
+        while (!queue.empty()) {
+            release(queue.front());
+            queue.pop_front();
+        }
+
+        hub_channels[channel].erase(this);
+        if (hub_channels[channel].empty()) {
+            hub_channels.erase(channel);
+        }
+    }
+
+    short events() {
+        return queue.empty() ? POLLIN : POLLIN | POLLOUT;
+    }
+
+    void ready(short revents) {
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            /* clients do not talk after the request, so this is the end */
+            char buffer[BUFSIZ];
+            const ssize_t bytes = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EINTR)) {
+                Loop::remove(this);
+                return;
+            }
+        }
+
+        if (revents & POLLOUT) {
+            flush();
+        }
+    }
+
+    /** Queue an event, taking one reference. */
+    void push(Event* event) {
+        if (queued + event->data.size() > hub_max_queued) {
+            release(event);
+
+            if (hub_policy == EventHub::DISCONNECT) {
+                Loop::remove(this);
+            }
+            return;
+        }
+
+        queue.push_back(event);
+        queued += event->data.size();
+        flush();
+    }
+
+    void expired() {
+        Loop::remove(this);
+    }
+
+private:
+    const std::string channel;
+
+    std::deque<Event*> queue;
+
+    /** Bytes of the first queued event already sent. */
+    size_t offset;
+
+    /** Bytes queued, including the part of the first event already sent. */
+    size_t queued;
+
+    void flush() {
+        bool progress = false;
+
+        while (!queue.empty()) {
+            const std::string& data = queue.front()->data;
+            const ssize_t bytes = send(fd, data.data() + offset, data.size() - offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            if (bytes < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    Loop::remove(this);
+                } else if (progress || !running()) {
+                    /* the write timeout counts from the last progress */
+                    start(server_timeouts.write * 1000UL);
+                }
+                return;
+            }
+
+            progress = true;
+
+            offset += bytes;
+            if (offset == data.size()) {
+                queued -= data.size();
+                offset = 0;
+                release(queue.front());
+                queue.pop_front();
+            }
+        }
+
+        stop();
+    }
+};
+
+void hubsubscribe(const std::string& message, int fd) {
+    size_t pos = 1;
+    std::string channel;
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (!getstring(message, pos, channel)) {
+        close(fd);
+        return;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Loop::add(new Subscriber(fd, channel));
+}
+
+void hubpublish(const std::string& message) {
+    size_t pos = 1;
+    std::string channel;
+    std::string data;
+
+    if (!getstring(message, pos, channel) || !getstring(message, pos, data)) {
+        return;
+    }
+
+    std::map<std::string, std::set<Subscriber*> >::iterator it = hub_channels.find(channel);
+    if (it == hub_channels.end()) {
+        return;
+    }
+
+    /* copy, subscribers may disconnect while the event is pushed */
+    const std::vector<Subscriber*> subscribers(it->second.begin(), it->second.end());
+    Event* event = new Event(data, subscribers.size());
+
+    for (std::vector<Subscriber*>::const_iterator subscriber = subscribers.begin(); subscriber != subscribers.end(); ++subscriber) {
+        (*subscriber)->push(event);
+    }
+}
+
+void EventHub::configure(Policy policy, size_t maxQueued) {
+    hub_policy = policy;
+    hub_max_queued = maxQueued;
+}
+
+bool EventHub::subscribe(const Request& request, Response& response, const std::string& channel) {
+    const int sock = Access::of(request).sock;
+
+    if (sock < 0) {
+        /* HTTP/2 streams have no socket of their own */
+        response.statusCode = 501;
+        response.statusMessage = "Not Implemented";
+        return false;
+    }
+
+    response.statusCode = 200;
+    response.statusMessage = "OK";
+    response.contentType = "text/event-stream";
+    response.fields["Cache-Control"] = "no-cache";
+    Access::of(response).flush(response);
+
+    std::string message(1, static_cast<char>(MESSAGE_SUBSCRIBE));
+    putstring(message, channel);
+    if (!supervisorsend(message, sock)) {
+        return false;
+    }
+
+    Access::of(response).detached = true;
+    return true;
+}
+
+bool EventHub::publish(const std::string& channel, const std::string& data, const std::string& event, const std::string& id) {
+    std::string serialized;
+
+    /* a line break would end the field and start another one */
+    if (event.find_first_of("\r\n") != std::string::npos || id.find_first_of("\r\n") != std::string::npos) {
+        return false;
+    }
+
+    if (!event.empty()) {
+        serialized += "event: " + event + "\n";
+    }
+
+    if (!id.empty()) {
+        serialized += "id: " + id + "\n";
+    }
+
+    /* one data field per line, "\r\n", "\r" and "\n" all end a line */
+    size_t begin = 0;
+    do {
+        const size_t end = data.find_first_of("\r\n", begin);
+        serialized += "data: " + data.substr(begin, end == std::string::npos ? std::string::npos : end - begin) + "\n";
+        begin = end == std::string::npos ? end : data.compare(end, 2, "\r\n") == 0 ? end + 2 : end + 1;
+    } while (begin != std::string::npos);
+
+    serialized += "\n";
+
+    std::string message(1, static_cast<char>(MESSAGE_PUBLISH));
+    putstring(message, channel);
+    putstring(message, serialized);
+    if (message.size() > max_message) {
+        return false;
+    }
+
+    return supervisorsend(message);
+}
+
+} /* namespace mhttpd */
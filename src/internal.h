@@ -0,0 +1,597 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MHTTPD_INTERNAL_H_
+#define MHTTPD_INTERNAL_H_
+
+#include <string>   /* std::string */
+#include <vector>   /* std::vector */
+
+#include <poll.h>   /* POLLIN */
+#include <sys/types.h> /* ssize_t */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h> /* DTRACE_PROBE1(), DTRACE_PROBE2() */
+#endif
+
+#include "mhttpd.h"
+
+namespace mhttpd {
+
+/**
+ * Destination of a response that is not written to the socket as plain
+ * HTTP/1.x, e.g. a HTTP/2 stream.
+ */
+class Sink {
+public:
+    virtual ~Sink() {
+    }
+
+    /** Emit status and header fields of the response. */
+    virtual void header(const Response& response) = 0;
+
+    /** Emit a block of body data. */
+    virtual void body(const char* buffer, size_t length) = 0;
+
+    /** Called once after the last block of body data was emitted. */
+    virtual void finish() = 0;
+};
+
+/**
+ * Time a client may keep a worker waiting in total, e.g. while trickling the
+ * body. Only time blocked on the socket counts, so handlers may still stream
+ * at their own pace.
+ */
+class Budget {
+public:
+    /** @param seconds in total, 0 for no limit */
+    Budget(unsigned seconds = 0);
+
+    /**
+     * Limit the next blocking call on a socket to the time left.
+     * @param option SO_RCVTIMEO or SO_SNDTIMEO
+     * @return false if the time is used up
+     */
+    bool begin(int sock, int option);
+
+    /** Charge the time passed since begin(). */
+    void end();
+
+private:
+    /** Set if there is a limit at all. */
+    bool limited;
+
+    /** Milliseconds left. */
+    unsigned long left;
+
+    /** Start of the blocking call, see schedulernow(). */
+    unsigned long since;
+};
+
+class Request::Implementation {
+public:
+    Implementation(const int sock) :
+            sock(sock), inputPos(0) {
+    }
+
+    ~Implementation() {
+    }
+
+    /** Unix socket to read from, -1 if the input is fully buffered. */
+    const int sock;
+
+    /** Buffered input, consumed before reading from the socket. */
+    std::string input;
+
+    /** Read position in input. */
+    size_t inputPos;
+
+    /** Time left for receiving the body, see Server::bodyTimeout. */
+    Budget bodyBudget;
+
+    /** Request target as received, including the query string. */
+    std::string target;
+};
+
+class Response::Implementation {
+public:
+    Implementation(const int sock) :
+            sock(sock), headerSent(false), sink(NULL), detached(false), failed(false), started(false) {
+    }
+
+    ~Implementation();
+
+    void sendHeader(Response& response);
+
+    void write(const char* buffer, size_t length);
+
+    /** Unix socket to write to. */
+    const int sock;
+
+    /** Set if HTTP header was sent. */
+    bool headerSent;
+
+    /** Alternative destination for the response, NULL for plain HTTP/1.x. */
+    Sink* sink;
+
+    /** Set if the socket was handed over to the server process. */
+    bool detached;
+
+    /** Set if sending failed, e.g. on the write timeout. */
+    bool failed;
+
+    /** Time left for sending the response, see Server::writeTimeout. */
+    Budget writeBudget;
+
+    /**
+     * Send the header, if not done yet, and everything buffered so far.
+     * @param more set if more data follows right away, e.g. a body sent by
+     *        other means, to have the kernel hold back a partial segment
+     */
+    void flush(Response& response, bool more = false);
+
+private:
+    std::vector<char> sendBuffer;
+
+    /** Set once the first byte was passed on, to trace it. */
+    bool started;
+
+    /** Trace the first byte passed on. */
+    void start();
+
+    void writeBuffer(const char* buffer, size_t length, bool more = false);
+};
+
+/** Grants library internals access to the implementation of public classes. */
+class Access {
+public:
+    static Request::Implementation& of(Request& request) {
+        return *request.implementation;
+    }
+
+    static const Request::Implementation& of(const Request& request) {
+        return *request.implementation;
+    }
+
+    static Response::Implementation& of(Response& response) {
+        return *response.implementation;
+    }
+
+    /** Wrap a connection detached by the server process, see WebSocket::detach(). */
+    static WebSocket* wrap(int sock) {
+        return new WebSocket(sock);
+    }
+};
+
+/** File descriptor served by the event loop of the server process. */
+class Watcher {
+public:
+    Watcher(int fd) :
+            fd(fd) {
+    }
+
+    /** Closes the file descriptor. */
+    virtual ~Watcher();
+
+    /** Events to wait for, see poll(2). */
+    virtual short events() {
+        return POLLIN;
+    }
+
+    /** Called when some of the events occurred. */
+    virtual void ready(short revents) = 0;
+
+    /**
+     * Set for listening sockets. The loop may then accept connections itself
+     * and call accepted() instead of ready().
+     */
+    virtual bool listening() {
+        return false;
+    }
+
+    /** Called with a connection the loop accepted on a listening socket. */
+    virtual void accepted(int) {
+    }
+
+    const int fd;
+};
+
+/** Event loop of the server process. */
+class Loop {
+public:
+    /** Serve a watcher, taking ownership. */
+    static void add(Watcher* watcher);
+
+    /** Stop serving a watcher, it is deleted after the current iteration. */
+    static void remove(Watcher* watcher);
+
+    /** Delete all watchers, e.g. in a freshly forked worker. */
+    static void clear();
+
+    /**
+     * Wait for events and dispatch them.
+     * @param timeout in milliseconds, -1 to wait forever
+     * @return false on failure
+     */
+    static bool iterate(int timeout);
+};
+
+/**
+ * Deadline in the event loop of the server process. Timers are kept in a
+ * hierarchical timer wheel, so starting, stopping and expiring one takes
+ * constant time, regardless of how many are running.
+ */
+class Timer {
+public:
+    Timer() :
+            due(0), before(NULL), after(NULL), slot(NULL) {
+    }
+
+    /** Stops the timer. */
+    virtual ~Timer();
+
+    /** Start the timer, or restart it if running. */
+    void start(unsigned long milliseconds);
+
+    /** Stop the timer, if running. */
+    void stop();
+
+    bool running() const {
+        return slot != NULL;
+    }
+
+    /** Called when the deadline passed. The timer is stopped by then. */
+    virtual void expired() = 0;
+
+    /** Milliseconds until the next timer may expire, -1 if none is running. */
+    static int next();
+
+    /** Expire all timers whose deadline passed. */
+    static void run();
+
+private:
+    /** No copy constructor. */
+    Timer(const Timer&);
+
+    /** No copy assignment. */
+    Timer operator=(const Timer&);
+
+    /** Sort into the wheel by deadline. */
+    void place();
+
+    /** Move all timers of a slot into lower levels of the wheel. */
+    static void cascade(Timer** slot);
+
+    /** Deadline in ticks. */
+    unsigned long due;
+
+    /** Neighbours in the list of timers sharing a slot of the wheel. */
+    Timer* before;
+    Timer* after;
+
+    /** Slot of the wheel, NULL if stopped. */
+    Timer** slot;
+};
+
+/** Timeouts of the running server in seconds, see Server. */
+struct Timeouts {
+    unsigned header;
+    unsigned body;
+    unsigned idle;
+    unsigned write;
+};
+
+/** Timeouts of the running server, set by Server::start(). */
+extern Timeouts server_timeouts;
+
+/** Tuning of TCP sockets, see Server. */
+struct SocketOptions {
+    unsigned deferAccept;
+    unsigned fastOpen;
+    bool noDelay;
+    bool cork;
+};
+
+/** Socket options of the running server, set by Server::start(). */
+extern SocketOptions server_sockets;
+
+/** Message types on the channel between workers and the server process, and between shards. */
+enum Message {
+    MESSAGE_SUBSCRIBE = 1, MESSAGE_PUBLISH, MESSAGE_ACQUIRE, MESSAGE_RELEASE, MESSAGE_LOOKUP, MESSAGE_STORE, MESSAGE_STEAL, MESSAGE_HANDOFF, MESSAGE_QUEUED, MESSAGE_WEBSOCKET, MESSAGE_CANCEL
+};
+
+/** Maximum size of a message on the channel. */
+static const size_t max_message = 65536;
+
+/** Send a message, optionally passing a file descriptor along. */
+bool sendmessage(int sock, const std::string& message, int fd, int flags);
+
+/**
+ * Receive a message and a file descriptor passed along, -1 if none.
+ * @return number of bytes received, 0 if closed, -1 on error
+ */
+ssize_t receivemessage(int sock, std::string& message, int& fd, int flags);
+
+/**
+ * Create the channel of a worker about to be forked to the server process.
+ * Called in the server process, which closes its copy once forked.
+ * @return end of the worker, see supervisorenter(), -1 on failure
+ */
+int supervisorchannel();
+
+/** Talk to the server process through channel, in a freshly forked worker. */
+void supervisorenter(int channel);
+
+/**
+ * Send a message to the server process, optionally passing a file
+ * descriptor along. Returns false outside of a running server.
+ */
+bool supervisorsend(const std::string& message, int fd = -1);
+
+/**
+ * Wait for the reply of the server process to the last message.
+ * @param fd file descriptor passed along, -1 if none
+ * @param timeout in milliseconds, -1 to wait forever
+ */
+bool supervisorreceive(std::string& message, int& fd, int timeout = -1);
+
+/** Answer a worker from within the server process. */
+bool supervisorreply(int channel, const std::string& message, int fd = -1);
+
+/** Append a 32 bit number to a message. */
+void putnumber(std::string& message, unsigned long value);
+
+/** Read a 32 bit number from a message. */
+bool getnumber(const std::string& message, size_t& pos, unsigned long& value);
+
+/** Append a length prefixed string to a message. */
+void putstring(std::string& message, const std::string& s);
+
+/** Read a length prefixed string from a message. */
+bool getstring(const std::string& message, size_t& pos, std::string& s);
+
+/** Handle MESSAGE_SUBSCRIBE in the server process. */
+void hubsubscribe(const std::string& message, int fd);
+
+/** Handle MESSAGE_PUBLISH in the server process. */
+void hubpublish(const std::string& message);
+
+/** Handle MESSAGE_ACQUIRE in the server process. */
+void proxyacquire(const std::string& message, int channel);
+
+/** Handle MESSAGE_RELEASE in the server process. */
+void proxyrelease(const std::string& message, int fd, int channel);
+
+/** Return upstream connections still held by a worker that went away. */
+void proxyclosed(int channel);
+
+/** Handle MESSAGE_LOOKUP in the server process. */
+void cachelookup(const std::string& message, int channel);
+
+/** Handle MESSAGE_STORE in the server process. */
+void cachestore(const std::string& message, int channel);
+
+/** Handle MESSAGE_CANCEL, a worker that gave up waiting for a response. */
+void cachecancel(int channel);
+
+/** Hand lookups a worker that went away was responsible for to others. */
+void cacheclosed(int channel);
+
+/** Handle MESSAGE_WEBSOCKET in the server process, see WebSocket::detach(). */
+void websocketadopt(const std::string& message, int fd);
+
+/** Number of CPUs the process may run on. */
+unsigned shardcpus();
+
+/**
+ * Create the sockets carrying published events between count shards. Called
+ * in the server process before the shards are forked.
+ */
+bool shardprepare(unsigned count);
+
+/** Close the sockets of shardprepare() in the server process. */
+void shardfinish();
+
+/**
+ * Turn a freshly forked server process into a shard: pin it to a CPU, make it
+ * allocate memory from the local NUMA node and receive events published on
+ * other shards.
+ */
+void shardenter(unsigned index);
+
+/** Pass a message published on this shard on to the other shards. */
+void shardforward(const std::string& message);
+
+/**
+ * Send a message to another shard, optionally passing a file descriptor
+ * along. Never blocks, a shard that does not keep up misses the message.
+ */
+bool shardsend(unsigned index, const std::string& message, int fd = -1);
+
+/** Classification of requests, see Server::classify(). */
+struct SchedulerRule {
+    /** Prefix of the request target, if field is empty. */
+    std::string prefix;
+
+    /** Header field name, empty to match the target. */
+    std::string field;
+
+    /** Value the header field must have. */
+    std::string value;
+
+    Server::Priority priority;
+
+    /** Milliseconds a request may wait for a worker, 0 for no limit. */
+    unsigned deadline;
+};
+
+/** Request in the server process waiting for a free worker, see scheduler.cpp. */
+class Queued {
+public:
+    Queued() :
+            priority(Server::NORMAL), deadline(0) {
+    }
+
+    virtual ~Queued() {
+    }
+
+    /** Fork a worker for the request, called once a worker is available. */
+    virtual void dispatch() = 0;
+
+    /**
+     * Append the request to a message for another shard.
+     * @return connection to pass along with the message, -1 if the request
+     *         cannot leave this shard
+     */
+    virtual int handoff(std::string& message) = 0;
+
+    /** Called once the request was passed on to another shard. */
+    virtual void handedOff() = 0;
+
+    Server::Priority priority;
+
+    /** Time after which the request is dropped, see schedulernow(), 0 for never. */
+    unsigned long deadline;
+};
+
+/** Set the worker limit and classification rules, see Server::maxWorkers. */
+void schedulerconfigure(unsigned workers, const std::vector<SchedulerRule>& rules);
+
+/**
+ * Create the load table shared by count shards. Called in the server process
+ * before the shards are forked.
+ */
+bool schedulerprepare(unsigned count);
+
+/** Set if requests are scheduled, i.e. the number of workers is limited. */
+bool schedulerenabled();
+
+/** Monotonic clock in milliseconds, for deadlines. */
+unsigned long schedulernow();
+
+/** Set priority and deadline of a request by the rules, see Server::classify(). */
+void schedulerclassify(const char* head, size_t length, Queued& request);
+
+/**
+ * Take a worker slot. The slot is released once every process holding the
+ * returned descriptor closed it, so it must go to the forked worker.
+ * @return write end of the slot, -1 if all workers are busy
+ */
+int scheduleracquire();
+
+/** Wait for a free worker. */
+void schedulerqueue(Queued* request);
+
+/** Stop waiting, e.g. the client went away. */
+void schedulerunqueue(Queued* request);
+
+/** Handle MESSAGE_STEAL from another shard that has idle workers. */
+void schedulersteal(const std::string& message);
+
+/** Handle MESSAGE_HANDOFF, a request passed on by another shard. */
+void schedulerreceive(const std::string& message, int fd);
+
+/** Take over requests waiting in other shards if there are idle workers. */
+void schedulerbalance();
+
+/**
+ * Fork a worker, which is not a child of the server process, so it needs no
+ * reaping. Returns once the intermediate child exited, right after forking.
+ * @return 0 in the worker, 1 in the server process, -1 on failure
+ */
+int serverfork();
+
+/**
+ * Serve a request passed on by another shard, see Queued::handoff().
+ * @param remaining milliseconds left until the deadline, 0 for none
+ */
+void serveradopt(const std::string& message, size_t pos, int fd, Server::Priority priority, unsigned long remaining);
+
+/** Traced points of a request, see Trace. */
+enum TracePoint {
+    TRACE_ACCEPT, TRACE_HEADER, TRACE_PARSE, TRACE_HANDLER, TRACE_FIRST_BYTE, TRACE_LAST_BYTE
+};
+
+/** Request served by this worker, for events recorded deep inside. */
+extern unsigned long trace_request;
+
+/** Start of a span in nanoseconds, 0 if tracing is disabled. */
+unsigned long tracebegin();
+
+/** Record a span of a request from begin, see tracebegin(), until now. */
+void tracespan(TracePoint point, unsigned long request, unsigned long begin);
+
+/** Record a point in time of a request. */
+void tracepoint(TracePoint point, unsigned long request);
+
+/** Give a freshly forked shard a ring buffer of its own. */
+void traceshard();
+
+/** Record events of a request in a freshly forked worker. */
+void traceworker(unsigned long request);
+
+/** Record a connection accepted by the server, see Traffic. */
+void captureopen(unsigned long connection);
+
+/** Record bytes received on a connection. */
+void capturedata(unsigned long connection, const char* data, size_t length);
+
+/** Record the end of a connection. */
+void captureclose(unsigned long connection);
+
+/*
+ * Static probes for perf(1), bpftrace(8) or SystemTap. Without sys/sdt.h they
+ * compile to nothing; with it, a disabled probe is a single nop instruction.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define MHTTPD_PROBE1(name, a) DTRACE_PROBE1(mhttpd, name, a)
+#define MHTTPD_PROBE2(name, a, b) DTRACE_PROBE2(mhttpd, name, a, b)
+#else
+#define MHTTPD_PROBE1(name, a) do { } while (0)
+#define MHTTPD_PROBE2(name, a, b) do { } while (0)
+#endif
+
+/**
+ * Split a query string ("a=b&c=d") into key value pairs and add them to
+ * parameters.
+ */
+void parseparameters(const std::string& query, std::multimap<std::string, std::string>& parameters);
+
+/**
+ * Serve a HTTP/2 connection, see RFC 7540.
+ * @param sock Unix socket of the connection
+ * @param upgrade request that asked for "Upgrade: h2c", answered on stream 1,
+ *        or NULL if the client connected with prior knowledge and the client
+ *        preface was already consumed
+ * @param settings "HTTP2-Settings" field of the upgrade request
+ * @param peer request to copy the client address from
+ * @param handler call back function for incoming requests
+ */
+void http2(int sock, const Request* upgrade, const std::string& settings, const Request& peer, handler_t handler);
+
+} /* namespace mhttpd */
+
+#endif /* MHTTPD_INTERNAL_H_ */
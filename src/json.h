@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MHTTPD_JSON_H_
+#define MHTTPD_JSON_H_
+
+#include <cstdio>   /* std::sprintf() */
+#include <cstdlib>  /* std::strtod() */
+#include <cstring>  /* std::memcpy(), std::strlen() */
+#include <map>      /* std::map */
+#include <string>   /* std::string */
+#include <vector>   /* std::vector */
+
+#include "mhttpd.h"
+
+namespace mhttpd {
+
+class Json;
+
+/**
+ * Description of the fields of a struct, to serialize it as a JSON object.
+ * Specialize it for every struct, calling Json::field() for every field:
+ * {@code
+ * namespace mhttpd {
+ * template <>
+ * struct JsonFields<User> {
+ *     static void write(Json& json, const User& user) {
+ *         json.field("id", user.id).field("name", user.name);
+ *     }
+ * };
+ * }
+ * }
+ * The fields are resolved at compile time, so a struct is written without
+ * any lookup, virtual call or intermediate string.
+ */
+template <class T>
+struct JsonFields;
+
+/**
+ * JSON writer, writing straight into a response. Numbers are formatted in
+ * place, strings are escaped while they are copied and output is collected
+ * in a fixed buffer that is passed on to the response in large blocks.
+ * Usage: {@code mhttpd::Json(response).value(users);}
+ */
+class Json {
+public:
+    /** Start writing JSON into a response, setting its content type. */
+    Json(Response& response) :
+            response(response), length(0), comma(false) {
+        response.contentType = "application/json";
+    }
+
+    /** Pass everything written on to the response. */
+    ~Json() {
+        flush();
+    }
+
+    /**
+     * Write a value: a boolean, a number, a string, a std::vector (array), a
+     * std::map with string keys (object) or a struct with JsonFields.
+     */
+    template <class T>
+    Json& value(const T& item) {
+        separate();
+        write(item);
+        comma = true;
+        return *this;
+    }
+
+    /** Write null. */
+    Json& null() {
+        separate();
+        append("null", 4);
+        comma = true;
+        return *this;
+    }
+
+    /** Write a field of the current object. */
+    template <class T>
+    Json& field(const char* name, const T& item) {
+        separate();
+        string(name, std::strlen(name));
+        put(':');
+        comma = false;
+        return value(item);
+    }
+
+    Json& beginObject() {
+        separate();
+        put('{');
+        comma = false;
+        return *this;
+    }
+
+    Json& endObject() {
+        put('}');
+        comma = true;
+        return *this;
+    }
+
+    Json& beginArray() {
+        separate();
+        put('[');
+        comma = false;
+        return *this;
+    }
+
+    Json& endArray() {
+        put(']');
+        comma = true;
+        return *this;
+    }
+
+    /** Pass everything written so far on to the response. */
+    void flush() {
+        if (length > 0) {
+            response.write(buffer, length);
+            length = 0;
+        }
+    }
+
+    /**
+     * Format an integer.
+     * @param output at least 20 characters
+     * @return number of characters written
+     */
+    static size_t format(char* output, unsigned long value) {
+        static const char pairs[] =
+                "00010203040506070809101112131415161718192021222324"
+                "25262728293031323334353637383940414243444546474849"
+                "50515253545556575859606162636465666768697071727374"
+                "75767778798081828384858687888990919293949596979899";
+
+        /* two digits at a time, from the end */
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        char* begin = end;
+        while (value >= 100) {
+            const unsigned pair = static_cast<unsigned>(value % 100) * 2;
+            value /= 100;
+            *--begin = pairs[pair + 1];
+            *--begin = pairs[pair];
+        }
+
+        if (value >= 10) {
+            *--begin = pairs[value * 2 + 1];
+            *--begin = pairs[value * 2];
+        } else {
+            *--begin = static_cast<char>('0' + value);
+        }
+
+        std::memcpy(output, begin, end - begin);
+        return end - begin;
+    }
+
+    /** Format a signed integer, see format(char*, unsigned long). */
+    static size_t format(char* output, long value) {
+        if (value >= 0) {
+            return format(output, static_cast<unsigned long>(value));
+        }
+
+        output[0] = '-';
+        return 1 + format(output + 1, 0UL - static_cast<unsigned long>(value));
+    }
+
+private:
+    /** No copy constructor. */
+    Json(const Json&);
+
+    /** No copy assignment. */
+    Json operator=(const Json&);
+
+    Response& response;
+
+    char buffer[4096];
+
+    /** Characters in buffer. */
+    size_t length;
+
+    /** Set if the next value needs a separating comma. */
+    bool comma;
+
+    void separate() {
+        if (comma) {
+            put(',');
+        }
+    }
+
+    void put(char c) {
+        if (length == sizeof(buffer)) {
+            flush();
+        }
+        buffer[length++] = c;
+    }
+
+    void append(const char* data, size_t size) {
+        if (size > sizeof(buffer) - length) {
+            flush();
+            if (size > sizeof(buffer)) {
+                response.write(data, size);
+                return;
+            }
+        }
+
+        std::memcpy(buffer + length, data, size);
+        length += size;
+    }
+
+    /** Make room for size characters, at most 32, and return where they go. */
+    char* reserve(size_t size) {
+        if (size > sizeof(buffer) - length) {
+            flush();
+        }
+        return buffer + length;
+    }
+
+    void integer(long value) {
+        length += format(reserve(24), value);
+    }
+
+    void integer(unsigned long value) {
+        length += format(reserve(24), value);
+    }
+
+    void write(bool value) {
+        if (value) {
+            append("true", 4);
+        } else {
+            append("false", 5);
+        }
+    }
+
+    void write(short value) {
+        integer(static_cast<long>(value));
+    }
+
+    void write(unsigned short value) {
+        integer(static_cast<unsigned long>(value));
+    }
+
+    void write(int value) {
+        integer(static_cast<long>(value));
+    }
+
+    void write(unsigned value) {
+        integer(static_cast<unsigned long>(value));
+    }
+
+    void write(long value) {
+        integer(value);
+    }
+
+    void write(unsigned long value) {
+        integer(value);
+    }
+
+    void write(float value) {
+        write(static_cast<double>(value));
+    }
+
+    void write(double value) {
+        if (value - value != 0) {
+            /* JSON knows no infinity and NaN */
+            append("null", 4);
+            return;
+        }
+
+        if (value > -1e15 && value < 1e15 && value == static_cast<long>(value)) {
+            integer(static_cast<long>(value));
+            return;
+        }
+
+        /* the shortest of the usual precisions that reads back unchanged */
+        char* output = reserve(32);
+        int size = std::sprintf(output, "%.15g", value);
+        if (std::strtod(output, NULL) != value) {
+            size = std::sprintf(output, "%.17g", value);
+        }
+        length += size;
+    }
+
+    void write(const char* value) {
+        string(value, std::strlen(value));
+    }
+
+    void write(const std::string& value) {
+        string(value.data(), value.size());
+    }
+
+    template <class T>
+    void write(const std::vector<T>& values) {
+        put('[');
+        comma = false;
+        for (typename std::vector<T>::const_iterator it = values.begin(); it != values.end(); ++it) {
+            value(*it);
+        }
+        put(']');
+    }
+
+    template <class T>
+    void write(const std::map<std::string, T>& values) {
+        put('{');
+        comma = false;
+        for (typename std::map<std::string, T>::const_iterator it = values.begin(); it != values.end(); ++it) {
+            field(it->first.c_str(), it->second);
+        }
+        put('}');
+    }
+
+    template <class T>
+    void write(const T& value) {
+        put('{');
+        comma = false;
+        JsonFields<T>::write(*this, value);
+        put('}');
+    }
+
+    /** Write a quoted string, escaping as required by RFC 8259. */
+    void string(const char* data, size_t size) {
+        put('"');
+
+        size_t done = 0;
+        for (;;) {
+            const size_t pos = plain(data, done, size);
+            append(data + done, pos - done);
+            if (pos == size) {
+                break;
+            }
+
+            escape(data[pos]);
+            done = pos + 1;
+        }
+
+        put('"');
+    }
+
+    void escape(unsigned char c) {
+        static const char hex[] = "0123456789abcdef";
+
+        char* output = reserve(6);
+        output[0] = '\\';
+        switch (c) {
+        case '"':
+        case '\\':
+            output[1] = c;
+            length += 2;
+            break;
+        case '\n':
+            output[1] = 'n';
+            length += 2;
+            break;
+        case '\r':
+            output[1] = 'r';
+            length += 2;
+            break;
+        case '\t':
+            output[1] = 't';
+            length += 2;
+            break;
+        default:
+            output[1] = 'u';
+            output[2] = '0';
+            output[3] = '0';
+            output[4] = hex[c >> 4];
+            output[5] = hex[c & 15];
+            length += 6;
+        }
+    }
+
+    static bool special(unsigned char c) {
+        return c < 0x20 || c == '"' || c == '\\';
+    }
+
+    /**
+     * Skip characters that need no escaping, a word at a time.
+     * @return position of the next character to escape, or size
+     */
+    static size_t plain(const char* data, size_t pos, size_t size) {
+        const unsigned long ones = ~0UL / 255;
+        const unsigned long highs = ones * 0x80;
+
+        while (pos + sizeof(unsigned long) <= size) {
+            unsigned long word;
+            std::memcpy(&word, data + pos, sizeof(word));
+
+            /* nonzero if any byte is below 0x20, '"' or '\\' */
+            const unsigned long quote = word ^ (ones * '"');
+            const unsigned long backslash = word ^ (ones * '\\');
+            const unsigned long candidates = ((word - ones * 0x20) | (quote - ones) | (backslash - ones)) & ~word & highs;
+            if (candidates) {
+                for (size_t i = 0; i < sizeof(unsigned long); ++i) {
+                    if (special(data[pos + i])) {
+                        return pos + i;
+                    }
+                }
+            }
+            pos += sizeof(unsigned long);
+        }
+
+        while (pos < size && !special(data[pos])) {
+            ++pos;
+        }
+
+        return pos;
+    }
+};
+
+} /* namespace mhttpd */
+
+#endif /* MHTTPD_JSON_H_ */
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cerrno>       /* errno */
+#include <cstdio>       /* std::perror() */
+#include <cstdlib>      /* std::getenv() */
+#include <cstring>      /* std::strcmp() */
+#include <map>          /* std::map */
+#include <set>          /* std::set */
+#include <vector>       /* std::vector */
+
+#include <sys/epoll.h>  /* epoll_create1(), epoll_ctl(), epoll_wait() */
+#include <sys/socket.h> /* SOCK_NONBLOCK, SOCK_CLOEXEC */
+#include <unistd.h>     /* close() */
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h> /* struct io_uring_sqe, struct io_uring_cqe */
+#include <signal.h>     /* _NSIG */
+#include <sys/mman.h>   /* mmap(), munmap() */
+#include <sys/syscall.h> /* __NR_io_uring_setup, __NR_io_uring_enter */
+#include <time.h>       /* struct timespec */
+#endif
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Watchers by file descriptor. */
+static std::map<int, Watcher*> loop_watchers;
+
+/** Watchers removed during the current iteration. */
+static std::vector<Watcher*> loop_removed;
+
+/** Call a watcher, unless it was removed by an earlier callback. */
+static void loopready(Watcher* watcher, short revents) {
+    std::map<int, Watcher*>::iterator it = loop_watchers.find(watcher->fd);
+    if (it != loop_watchers.end() && it->second == watcher) {
+        watcher->ready(revents);
+    }
+}
+
+/** Hand a connection accepted by the loop to its listener. */
+static void loopaccepted(Watcher* watcher, int sock) {
+    std::map<int, Watcher*>::iterator it = loop_watchers.find(watcher->fd);
+    if (it != loop_watchers.end() && it->second == watcher) {
+        watcher->accepted(sock);
+    } else {
+        close(sock);
+    }
+}
+
+/** Mechanism the loop waits for events with. */
+class Backend {
+public:
+    virtual ~Backend() {
+    }
+
+    /** Called every iteration for every watcher, with its current events. */
+    virtual void watch(Watcher* watcher, short events) = 0;
+
+    /** Stop watching, called before the watcher's descriptor is closed. */
+    virtual void unwatch(Watcher* watcher) = 0;
+
+    /**
+     * Wait for events and dispatch them.
+     * @param timeout in milliseconds, -1 to wait forever
+     * @return false on failure
+     */
+    virtual bool wait(int timeout) = 0;
+};
+
+/** Level triggered epoll(7), works on every Linux kernel. */
+class Epoll: public Backend {
+public:
+    Epoll() :
+            fd(epoll_create1(EPOLL_CLOEXEC)) {
+        if (fd < 0) {
+            std::perror("epoll_create1() failed");
+        }
+    }
+
+    ~Epoll() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    void watch(Watcher* watcher, short events) {
+        std::map<int, short>::iterator it = registered.find(watcher->fd);
+        if (it != registered.end() && it->second == events) {
+            return;
+        }
+
+        struct epoll_event event = epoll_event();
+        event.events = 0;
+        event.events |= events & POLLIN ? EPOLLIN : 0u;
+        event.events |= events & POLLOUT ? EPOLLOUT : 0u;
+        event.data.fd = watcher->fd;
+
+        if (epoll_ctl(fd, it == registered.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, watcher->fd, &event) < 0) {
+            std::perror("epoll_ctl() failed");
+            return;
+        }
+
+        registered[watcher->fd] = events;
+    }
+
+    void unwatch(Watcher* watcher) {
+        if (registered.erase(watcher->fd)) {
+            epoll_ctl(fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+        }
+    }
+
+    bool wait(int timeout) {
+        struct epoll_event events[64];
+
+        const int count = epoll_wait(fd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (count < 0) {
+            return errno == EINTR;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            std::map<int, Watcher*>::iterator it = loop_watchers.find(events[i].data.fd);
+            if (it == loop_watchers.end()) {
+                continue;
+            }
+
+            short revents = 0;
+            revents |= events[i].events & EPOLLIN ? POLLIN : 0;
+            revents |= events[i].events & EPOLLOUT ? POLLOUT : 0;
+            revents |= events[i].events & EPOLLERR ? POLLERR : 0;
+            revents |= events[i].events & EPOLLHUP ? POLLHUP : 0;
+            loopready(it->second, revents);
+        }
+
+        return true;
+    }
+
+private:
+    const int fd;
+
+    /** Events registered with the kernel, by descriptor. */
+    std::map<int, short> registered;
+};
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_EXT_ARG)
+
+/** Submission queue size of the io_uring backend. */
+static const unsigned uring_entries = 256;
+
+/**
+ * io_uring(7), Linux 5.11 and newer. Watchers are served by one-shot poll
+ * requests, which are level triggered and re-armed in the same system call
+ * that waits for the next completions. Listening sockets use multishot
+ * accept (Linux 5.19), so accepting connections takes no system calls at all.
+ */
+class Uring: public Backend {
+public:
+    Uring() :
+            fd(-1), ring(MAP_FAILED), ringSize(0), sqes(MAP_FAILED), sqesSize(0), sequence(0), multishotAccept(true) {
+        struct io_uring_params params = io_uring_params();
+
+        fd = syscall(__NR_io_uring_setup, uring_entries, &params);
+        if (fd < 0) {
+            return;
+        }
+
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+            close(fd);
+            fd = -1;
+            return;
+        }
+
+        /* submission and completion ring share one mapping */
+        const size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        const size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        ringSize = sqSize > cqSize ? sqSize : cqSize;
+        ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+        if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+            std::perror("mmap(io_uring) failed");
+            close(fd);
+            fd = -1;
+            return;
+        }
+
+        char* base = static_cast<char*>(ring);
+        sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+        tail = *sqTail;
+    }
+
+    ~Uring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (ring != MAP_FAILED) {
+            munmap(ring, ringSize);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    /** Check if the kernel supports what is needed. */
+    bool usable() const {
+        return fd >= 0;
+    }
+
+    void watch(Watcher* watcher, short events) {
+        std::map<Watcher*, Armed>::iterator it = armed.find(watcher);
+        if (it != armed.end()) {
+            if (it->second.accept || it->second.events == events) {
+                return;
+            }
+
+            /* events changed, replace the poll request */
+            cancel(it->second);
+            armed.erase(it);
+        }
+
+        struct io_uring_sqe* sqe = next();
+        Armed state;
+        state.token = ++sequence;
+        state.events = events;
+        state.accept = false;
+
+#ifdef IORING_ACCEPT_MULTISHOT
+        if (multishotAccept && watcher->listening()) {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            state.accept = true;
+        }
+#endif
+
+        if (!state.accept) {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = static_cast<unsigned short>(events);
+        }
+
+        sqe->fd = watcher->fd;
+        sqe->user_data = state.token;
+        armed[watcher] = state;
+        requests[state.token] = watcher;
+    }
+
+    void unwatch(Watcher* watcher) {
+        std::map<Watcher*, Armed>::iterator it = armed.find(watcher);
+        if (it != armed.end()) {
+            cancel(it->second);
+            armed.erase(it);
+        }
+    }
+
+    bool wait(int timeout) {
+        struct timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+        struct io_uring_getevents_arg arg = io_uring_getevents_arg();
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = timeout < 0 ? 0 : reinterpret_cast<unsigned long>(&ts);
+
+        /* submit everything queued and wait for at least one completion */
+        if (enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != EINTR && errno != ETIME) {
+            std::perror("io_uring_enter() failed");
+            return false;
+        }
+
+        unsigned head = *cqHead;
+        const unsigned end = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+        /* copy first, callbacks may queue new requests */
+        std::vector<struct io_uring_cqe> completions;
+        for (; head != end; ++head) {
+            completions.push_back(cqes[head & cqMask]);
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        for (std::vector<struct io_uring_cqe>::const_iterator cqe = completions.begin(); cqe != completions.end(); ++cqe) {
+            complete(*cqe);
+        }
+
+        return true;
+    }
+
+private:
+    /** Request currently in flight for a watcher. */
+    struct Armed {
+        __u64 token;
+
+        short events;
+
+        bool accept;
+    };
+
+    int fd;
+
+    void* ring;
+
+    size_t ringSize;
+
+    void* sqes;
+
+    size_t sqesSize;
+
+    unsigned* sqHead;
+
+    unsigned* sqTail;
+
+    unsigned sqMask;
+
+    unsigned sqEntries;
+
+    unsigned* sqArray;
+
+    /** Submission queue tail, published to the kernel on the next enter. */
+    unsigned tail;
+
+    unsigned* cqHead;
+
+    unsigned* cqTail;
+
+    unsigned cqMask;
+
+    struct io_uring_cqe* cqes;
+
+    /** Last token handed out, tokens are never reused. */
+    __u64 sequence;
+
+    /** Cleared if the kernel does not support multishot accept. */
+    bool multishotAccept;
+
+    std::map<Watcher*, Armed> armed;
+
+    /** Watchers by token of the request in flight. */
+    std::map<__u64, Watcher*> requests;
+
+    /** Cancelled multishot accepts that may still deliver connections. */
+    std::set<__u64> orphans;
+
+    int enter(unsigned wait, unsigned flags, const void* arg, size_t size) {
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        const unsigned submit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+    }
+
+    /** Get a cleared submission queue entry, submitting if the queue is full. */
+    struct io_uring_sqe* next() {
+        while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+            if (enter(0, 0, NULL, 0) < 0 && errno != EINTR && errno != EBUSY) {
+                std::perror("io_uring_enter() failed");
+                break;
+            }
+        }
+
+        const unsigned index = tail & sqMask;
+        struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+        *sqe = io_uring_sqe();
+        sqArray[index] = index;
+        tail += 1;
+        return sqe;
+    }
+
+    void cancel(const Armed& state) {
+        struct io_uring_sqe* sqe = next();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = state.token;
+        sqe->user_data = 0;
+
+        requests.erase(state.token);
+        if (state.accept) {
+            orphans.insert(state.token);
+        }
+    }
+
+    void complete(const struct io_uring_cqe& cqe) {
+        std::map<__u64, Watcher*>::iterator it = requests.find(cqe.user_data);
+        if (it == requests.end()) {
+            /* cancel requests and late completions of cancelled ones */
+            if (orphans.count(cqe.user_data)) {
+                if (cqe.res >= 0) {
+                    close(cqe.res);
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    orphans.erase(cqe.user_data);
+                }
+            }
+            return;
+        }
+
+        Watcher* watcher = it->second;
+        Armed& state = armed[watcher];
+
+        if (!state.accept) {
+            /* one-shot poll, re-armed by the next call to watch() */
+            requests.erase(it);
+            armed.erase(watcher);
+            loopready(watcher, cqe.res < 0 ? POLLERR : static_cast<short>(cqe.res));
+            return;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            /* multishot accept ended, re-armed by the next call to watch() */
+            requests.erase(it);
+            armed.erase(watcher);
+
+            if (cqe.res == -EINVAL) {
+                /* kernel too old, fall back to polling the listening socket */
+                multishotAccept = false;
+                return;
+            }
+        }
+
+        if (cqe.res >= 0) {
+            loopaccepted(watcher, cqe.res);
+        } else if (cqe.res != -ECANCELED) {
+            errno = -cqe.res;
+            std::perror("accept() failed");
+        }
+    }
+};
+
+#endif
+
+/** Backend of this process, created on first use. */
+static Backend* loop_backend = NULL;
+
+static Backend* backend() {
+    if (loop_backend) {
+        return loop_backend;
+    }
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_EXT_ARG)
+    const char* io = std::getenv("MHTTPD_IO");
+    if (io == NULL || std::strcmp(io, "epoll") != 0) {
+        Uring* uring = new Uring();
+        if (uring->usable()) {
+            loop_backend = uring;
+            return loop_backend;
+        }
+        delete uring;
+    }
+#endif
+
+    loop_backend = new Epoll();
+    return loop_backend;
+}
+
+Watcher::~Watcher() {
+    close(fd);
+}
+
+void Loop::add(Watcher* watcher) {
+    loop_watchers[watcher->fd] = watcher;
+}
+
+void Loop::remove(Watcher* watcher) {
+    std::map<int, Watcher*>::iterator it = loop_watchers.find(watcher->fd);
+    if (it != loop_watchers.end() && it->second == watcher) {
+        loop_watchers.erase(it);
+        loop_removed.push_back(watcher);
+
+        if (loop_backend) {
+            loop_backend->unwatch(watcher);
+        }
+    }
+}
+
+void Loop::clear() {
+    /* in a freshly forked worker, the backend must not touch the kernel state shared with the server process */
+    delete loop_backend;
+    loop_backend = NULL;
+
+    for (std::map<int, Watcher*>::iterator it = loop_watchers.begin(); it != loop_watchers.end(); ++it) {
+        delete it->second;
+    }
+    loop_watchers.clear();
+
+    for (std::vector<Watcher*>::iterator it = loop_removed.begin(); it != loop_removed.end(); ++it) {
+        delete *it;
+    }
+    loop_removed.clear();
+}
+
+bool Loop::iterate(int timeout) {
+    Backend* events = backend();
+
+    for (std::map<int, Watcher*>::iterator it = loop_watchers.begin(); it != loop_watchers.end(); ++it) {
+        events->watch(it->second, it->second->events());
+    }
+
+    /* wake up for the next timer */
+    const int deadline = Timer::next();
+    if (deadline >= 0 && (timeout < 0 || deadline < timeout)) {
+        timeout = deadline;
+    }
+
+    const bool result = events->wait(timeout);
+    Timer::run();
+
+    for (std::vector<Watcher*>::iterator it = loop_removed.begin(); it != loop_removed.end(); ++it) {
+        delete *it;
+    }
+    loop_removed.clear();
+
+    return result;
+}
+
+} /* namespace mhttpd */
@@ -24,34 +24,34 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cerrno>       /* errno */
 #include <cstdio>       /* std::perror() */
-#include <cstdlib>      /* std::exit() */
+#include <cstdlib>      /* std::exit(), std::strtoul() */
+#include <cstring>      /* std::memcpy(), std::memset() */
 #include <ctime>        /* std::time() */
 #include <iostream>     /* std::cout */
 #include <sstream>      /* std::stringstream */
 #include <vector>       /* std::vector */
 
-#include <netdb.h>      /* accept(), send(), shutdown() recv() */
-#include <unistd.h>     /* fork(), close() */
+#include <arpa/inet.h>  /* inet_ntop() */
+#include <fcntl.h>      /* fcntl() */
+#include <netdb.h>      /* accept4(), send(), shutdown() recv(), getaddrinfo(), getsockname() */
+#include <netinet/tcp.h> /* TCP_NODELAY, TCP_DEFER_ACCEPT, TCP_FASTOPEN */
+#include <sys/un.h>     /* struct sockaddr_un */
+#include <signal.h>     /* sigaction(), kill() */
+#include <unistd.h>     /* fork(), _exit(), close() */
 #include <wait.h>       /* sig_atomic_t, signal(), waitpid() */
 
 #include "mhttpd.h"
+#include "internal.h"
+#include "json.h"
 
 namespace mhttpd {
 
-class Request::Implementation {
-public:
-    Implementation(const int sock) :
-            sock(sock) {
-    }
-
-    ~Implementation() {
-    }
-
-    /** Unix socket to read from. */
-    const int sock;
-};
-
 Request::Request(const int sock) :
         implementation(new Implementation(sock)) {
     port = ip[0] = ip[1] = ip[2] = ip[3] = 0;
@@ -66,82 +66,142 @@ size_t Request::get(char& c) {
 }
 
 size_t Request::read(char* buffer, size_t length) {
-    return recv(implementation->sock, buffer, length, 0);
+    if (implementation->inputPos < implementation->input.size()) {
+        size_t bytes = implementation->input.copy(buffer, length, implementation->inputPos);
+        implementation->inputPos += bytes;
+        return bytes;
+    }
+
+    if (implementation->sock < 0) {
+        return 0;
+    }
+
+    if (!implementation->bodyBudget.begin(implementation->sock, SO_RCVTIMEO)) {
+        return 0;
+    }
+
+    const ssize_t bytes = recv(implementation->sock, buffer, length, 0);
+    implementation->bodyBudget.end();
+    if (bytes > 0) {
+        capturedata(trace_request, buffer, bytes);
+    }
+
+    return bytes;
 }
 
-class Response::Implementation {
-public:
-    Implementation(const int sock) :
-            sock(sock), headerSent(false) {
+Response::Implementation::~Implementation() {
+    if (!sendBuffer.empty()) {
+        writeBuffer(sendBuffer.data(), sendBuffer.size());
     }
 
-    ~Implementation() {
-        if (!sendBuffer.empty()) {
-            writeBuffer(sendBuffer.data(), sendBuffer.size());
-        }
+    if (sink) {
+        sink->finish();
     }
 
-    void sendHeader(Response& response) {
-        headerSent = true;
-        response << response.version << " " << response.statusCode << " " << response.statusMessage << "\r\n";
-        response << "Content-Type: " << response.contentType << "\r\n";
-        response << "Connection: Close\r\n";
+    tracepoint(TRACE_LAST_BYTE, trace_request);
+    MHTTPD_PROBE1(last_byte, trace_request);
+}
 
-        for (std::map<std::string, std::string>::const_iterator it = response.fields.begin(); it != response.fields.end(); ++it) {
-            response << it->first << ": " << it->second << "\r\n";
-        }
+void Response::Implementation::start() {
+    started = true;
+    tracepoint(TRACE_FIRST_BYTE, trace_request);
+    MHTTPD_PROBE1(first_byte, trace_request);
+}
 
-        response << "\r\n";
+void Response::Implementation::sendHeader(Response& response) {
+    headerSent = true;
+
+    if (sink) {
+        start();
+        sink->header(response);
+        return;
     }
 
-    void write(const char* buffer, size_t length) {
-        if (sendBuffer.empty()) {
-            if (length >= BUFSIZ) {
-                /* empty sendBuffer && big buffer => send directly */
-                writeBuffer(buffer, length);
-            } else {
-                /* empty sendBuffer && small buffer => put in sendBuffer */
-                for (size_t i = 0; i < length; ++i) {
-                    sendBuffer.push_back(buffer[i]);
-                }
-            }
+    response << response.version << " " << response.statusCode << " " << response.statusMessage << "\r\n";
+    response << "Content-Type: " << response.contentType << "\r\n";
+    response << "Connection: Close\r\n";
 
-            return;
+    for (std::map<std::string, std::string>::const_iterator it = response.fields.begin(); it != response.fields.end(); ++it) {
+        /* a line per value of fields that cannot be combined, see Response::fields */
+        size_t begin = 0;
+        for (size_t end; (end = it->second.find('\n', begin)) != std::string::npos; begin = end + 1) {
+            response << it->first << ": " << it->second.substr(begin, end - begin) << "\r\n";
         }
+        response << it->first << ": " << it->second.substr(begin) << "\r\n";
+    }
 
-        if (sendBuffer.size() + length < BUFSIZ) {
-            /* sum(data) is small => put in sendBuffer */
-            for (size_t i = 0; i < length; ++i) {
-                sendBuffer.push_back(buffer[i]);
-            }
+    response << "\r\n";
+}
+
+void Response::Implementation::flush(Response& response, bool more) {
+    if (!headerSent) {
+        sendHeader(response);
+    }
+
+    if (!sendBuffer.empty()) {
+        writeBuffer(sendBuffer.data(), sendBuffer.size(), more);
+        sendBuffer.clear();
+    }
+}
+
+void Response::Implementation::write(const char* buffer, size_t length) {
+    if (sendBuffer.empty()) {
+        if (length >= BUFSIZ) {
+            /* empty sendBuffer && big buffer => send directly */
+            writeBuffer(buffer, length);
         } else {
-            /* sum(data) is big => empty sendBuffer and try again */
-            writeBuffer(sendBuffer.data(), sendBuffer.size());
-            sendBuffer.clear();
-            write(buffer, length);
+            /* empty sendBuffer && small buffer => put in sendBuffer */
+            sendBuffer.insert(sendBuffer.end(), buffer, buffer + length);
         }
+
+        return;
     }
 
-    /** Unix socket to write to. */
-    const int sock;
+    if (sendBuffer.size() + length < BUFSIZ) {
+        /* sum(data) is small => put in sendBuffer */
+        sendBuffer.insert(sendBuffer.end(), buffer, buffer + length);
+    } else {
+        /* sum(data) is big => empty sendBuffer and try again, corked only if the rest is sent right away */
+        writeBuffer(sendBuffer.data(), sendBuffer.size(), length >= BUFSIZ);
+        sendBuffer.clear();
+        write(buffer, length);
+    }
+}
 
-    /** Set if HTTP header was sent. */
-    bool headerSent;
+void Response::Implementation::writeBuffer(const char* buffer, size_t length, bool more) {
+    if (sink) {
+        sink->body(buffer, length);
+        return;
+    }
 
-private:
-    std::vector<char> sendBuffer;
+    /* do not wait for the write timeout over and over again */
+    if (failed) {
+        return;
+    }
 
-    void writeBuffer(const char* buffer, size_t length) {
-        size_t offset = 0;
-        while (offset < length) {
-            ssize_t bytes = send(sock, buffer + offset, length - offset, 0);
-            if (bytes < 0) {
-                break;
-            }
-            offset += bytes;
+    if (!started) {
+        start();
+    }
+
+    /* e.g. the header, followed by the body: do not push a partial segment */
+    const int flags = more && server_sockets.cork ? MSG_MORE : 0;
+
+    size_t offset = 0;
+    while (offset < length) {
+        if (!writeBudget.begin(sock, SO_SNDTIMEO)) {
+            failed = true;
+            break;
+        }
+
+        ssize_t bytes = send(sock, buffer + offset, length - offset, flags);
+        writeBudget.end();
+        if (bytes < 0) {
+            failed = true;
+            break;
         }
+        offset += bytes;
     }
-};
+}
 
 Response::Response(const int sock) :
         version("HTTP/1.1"), statusCode(501), statusMessage("Not Implemented"), contentType("application/octet-stream"), implementation(new Implementation(sock)) {
@@ -172,9 +232,8 @@ Response& operator<<(Response& response, const std::string& string) {
 }
 
 Response& operator<<(Response& response, const int& i) {
-    std::stringstream stream;
-    stream << i;
-    return response << stream.str();
+    char buffer[24];
+    return response.write(buffer, Json::format(buffer, static_cast<long>(i)));
 }
 
 class Log::Implementation {
@@ -194,8 +253,14 @@ public:
         stream << string;
     }
 
-    void writeAddress(const unsigned char ip[4], const unsigned short port) {
-        stream << "(" << (int) ip[0] << "." << (int) ip[1] << "." << (int) ip[2] << "." << (int) ip[3] << ":" << (int) port << ") ";
+    void writeAddress(const std::string& address, const unsigned short port) {
+        if (address.find(':') == std::string::npos) {
+            stream << "(" << address << ":" << (int) port << ") ";
+        } else if (port) {
+            stream << "([" << address << "]:" << (int) port << ") ";
+        } else {
+            stream << "(" << address << ") ";
+        }
     }
 
     std::stringstream stream;
@@ -209,7 +274,7 @@ Log::Log() :
 Log::Log(const Request& request) :
         implementation(new Implementation) {
     implementation->writeTime();
-    implementation->writeAddress(request.ip, request.port);
+    implementation->writeAddress(request.address, request.port);
 }
 
 Log::~Log() {
@@ -246,68 +311,152 @@ Log& Log::operator<<(const std::string& value) {
     return *this;
 }
 
-static int server_socket_fd;
-
 static volatile sig_atomic_t server_running = 1;
 
+Timeouts server_timeouts = {10, 10, 60, 10};
+
+SocketOptions server_sockets = {0, 0, true, true};
+
+/** Connections accepted, numbers requests for tracing. */
+static unsigned long server_requests = 0;
+
+/** Return value of start(), set on fatal errors. */
+static int server_result = 0;
+
 static void server_signal(int) {
-    close(server_socket_fd);
     server_running = 0;
 }
 
-static void server_worker(int sock, struct sockaddr_in* sockaddr, handler_t handler) {
-    /* double fork to avoid zombie processes */
+/**
+ * Fill in the client address of a request.
+ * @param local path of the listening socket for Unix domain sockets
+ */
+static void setpeer(Request& request, const struct sockaddr_storage* sockaddr, const std::string& local) {
+    char string[INET6_ADDRSTRLEN] = {0};
+
+    if (sockaddr->ss_family == AF_INET) {
+        const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(sockaddr);
+        request.port = ntohs(in->sin_port);
+        request.ip[0] = 0xff & (in->sin_addr.s_addr >> 0);
+        request.ip[1] = 0xff & (in->sin_addr.s_addr >> 8);
+        request.ip[2] = 0xff & (in->sin_addr.s_addr >> 16);
+        request.ip[3] = 0xff & (in->sin_addr.s_addr >> 24);
+        inet_ntop(AF_INET, &in->sin_addr, string, sizeof(string));
+        request.address = string;
+    } else if (sockaddr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = reinterpret_cast<const struct sockaddr_in6*>(sockaddr);
+        request.port = ntohs(in6->sin6_port);
+
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            /* IPv4 client on a dual stack socket */
+            for (size_t i = 0; i < 4; ++i) {
+                request.ip[i] = in6->sin6_addr.s6_addr[12 + i];
+            }
+            inet_ntop(AF_INET, in6->sin6_addr.s6_addr + 12, string, sizeof(string));
+        } else {
+            inet_ntop(AF_INET6, &in6->sin6_addr, string, sizeof(string));
+        }
+        request.address = string;
+    } else if (sockaddr->ss_family == AF_UNIX) {
+        request.address = "unix:" + local;
+    }
+}
+
+/** Wait no longer than the idle timeout for further requests. */
+static void server_idle(int sock) {
+    struct timeval timeval = {static_cast<time_t>(server_timeouts.idle), 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeval, sizeof(timeval));
+}
+
+Budget::Budget(unsigned seconds) :
+        limited(seconds != 0), left(seconds * 1000UL), since(0) {
+}
+
+bool Budget::begin(int sock, int option) {
+    if (!limited) {
+        return true;
+    }
+
+    /* a zero timeout would wait forever */
+    if (left == 0) {
+        return false;
+    }
+
+    struct timeval timeval = {static_cast<time_t>(left / 1000), static_cast<suseconds_t>(left % 1000 * 1000)};
+    if (setsockopt(sock, SOL_SOCKET, option, &timeval, sizeof(timeval)) < 0) {
+        return false;
+    }
+
+    since = schedulernow();
+    return true;
+}
+
+void Budget::end() {
+    if (limited) {
+        const unsigned long passed = schedulernow() - since;
+        left = passed < left ? left - passed : 0;
+    }
+}
+
+int serverfork() {
     pid_t pid = fork();
     switch (pid) {
     case -1:
         /* error */
-        std::perror("double fork() failed");
-        return;
+        std::perror("fork() failed");
+        return -1;
 
     case 0:
-        /* child */
-        break;
+        /*
+         * child, double fork to avoid zombie processes. Only this child is
+         * waited for, so it leaves right away, before the worker drops the
+         * file descriptors of the server process.
+         */
+        pid = fork();
+        if (pid < 0) {
+            std::perror("double fork() failed");
+        }
+        if (pid != 0) {
+            _exit(0);
+        }
+        return 0;
 
     default:
         /* parent */
-        std::exit(0);
-        break;
+        int status;
+        waitpid(pid, &status, 0);
+        return 1;
     }
+}
+
+/**
+ * Serve a connection in a freshly forked worker.
+ * @param buffer received data, starting with the request header
+ * @param received number of bytes received
+ * @param length length of the request header, including the final "\r\n\r\n"
+ * @return false if the connection was handed over to the server process
+ */
+static bool server_worker(unsigned long id, int sock, const char* buffer, size_t received, size_t length, const struct sockaddr_storage* sockaddr, const std::string& local, handler_t handler) {
+    traceworker(id);
+    const unsigned long begin = tracebegin();
 
-    /* set timeout to 5 seconds */
-    struct timeval timeval = {5, 0};
+    /* give up on clients that stop reading or sending the body, see Budget for trickling ones */
+    struct timeval timeval = {static_cast<time_t>(server_timeouts.body), 0};
     if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeval, sizeof(timeval)) < 0) {
         std::perror("setsockopt(rcvtimeo) failed");
-        return;
+        return true;
     }
 
-    char buffer[BUFSIZ] = {0};
-    size_t length = 0;
-
-    do {
-        ssize_t read = recv(sock, buffer + length, (BUFSIZ - length) > 0 ? 1 : 0, 0);
-
-        if (read == 0) {
-            /* connection closed => close connection */
-            return;
-        }
-
-        if (read < 0) {
-            /* timeout / another error => close connection */
-            return;
-        }
-
-        length += read;
-
-        if (length >= BUFSIZ) {
-            /* maximum request size reached => close connection */
-            return;
-        }
-    } while (length < 4 || buffer[length - 4] != '\r' || buffer[length - 3] != '\n' || buffer[length - 2] != '\r' || buffer[length - 1] != '\n');
+    timeval.tv_sec = server_timeouts.write;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeval, sizeof(timeval)) < 0) {
+        std::perror("setsockopt(sndtimeo) failed");
+        return true;
+    }
 
     size_t pos = 0;
     Request request(sock);
-    Response response(sock);
+    Access::of(request).input.assign(buffer + length, received - length);
+    Access::of(request).bodyBudget = Budget(server_timeouts.body);
 
     /* parse request type */
     while (pos < length && buffer[pos] != ' ') {
@@ -319,7 +468,7 @@ static void server_worker(int sock, struct sockaddr_in* sockaddr, handler_t hand
     if (pos < length && buffer[pos] == ' ') {
         pos += 1;
     } else {
-        return;
+        return true;
     }
 
     /* parse request path */
@@ -332,7 +481,7 @@ static void server_worker(int sock, struct sockaddr_in* sockaddr, handler_t hand
     if (pos < length && buffer[pos] == ' ') {
         pos += 1;
     } else {
-        return;
+        return true;
     }
 
     /* parse request http version */
@@ -345,7 +494,7 @@ static void server_worker(int sock, struct sockaddr_in* sockaddr, handler_t hand
     if (pos < length - 1 && buffer[pos] == '\r' && buffer[pos + 1] == '\n') {
         pos += 2;
     } else {
-        return;
+        return true;
     }
 
     /* parse header fields */
@@ -362,7 +511,7 @@ static void server_worker(int sock, struct sockaddr_in* sockaddr, handler_t hand
         if (pos < length && buffer[pos] == ':') {
             pos += 1;
         } else {
-            return;
+            return true;
         }
 
         /* remove whitespace before content */
@@ -379,114 +528,800 @@ static void server_worker(int sock, struct sockaddr_in* sockaddr, handler_t hand
         if (pos < length - 1 && buffer[pos] == '\r' && buffer[pos + 1] == '\n') {
             pos += 2;
         } else {
-            return;
+            return true;
         }
 
         request.fields[key] = value;
     }
 
+    Access::of(request).target = request.path;
+
     /* parse path parameters */
     if ((pos = request.path.find('?')) != std::string::npos) {
-        std::string query = request.path.substr(pos + 1, std::string::npos);
+        parseparameters(request.path.substr(pos + 1, std::string::npos), request.parameters);
         request.path.erase(pos);
+    }
+
+    request.path = urldecode(request.path);
+    setpeer(request, sockaddr, local);
+    tracespan(TRACE_PARSE, id, begin);
+    MHTTPD_PROBE1(parse, id);
+
+    /* HTTP/2 with prior knowledge, see RFC 7540 section 3.4 */
+    if (request.type == "PRI" && request.path == "*" && request.version == "HTTP/2.0") {
+        char preface[6];
+        if (request.read(preface, sizeof(preface)) != sizeof(preface) || std::string(preface, sizeof(preface)) != "SM\r\n\r\n") {
+            return true;
+        }
+
+        server_idle(sock);
+
+        http2(sock, NULL, std::string(), request, handler);
+        return true;
+    }
 
-        while (!query.empty()) {
-            std::string key;
-            std::string val;
+    /* HTTP/2 upgrade, see RFC 7540 section 3.2 */
+    if (request.fields.count("Upgrade") && request.fields["Upgrade"].find("h2c") != std::string::npos && request.fields.count("HTTP2-Settings") && !request.fields.count("Content-Length") && !request.fields.count("Transfer-Encoding")) {
+        server_idle(sock);
+        http2(sock, &request, request.fields["HTTP2-Settings"], request, handler);
+        return true;
+    }
 
-            pos = query.find('&');
-            key = query.substr(0, pos);
-            query.erase(0, pos);
-            query.erase(0, 1);
+    Response response(sock);
+    Access::of(response).writeBudget = Budget(server_timeouts.write);
+    const unsigned long calling = tracebegin();
+    MHTTPD_PROBE2(handler_start, id, request.path.c_str());
+    handler(request, response);
+    tracespan(TRACE_HANDLER, id, calling);
+    MHTTPD_PROBE2(handler_done, id, response.statusCode);
+    return !Access::of(response).detached;
+}
 
-            if ((pos = key.find('=')) != std::string::npos) {
-                val = key.substr(pos + 1, std::string::npos);
-                key.erase(pos);
+/**
+ * Connection whose request header is still being received. Slow clients wait
+ * here, bound by the header timeout, instead of occupying a worker.
+ */
+class Pending: public Watcher, public Timer, public Queued {
+public:
+    Pending(unsigned long id, int fd, const struct sockaddr_storage* client_addr, const std::string& local, handler_t handler) :
+            Watcher(fd), id(id), begin(tracebegin()), client_addr(*client_addr), local(local), handler(handler), received(0), length(0), queued(false) {
+        start(server_timeouts.header * 1000UL);
+    }
+
+    short events() {
+        /* the client is not read from while waiting, only hang ups matter */
+        return queued ? 0 : POLLIN;
+    }
+
+    void ready(short revents) {
+        if (queued) {
+            if (revents & (POLLHUP | POLLERR)) {
+                schedulerunqueue(this);
+                close();
             }
+            return;
+        }
+
+        const ssize_t read = recv(fd, buffer + received, BUFSIZ - received, MSG_DONTWAIT);
+
+        if (read < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+
+        if (read <= 0) {
+            /* connection closed / another error => close connection */
+            close();
+            return;
+        }
+
+        capturedata(id, buffer + received, read);
+        const size_t from = received < 3 ? 0 : received - 3;
+        received += read;
+
+        for (size_t i = from; i + 3 < received; ++i) {
+            if (buffer[i] == '\r' && buffer[i + 1] == '\n' && buffer[i + 2] == '\r' && buffer[i + 3] == '\n') {
+                tracespan(TRACE_HEADER, id, begin);
+                MHTTPD_PROBE1(header, id);
+                complete(i + 4);
+                return;
+            }
+        }
+
+        if (received >= BUFSIZ) {
+            /* maximum request size reached => close connection */
+            close();
+        }
+    }
 
-            request.parameters.insert(std::pair<std::string, std::string>(urldecode(key), urldecode(val)));
+    void expired() {
+        if (queued) {
+            /* waited for a worker past the deadline */
+            schedulerunqueue(this);
+            reject();
+            return;
         }
+
+        close();
     }
 
-    request.path = urldecode(request.path);
-    request.port = ntohs(sockaddr->sin_port);
-    request.ip[0] = 0xff & (sockaddr->sin_addr.s_addr >> 0);
-    request.ip[1] = 0xff & (sockaddr->sin_addr.s_addr >> 8);
-    request.ip[2] = 0xff & (sockaddr->sin_addr.s_addr >> 16);
-    request.ip[3] = 0xff & (sockaddr->sin_addr.s_addr >> 24);
+    void dispatch() {
+        queued = false;
+        stop();
 
-    handler(request, response);
-}
+        if (deadline != 0 && schedulernow() >= deadline) {
+            reject();
+            return;
+        }
 
-int start(unsigned port, handler_t handler) {
-    /* set up signal handler */
-    if (SIG_ERR == signal(SIGINT, server_signal)) {
-        std::perror("signal() failed");
-        return 1;
+        serve(scheduleracquire());
+        Loop::remove(this);
     }
 
-    /* create socket */
-    if (-1 == (server_socket_fd = socket(AF_INET, SOCK_STREAM, 0))) {
-        std::perror("socket() failed");
-        return 1;
+    int handoff(std::string& message) {
+        putstring(message, local);
+        putstring(message, std::string(reinterpret_cast<const char*>(&client_addr), sizeof(client_addr)));
+        putnumber(message, length);
+        putstring(message, std::string(buffer, received));
+        return fd;
     }
 
-    /* bind socket to local address */
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    if (-1 == bind(server_socket_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr))) {
-        std::perror("bind() failed");
-        return 1;
+    void handedOff() {
+        queued = false;
+        close();
     }
 
-    /* mark socket as listening socket */
-    if (-1 == listen(server_socket_fd, SOMAXCONN)) {
-        std::perror("listen() failed");
-        return 1;
+    /** Take over the header of a request passed on by another shard. */
+    void adopt(const std::string& head, size_t length, Server::Priority priority, unsigned long remaining) {
+        head.copy(buffer, head.size());
+        received = head.size();
+        this->length = length;
+        this->priority = priority;
+        deadline = remaining ? schedulernow() + remaining : 0;
+        schedule();
+    }
+
+private:
+    /** Number of the request in this shard, for tracing. */
+    const unsigned long id;
+
+    /** Time the connection was accepted, for tracing. */
+    const unsigned long begin;
+
+    const struct sockaddr_storage client_addr;
+
+    /** Path of a Unix domain socket, empty for TCP. */
+    const std::string local;
+
+    const handler_t handler;
+
+    char buffer[BUFSIZ];
+
+    size_t received;
+
+    /** Length of the request header, set once complete. */
+    size_t length;
+
+    /** Set while waiting for a worker. */
+    bool queued;
+
+    /** Stop serving the connection. */
+    void close() {
+        stop();
+        captureclose(id);
+        Loop::remove(this);
+    }
+
+    /** Answer a request that waited too long with 503, without blocking. */
+    void reject() {
+        static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: Close\r\n\r\n";
+        send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close();
+    }
+
+    /** The request header is complete, serve it or wait for a worker. */
+    void complete(size_t length) {
+        this->length = length;
+
+        if (!schedulerenabled()) {
+            serve(-1);
+            Loop::remove(this);
+            return;
+        }
+
+        schedulerclassify(buffer, length, *this);
+        schedule();
+    }
+
+    /** Fork a worker if one is available, wait for one otherwise. */
+    void schedule() {
+        stop();
+
+        const int slot = scheduleracquire();
+        if (slot >= 0) {
+            serve(slot);
+            Loop::remove(this);
+            return;
+        }
+
+        queued = true;
+        schedulerqueue(this);
+
+        if (deadline != 0) {
+            const unsigned long now = schedulernow();
+            start(deadline > now ? deadline - now : 0);
+        }
+    }
+
+    /**
+     * Fork a worker for the connection.
+     * @param slot worker slot to hand to the worker, see scheduleracquire(),
+     *        -1 if the number of workers is not limited
+     */
+    void serve(int slot) {
+        /* for workers handing work back to this process */
+        const int channel = supervisorchannel();
+
+        switch (serverfork()) {
+        case -1:
+            /* error */
+            if (slot >= 0) {
+                ::close(slot);
+            }
+            if (channel >= 0) {
+                ::close(channel);
+            }
+            server_result = 1;
+            server_running = 0;
+            return;
+
+        case 0: {
+            /* worker, drop the file descriptors of the server process */
+            const int socket_fd = dup(fd);
+            fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+            const unsigned long request = id;
+            const std::string head(buffer, received);
+            const size_t header = length;
+            const struct sockaddr_storage addr = client_addr;
+            const std::string path = local;
+            const handler_t callback = handler;
+            Loop::clear();
+            supervisorenter(channel);
+            if (server_worker(request, socket_fd, head.data(), head.size(), header, &addr, path, callback)) {
+                shutdown(socket_fd, SHUT_RDWR);
+            }
+            captureclose(request);
+            ::close(socket_fd);
+            std::exit(0);
+        }
+
+        default:
+            /* parent, the slot is released once the worker exits */
+            if (slot >= 0) {
+                ::close(slot);
+            }
+            if (channel >= 0) {
+                ::close(channel);
+            }
+        }
     }
+};
+
+/** Handler of the running server, for requests passed on by other shards. */
+static handler_t server_handler = NULL;
+
+void serveradopt(const std::string& message, size_t pos, int fd, Server::Priority priority, unsigned long remaining) {
+    std::string local;
+    std::string address;
+    unsigned long length;
+    std::string head;
+
+    if (!getstring(message, pos, local) || !getstring(message, pos, address) || address.size() != sizeof(struct sockaddr_storage) || !getnumber(message, pos, length) || !getstring(message, pos, head) || head.size() > BUFSIZ || length > head.size() || server_handler == NULL) {
+        close(fd);
+        return;
+    }
+
+    struct sockaddr_storage client_addr;
+    std::memcpy(&client_addr, address.data(), sizeof(client_addr));
+
+    const unsigned long id = ++server_requests;
+    captureopen(id);
+    capturedata(id, head.data(), head.size());
+
+    Pending* pending = new Pending(id, fd, &client_addr, local, server_handler);
+    Loop::add(pending);
+    pending->adopt(head, length, priority, remaining);
+}
 
-    /* accept connection and process */
-    while (server_running) {
-        struct sockaddr_in client_addr;
+/** Listening socket, receives request headers and forks a worker for every request. */
+class Listener: public Watcher {
+public:
+    Listener(int fd, const std::string& local, handler_t handler) :
+            Watcher(fd), local(local), handler(handler) {
+    }
+
+    void ready(short) {
+        struct sockaddr_storage client_addr;
         socklen_t client_addr_length = sizeof(client_addr);
-        int socket_fd = accept(server_socket_fd, (struct sockaddr*) &client_addr, &client_addr_length);
+        int socket_fd = accept4(fd, (struct sockaddr*) &client_addr, &client_addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (socket_fd < 0) {
-            if (!server_running) {
+            /* another shard may have been faster */
+            if (server_running && errno != EAGAIN) {
+                std::perror("accept() failed");
+            }
+            return;
+        }
+
+        serve(socket_fd, &client_addr);
+    }
+
+    bool listening() {
+        return true;
+    }
+
+    void accepted(int socket_fd) {
+        struct sockaddr_storage client_addr = sockaddr_storage();
+        socklen_t client_addr_length = sizeof(client_addr);
+        getpeername(socket_fd, (struct sockaddr*) &client_addr, &client_addr_length);
+        serve(socket_fd, &client_addr);
+    }
+
+private:
+    /** Path of a Unix domain socket, empty for TCP. */
+    const std::string local;
+
+    const handler_t handler;
+
+    void serve(int socket_fd, const struct sockaddr_storage* client_addr) {
+        const unsigned long id = ++server_requests;
+        tracepoint(TRACE_ACCEPT, id);
+        MHTTPD_PROBE2(accept, id, socket_fd);
+        captureopen(id);
+
+        Pending* pending = new Pending(id, socket_fd, client_addr, local, handler);
+        Loop::add(pending);
+
+        /* the request often arrives along with the connection */
+        pending->ready(POLLIN);
+    }
+};
+
+void parseparameters(const std::string& string, std::multimap<std::string, std::string>& parameters) {
+    std::string query = string;
+
+    while (!query.empty()) {
+        std::string key;
+        std::string val;
+
+        size_t pos = query.find('&');
+        key = query.substr(0, pos);
+        query.erase(0, pos);
+        query.erase(0, 1);
+
+        if ((pos = key.find('=')) != std::string::npos) {
+            val = key.substr(pos + 1, std::string::npos);
+            key.erase(pos);
+        }
+
+        parameters.insert(std::pair<std::string, std::string>(urldecode(key), urldecode(val)));
+    }
+}
+
+class Server::Implementation {
+public:
+    Implementation(handler_t handler) :
+            handler(handler) {
+    }
+
+    ~Implementation() {
+        for (std::vector<Endpoint>::const_iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+            if (it->fd >= 0) {
+                close(it->fd);
+            }
+
+            if (!it->path.empty()) {
+                unlink(it->path.c_str());
+            }
+        }
+    }
+
+    /** Bound socket, not yet served. */
+    struct Endpoint {
+        int fd;
+
+        /** Path of a Unix domain socket, empty for TCP. */
+        std::string path;
+
+        /** Local address, to bind the sockets of further shards to. */
+        struct sockaddr_storage address;
+
+        socklen_t length;
+    };
+
+    const handler_t handler;
+
+    std::vector<Endpoint> endpoints;
+
+    /** Classification of requests, see classify(). */
+    std::vector<SchedulerRule> rules;
+
+    /**
+     * Create a listening socket.
+     * @param reuse share the address with other sockets, see SO_REUSEPORT
+     * @return socket, -1 on failure
+     */
+    static int openSocket(int family, const struct sockaddr* addr, socklen_t length, const std::string& path, bool reuse) {
+        /* create socket */
+        int fd;
+        if (-1 == (fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0))) {
+            std::perror("socket() failed");
+            return -1;
+        }
+
+        int on = 1;
+        if (family == AF_INET6) {
+            /* let "[::]:port" and "0.0.0.0:port" coexist */
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+        }
+
+        if (reuse && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            std::perror("setsockopt(reuseport) failed");
+            close(fd);
+            return -1;
+        }
+
+        if (family == AF_UNIX) {
+            /* remove a stale socket of an earlier run */
+            unlink(path.c_str());
+        }
+
+        /* bind socket to local address */
+        if (-1 == bind(fd, addr, length)) {
+            std::perror("bind() failed");
+            close(fd);
+            return -1;
+        }
+
+        /* mark socket as listening socket */
+        if (-1 == ::listen(fd, SOMAXCONN)) {
+            std::perror("listen() failed");
+            close(fd);
+            return -1;
+        }
+
+        return fd;
+    }
+
+    bool bindTo(int family, const struct sockaddr* addr, socklen_t length, const std::string& path) {
+        Endpoint endpoint;
+        endpoint.path = path;
+        endpoint.address = sockaddr_storage();
+        std::memcpy(&endpoint.address, addr, length);
+        endpoint.length = length;
+
+        if (-1 == (endpoint.fd = openSocket(family, addr, length, path, false))) {
+            return false;
+        }
+
+        endpoints.push_back(endpoint);
+        return true;
+    }
+
+    /** Apply the socket options of the running server to a TCP listener. */
+    static void tune(int fd) {
+        /* inherited by the accepted connections */
+        int on = server_sockets.noDelay ? 1 : 0;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+            std::perror("setsockopt(nodelay) failed");
+        }
+
+        int seconds = server_sockets.deferAccept;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) < 0) {
+            std::perror("setsockopt(defer_accept) failed");
+        }
+
+        int queue = server_sockets.fastOpen;
+        if (queue > 0 && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) < 0) {
+            std::perror("setsockopt(fastopen) failed");
+        }
+    }
+
+    /** Serve the endpoints from the event loop of this process. */
+    int serve() {
+        server_handler = handler;
+
+        for (std::vector<Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+            if (it->path.empty()) {
+                tune(it->fd);
+            }
+
+            Loop::add(new Listener(it->fd, it->path, handler));
+            it->fd = -1;
+        }
+
+        /* accept connections and serve the event loop */
+        server_result = 0;
+        while (server_running) {
+            if (!Loop::iterate(-1)) {
+                std::perror("poll() failed");
+                server_result = 1;
                 break;
             }
+        }
 
-            std::perror("accept() failed");
-            continue;
+        /* shutdown */
+        Loop::clear();
+        return server_result;
+    }
+
+    /** Serve the endpoints from count shards, each a process of its own. */
+    int serve(unsigned count, void (*setup)(Shard&)) {
+        for (std::vector<Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+            if (it->path.empty()) {
+                /*
+                 * let the sockets of the other shards share the port. The
+                 * option only counts if set before bind(), so open the socket
+                 * anew, at the port actually bound in case it was 0.
+                 */
+                it->length = sizeof(it->address);
+                if (getsockname(it->fd, (struct sockaddr*) &it->address, &it->length) < 0) {
+                    std::perror("getsockname() failed");
+                    return 1;
+                }
+
+                close(it->fd);
+                if (-1 == (it->fd = openSocket(it->address.ss_family, (struct sockaddr*) &it->address, it->length, it->path, true))) {
+                    return 1;
+                }
+            } else {
+                /* shared by all shards, accept() must not block the losers */
+                fcntl(it->fd, F_SETFL, fcntl(it->fd, F_GETFL) | O_NONBLOCK);
+            }
         }
 
-        pid_t pid = fork();
-        switch (pid) {
-        case -1:
-            /* error */
-            std::perror("fork() failed");
+        if (!shardprepare(count) || !schedulerprepare(count)) {
+            shardfinish();
             return 1;
+        }
 
-        case 0:
-            /* child */
-            close(server_socket_fd);
-            server_worker(socket_fd, &client_addr, handler);
-            shutdown(socket_fd, SHUT_RDWR);
-            close(socket_fd);
-            std::exit(0);
+        /* no SA_RESTART, waitpid() has to notice SIGINT to pass it on */
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        sigemptyset(&action.sa_mask);
+        action.sa_handler = server_signal;
+        if (sigaction(SIGINT, &action, NULL) < 0) {
+            std::perror("sigaction() failed");
+            shardfinish();
+            return 1;
+        }
 
-        default:
-            /* parent */
-            close(socket_fd);
-            waitpid(pid, &socket_fd, 0);
+        std::vector<pid_t> shards;
+        for (unsigned index = 0; index < count && server_running; ++index) {
+            pid_t pid = fork();
+            switch (pid) {
+            case -1:
+                /* error, take down the shards started so far */
+                std::perror("fork() failed");
+                server_result = 1;
+                server_running = 0;
+                break;
+
+            case 0:
+                /* child */
+                signal(SIGINT, server_signal);
+                shardenter(index);
+                std::exit(shard(index, setup));
+
+            default:
+                /* parent */
+                shards.push_back(pid);
+                break;
+            }
+        }
+
+        shardfinish();
+        for (std::vector<Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+            close(it->fd);
+            it->fd = -1;
+        }
+
+        size_t alive = shards.size();
+        bool stopping = false;
+        while (alive > 0) {
+            int status;
+            const pid_t pid = waitpid(-1, &status, 0);
+
+            if (pid < 0 && errno != EINTR) {
+                std::perror("waitpid() failed");
+                server_result = 1;
+                break;
+            }
+
+            for (std::vector<pid_t>::iterator it = shards.begin(); pid > 0 && it != shards.end(); ++it) {
+                if (*it == pid) {
+                    *it = 0;
+                    alive -= 1;
+
+                    if (server_running || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                        /* a shard failed on its own, do not limp on without it */
+                        Log() << "shard " << static_cast<int>(it - shards.begin()) << " failed";
+                        server_result = 1;
+                        server_running = 0;
+                    }
+                }
+            }
+
+            if (!server_running && !stopping) {
+                stopping = true;
+                for (std::vector<pid_t>::const_iterator it = shards.begin(); it != shards.end(); ++it) {
+                    if (*it > 0) {
+                        kill(*it, SIGINT);
+                    }
+                }
+            }
+        }
+
+        return server_result;
+    }
+
+private:
+    /** Serve as a shard, in a freshly forked process. */
+    int shard(unsigned index, void (*setup)(Shard&)) {
+        Shard& context = Shard::current();
+
+        for (std::vector<Endpoint>::iterator it = endpoints.begin(); it != endpoints.end(); ++it) {
+            if (!it->path.empty()) {
+                continue;
+            }
+
+            /* a socket of its own, allocated on the local node */
+            if (index > 0) {
+                const int fd = openSocket(it->address.ss_family, (struct sockaddr*) &it->address, it->length, it->path, true);
+                if (fd < 0) {
+                    return 1;
+                }
+                close(it->fd);
+                it->fd = fd;
+            }
+
+#ifdef SO_INCOMING_CPU
+            /* prefer connections whose packets are processed on this CPU */
+            if (context.cpu >= 0) {
+                setsockopt(it->fd, SOL_SOCKET, SO_INCOMING_CPU, &context.cpu, sizeof(context.cpu));
+            }
+#endif
         }
+
+        if (setup) {
+            setup(context);
+        }
+
+        return serve();
+    }
+};
+
+Server::Server(handler_t handler) :
+        headerTimeout(10), bodyTimeout(10), idleTimeout(60), writeTimeout(10), deferAccept(0), fastOpen(0), noDelay(true), cork(true), shards(1), shardSetup(NULL), maxWorkers(0), implementation(new Implementation(handler)) {
+}
+
+Server::~Server() {
+    delete implementation;
+}
+
+bool Server::listen(unsigned port) {
+    struct sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    return implementation->bindTo(AF_INET, (struct sockaddr *) &addr, sizeof(addr), std::string());
+}
+
+bool Server::listen(const std::string& endpoint) {
+    if (endpoint.compare(0, 5, "unix:") == 0) {
+        const std::string path = endpoint.substr(5);
+        struct sockaddr_un addr = sockaddr_un();
+
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            Log() << "invalid socket path: " << endpoint;
+            return false;
+        }
+
+        addr.sun_family = AF_UNIX;
+        path.copy(addr.sun_path, path.size());
+        return implementation->bindTo(AF_UNIX, (struct sockaddr *) &addr, sizeof(addr), path);
+    }
+
+    /* "port", "host:port" or "[host]:port" */
+    std::string host;
+    std::string port = endpoint;
+    size_t pos;
+
+    if (!endpoint.empty() && endpoint[0] == '[' && (pos = endpoint.find("]:")) != std::string::npos) {
+        host = endpoint.substr(1, pos - 1);
+        port = endpoint.substr(pos + 2);
+    } else if ((pos = endpoint.rfind(':')) != std::string::npos) {
+        host = endpoint.substr(0, pos);
+        port = endpoint.substr(pos + 1);
+    }
+
+    if (host.empty()) {
+        return listen(std::strtoul(port.c_str(), NULL, 10));
+    }
+
+    struct addrinfo hints = addrinfo();
+    struct addrinfo* result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    const int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+    if (error) {
+        Log() << "invalid address " << endpoint << ": " << gai_strerror(error);
+        return false;
+    }
+
+    const bool bound = implementation->bindTo(result->ai_family, result->ai_addr, result->ai_addrlen, std::string());
+    freeaddrinfo(result);
+    return bound;
+}
+
+void Server::classify(const std::string& prefix, Priority priority, unsigned deadline) {
+    SchedulerRule rule;
+    rule.prefix = prefix;
+    rule.priority = priority;
+    rule.deadline = deadline;
+    implementation->rules.push_back(rule);
+}
+
+void Server::classify(const std::string& field, const std::string& value, Priority priority, unsigned deadline) {
+    SchedulerRule rule;
+    rule.field = field;
+    rule.value = value;
+    rule.priority = priority;
+    rule.deadline = deadline;
+    implementation->rules.push_back(rule);
+}
+
+int Server::start() {
+    if (implementation->endpoints.empty()) {
+        Log() << "no endpoint to listen on";
+        return 1;
+    }
+
+    server_timeouts.header = headerTimeout;
+    server_timeouts.body = bodyTimeout;
+    server_timeouts.idle = idleTimeout;
+    server_timeouts.write = writeTimeout;
+    server_sockets.deferAccept = deferAccept;
+    server_sockets.fastOpen = fastOpen;
+    server_sockets.noDelay = noDelay;
+    server_sockets.cork = cork;
+    schedulerconfigure(maxWorkers, implementation->rules);
+
+    server_running = 1;
+    server_result = 0;
+
+    const unsigned count = shards ? shards : shardcpus();
+    if (count > 1) {
+        return implementation->serve(count, shardSetup);
+    }
+
+    /* set up signal handler */
+    if (SIG_ERR == signal(SIGINT, server_signal)) {
+        std::perror("signal() failed");
+        return 1;
+    }
+
+    return implementation->serve();
+}
+
+int start(unsigned port, handler_t handler) {
+    Server server(handler);
+
+    if (!server.listen(port)) {
+        return 1;
     }
 
-    /* shutdown */
-    shutdown(server_socket_fd, SHUT_RDWR);
-    close(server_socket_fd);
-    return 0;
+    return server.start();
 }
 
 std::string urlencode(const std::string& s) {
@@ -29,6 +29,7 @@
 
 #include <map>      /* std::map */
 #include <string>   /* std::string */
+#include <vector>   /* std::vector */
 
 namespace mhttpd {
 
@@ -44,10 +45,16 @@ public:
     /** Destroy this request. */
     ~Request();
 
-    /** Client IP address, 0 if unknown. */
+    /**
+     * Client address: dotted IPv4, IPv6 or "unix:" followed by the path of
+     * the listening socket, empty if unknown.
+     */
+    std::string address;
+
+    /** Client IPv4 address, 0 if unknown or not IPv4. */
     unsigned char ip[4];
 
-    /** Client port, 0 if unknown. */
+    /** Client port, 0 if unknown or not TCP. */
     unsigned short port;
 
     /* HTTP request type, see RFC 7231 section 4.3. */
@@ -78,6 +85,8 @@ private:
     /** No copy assignment. */
     Request operator=(const Request&);
 
+    friend class Access;
+
     class Implementation;
     Implementation* const implementation;
 };
@@ -106,7 +115,11 @@ public:
     /** Content type, see RFC 7231 section 7. */
     std::string contentType;
 
-    /** Header fields, see RFC 7231 section 7. */
+    /**
+     * Header fields, see RFC 7231 section 7. Values of a field that cannot
+     * be combined into one, e.g. Set-Cookie, are separated by '\n' and sent
+     * in a line of their own each.
+     */
     std::map<std::string, std::string> fields;
 
     /** Add a character to the output. */
@@ -128,6 +141,8 @@ private:
     /** No copy assignment. */
     Response operator=(const Response&);
 
+    friend class Access;
+
     class Implementation;
     Implementation* const implementation;
 };
@@ -169,9 +184,623 @@ private:
     Implementation* const implementation;
 };
 
+/**
+ * Parser for request bodies of HTML forms, "application/x-www-form-urlencoded"
+ * and "multipart/form-data" (RFC 7578). Fields are added to the parameters of
+ * the request. Uploaded files are streamed to a call back function or
+ * spilled to temporary files as the body arrives, so memory use does not
+ * depend on the size of the body.
+ * Usage: {@code Form form(request); if (form.parse()) ...}
+ */
+class Form {
+public:
+    /** File of a multipart body. */
+    struct File {
+        /** Name of the form field. */
+        std::string name;
+
+        /** File name sent by the client, may be empty. */
+        std::string filename;
+
+        /** Content type sent by the client. */
+        std::string contentType;
+
+        /** Temporary file holding the data, empty if streamed to a call back. */
+        std::string path;
+
+        /** Size of the data in bytes. */
+        size_t size;
+    };
+
+    /**
+     * Call back function for file data.
+     * @param file the file the data belongs to
+     * @param data next block of the file, NULL at the end of the file
+     * @param length size of the block, 0 at the end of the file
+     * @param context value passed to parse()
+     * @return false to abort parsing
+     */
+    typedef bool (*callback_t)(const File& file, const char* data, size_t length, void* context);
+
+    /** Create a parser for the body of a request. */
+    Form(const Request& request);
+
+    /** Destroy this parser, removing temporary files that were not renamed. */
+    ~Form();
+
+    /** Maximum size of a field other than a file. */
+    size_t maxFieldSize;
+
+    /** Directory for temporary files. */
+    std::string directory;
+
+    /**
+     * Parse the body, spilling files to temporary files.
+     * @return false if the body is malformed, incomplete or too large
+     */
+    bool parse();
+
+    /**
+     * Parse the body, streaming files to a call back function.
+     * @return false if the body is malformed, incomplete or too large, or
+     *         if the call back aborted
+     */
+    bool parse(callback_t callback, void* context);
+
+    /** Files of the body, in the order received. */
+    const std::vector<File>& files() const;
+
+private:
+    /** No copy constructor. */
+    Form(const Form&);
+
+    /** No copy assignment. */
+    Form operator=(const Form&);
+
+    class Implementation;
+    Implementation* const implementation;
+};
+
+/**
+ * WebSocket connection, see RFC 6455.
+ * Created from within a handler to upgrade the connection of the request:
+ * {@code WebSocket ws(request, response); while (ws.receive(msg)) ws.send(msg);}
+ * A connection served like this occupies its worker until it is closed; see
+ * detach() for connections that are idle most of the time.
+ */
+class WebSocket {
+public:
+    /** Message types. */
+    enum Type {
+        TEXT = 0x1, BINARY = 0x2
+    };
+
+    /**
+     * Answer a WebSocket upgrade request. On success, "101 Switching
+     * Protocols" is sent and the response must not be used any more.
+     * Otherwise the response is set to "400 Bad Request".
+     */
+    WebSocket(const Request& request, Response& response);
+
+    /** Close the connection, if still open. */
+    ~WebSocket();
+
+    /** Called with each message of a detached connection, see detach(). */
+    typedef void (*callback_t)(WebSocket& socket, const std::string& message, Type type);
+
+    /** Seconds without traffic before a ping is sent, 0 to disable. */
+    unsigned pingInterval;
+
+    /** Maximum size of a received message. */
+    size_t maxMessageSize;
+
+    /** Check if the connection is open. */
+    bool isOpen() const;
+
+    /**
+     * Receive the next message, reassembling fragments and answering control
+     * frames. Returns false once the connection is closed.
+     */
+    bool receive(std::string& message, Type& type);
+
+    /** Receive the next message, ignoring its type. */
+    bool receive(std::string& message);
+
+    /** Send a message. Returns false if the connection is closed. */
+    bool send(const std::string& message, Type type = TEXT);
+
+    /** Close the connection with a status code, see RFC 6455 section 7.4. */
+    void close(unsigned short code = 1000);
+
+    /**
+     * Hand the connection over to the server process, so an idle connection
+     * costs memory instead of a process. The server process answers and
+     * sends pings; each message is passed to callback in a worker of its own,
+     * one at a time and in order. The callback may send and close, but must
+     * not receive. This object must not be used any more afterwards.
+     * @return false if the connection could not be handed over
+     */
+    bool detach(callback_t callback);
+
+private:
+    /** Wrap a connection detached by the server process, see detach(). */
+    explicit WebSocket(int sock);
+
+    /** No copy constructor. */
+    WebSocket(const WebSocket&);
+
+    /** No copy assignment. */
+    WebSocket operator=(const WebSocket&);
+
+    friend class Access;
+
+    class Implementation;
+    Implementation* const implementation;
+};
+
+/**
+ * Broadcast hub for Server-Sent Events, see the "Server-sent events" section
+ * of the HTML living standard. Subscribed connections are held by the server
+ * process, so idle subscribers cost memory instead of a process each. Every
+ * published event is serialized once and shared by all its subscribers.
+ */
+class EventHub {
+public:
+    /** What to do with subscribers that cannot keep up. */
+    enum Policy {
+        /** Skip events for the subscriber until its queue drained. */
+        DROP,
+
+        /** Close the connection of the subscriber. */
+        DISCONNECT
+    };
+
+    /**
+     * Configure the handling of slow subscribers. Call before start().
+     * @param policy what to do with a slow subscriber
+     * @param maxQueued bytes queued for a subscriber before it counts as slow
+     */
+    static void configure(Policy policy, size_t maxQueued);
+
+    /**
+     * Answer a request with an event stream and hand the connection over to
+     * the hub. The response must not be used any more afterwards.
+     * @return false if the connection could not be handed over
+     */
+    static bool subscribe(const Request& request, Response& response, const std::string& channel);
+
+    /**
+     * Publish an event to all subscribers of a channel.
+     * @param channel channel name
+     * @param data event data, may contain several lines
+     * @param event event type, omitted if empty, must not contain line breaks
+     * @param id event id, omitted if empty, must not contain line breaks
+     * @return false if event or id contain a line break, or if the event
+     *         could not be handed to the hub
+     */
+    static bool publish(const std::string& channel, const std::string& data, const std::string& event = std::string(), const std::string& id = std::string());
+
+private:
+    /** No instances. */
+    EventHub();
+};
+
+/**
+ * Reverse proxy, forwarding requests to upstream HTTP/1.1 servers. Idle
+ * upstream connections are pooled by the server process and reused by all
+ * workers. Create proxies before start() and call forward() from a handler.
+ */
+class Proxy {
+public:
+    /** How to pick an upstream for a request. */
+    enum Balancing {
+        ROUND_ROBIN, LEAST_CONNECTIONS
+    };
+
+    /** Create a new proxy. */
+    Proxy(Balancing balancing = ROUND_ROBIN);
+
+    /** Destroy this proxy. */
+    ~Proxy();
+
+    /** Maximum number of idle connections kept per upstream. */
+    size_t maxIdle;
+
+    /** Timeout in seconds for connecting to and talking to an upstream. */
+    unsigned timeout;
+
+    /**
+     * Add an upstream: "host:port", "[host]:port" or "unix:/path/to/socket".
+     * @return false if the endpoint is invalid
+     */
+    bool addUpstream(const std::string& endpoint);
+
+    /**
+     * Forward a request to an upstream and stream its response back. Answers
+     * "502 Bad Gateway" if no upstream can be reached.
+     */
+    void forward(const Request& request, Response& response) const;
+
+private:
+    /** No copy constructor. */
+    Proxy(const Proxy&);
+
+    /** No copy assignment. */
+    Proxy operator=(const Proxy&);
+
+    class Implementation;
+    Implementation* const implementation;
+};
+
 /** Type definition of a mhttp handler. */
 typedef void (*handler_t)(const Request&, Response&);
 
+/**
+ * Cache for the responses of a handler, shared by all workers of a server.
+ * Only GET and HEAD requests on configured routes are cached, keyed on
+ * type, path and parameters. While an entry is computed, other requests for
+ * it wait for the result instead of running the handler, too, and are
+ * answered with it even if it cannot be cached, unless it is meant for a
+ * single client, e.g. sets a cookie, or varies with request fields the key
+ * does not cover, i.e. has a Vary field. Handlers
+ * behind a cache must answer with a plain response, e.g. no WebSocket.
+ * Usage: {@code static Cache cache(handler); cache.route("/news", 5);} and
+ * {@code cache.serve(request, response);} from within the server's handler.
+ */
+class Cache {
+public:
+    /**
+     * Create a new cache.
+     * @param handler call back function computing responses
+     */
+    Cache(handler_t handler);
+
+    /** Destroy this cache. */
+    ~Cache();
+
+    /** Maximum size of all cached responses in bytes. */
+    size_t maxSize;
+
+    /**
+     * Seconds a request waits for a response computed by another worker
+     * before running the handler itself, 0 to wait as long as it takes.
+     */
+    unsigned maxWait;
+
+    /**
+     * Cache responses for paths starting with prefix. The longest matching
+     * prefix wins.
+     * @param ttl seconds a response is served without running the handler
+     * @param stale seconds an expired response is still served while a
+     *        single request refreshes it
+     */
+    void route(const std::string& prefix, unsigned ttl, unsigned stale = 0);
+
+    /** Answer a request from the cache or by running the handler. */
+    void serve(const Request& request, Response& response) const;
+
+private:
+    /** No copy constructor. */
+    Cache(const Cache&);
+
+    /** No copy assignment. */
+    Cache operator=(const Cache&);
+
+    class Implementation;
+    Implementation* const implementation;
+};
+
+/**
+ * Static file compiled into the binary by mhttpd-embed, with precomputed
+ * HTTP/1.1 response headers.
+ */
+struct Asset {
+    /** Request path, e.g. "/css/site.css". */
+    const char* path;
+
+    const char* contentType;
+
+    /** Entity tag, including the quotes. */
+    const char* etag;
+
+    /** Response header for body, from the status line to the empty line. */
+    const char* header;
+
+    const unsigned char* body;
+
+    size_t length;
+
+    /** Response header for gzipBody, NULL if compression did not pay off. */
+    const char* gzipHeader;
+
+    const unsigned char* gzipBody;
+
+    size_t gzipLength;
+};
+
+/**
+ * Serves assets generated by mhttpd-embed straight from read only memory:
+ * no file system access, revalidation by ETag and the gzip variant for
+ * clients that accept it. "/dir/" is answered with "/dir/index.html".
+ * Usage: {@code extern const Asset assets[]; extern const size_t assets_count;
+ * static Assets embedded(assets, assets_count);} and
+ * {@code if (embedded.serve(request, response)) return;} in the handler.
+ */
+class Assets {
+public:
+    /** @param assets table generated by mhttpd-embed, sorted by path */
+    Assets(const Asset* assets, size_t count);
+
+    /**
+     * Answer a GET or HEAD request for an asset.
+     * @return false if there is no such asset
+     */
+    bool serve(const Request& request, Response& response) const;
+
+    /** Find an asset by path, NULL if there is none. */
+    const Asset* find(const std::string& path) const;
+
+private:
+    const Asset* const assets;
+
+    const size_t count;
+};
+
+/**
+ * Key value store in shared memory, for results that handlers would
+ * otherwise recompute in every worker. Create it before Server::start(),
+ * e.g. as a global, so all workers of all shards inherit the mapping.
+ * Entries live in fixed size slabs and are evicted once their time to live
+ * passed or, least recently used first, when memory runs out. Keys are
+ * spread over independently locked stripes; a worker dying while holding a
+ * lock costs the entries of its stripe, not the store.
+ */
+class SharedCache {
+public:
+    /**
+     * Create a store.
+     * @param size bytes of shared memory
+     * @param stripes number of independently locked parts
+     */
+    SharedCache(size_t size = 16 * 1024 * 1024, unsigned stripes = 16);
+
+    /** Unmap the store, in this process only. */
+    ~SharedCache();
+
+    /**
+     * Store a value, replacing the previous one.
+     * @param ttl seconds until the entry expires, 0 for never
+     * @return false if the entry is larger than maxEntry or memory ran out
+     */
+    bool set(const std::string& key, const std::string& value, unsigned ttl = 0);
+
+    /**
+     * Look up a value.
+     * @return false if there is no such entry or it expired
+     */
+    bool get(const std::string& key, std::string& value);
+
+    /**
+     * Remove an entry.
+     * @return false if there was no such entry
+     */
+    bool remove(const std::string& key);
+
+    /** Maximum size of key and value together, in bytes. */
+    static const size_t maxEntry;
+
+private:
+    /** No copy constructor. */
+    SharedCache(const SharedCache&);
+
+    /** No copy assignment. */
+    SharedCache operator=(const SharedCache&);
+
+    class Implementation;
+    Implementation* const implementation;
+};
+
+/**
+ * Context of a shard, see Server::shards. Every shard is a server process of
+ * its own, pinned to a CPU, with its own listeners, event loop, caches and
+ * upstream connections. Workers inherit the context of their shard.
+ */
+class Shard {
+public:
+    /** Context of the shard the calling process belongs to. */
+    static Shard& current();
+
+    /** Index of the shard, 0 to count - 1. */
+    unsigned index;
+
+    /** Number of shards. */
+    unsigned count;
+
+    /** CPU the shard is pinned to, -1 if not pinned. */
+    int cpu;
+
+    /** NUMA node the shard allocates memory from, -1 if unknown. */
+    int node;
+
+    /** Free for the application, e.g. set up in Server::shardSetup. */
+    void* data;
+};
+
+/**
+ * Request tracing. Once enabled, every request leaves timestamped spans for
+ * receiving the header, parsing it and running the handler, plus the points
+ * the connection was accepted and the first and last byte of the response
+ * were sent. Events are kept in a ring buffer shared by a server process and
+ * its workers, one per shard.
+ */
+class Trace {
+public:
+    /**
+     * Start recording, keeping the last capacity events. Call before
+     * Server::start().
+     * @return false on failure
+     */
+    static bool enable(size_t capacity = 65536);
+
+    /**
+     * Recorded events of the current shard in Chrome's trace event format,
+     * e.g. for chrome://tracing or Perfetto. Every request gets a row.
+     */
+    static std::string json();
+};
+
+/**
+ * Traffic capture. Once enabled, everything clients send is appended to a
+ * binary log, with timestamps and connection boundaries, to be replayed
+ * against a server later with mhttpd-replay. Bodies a Proxy forwards with
+ * splice(2) bypass the capture.
+ */
+class Traffic {
+public:
+    /**
+     * Start capturing into a file, replacing it. Call before Server::start().
+     * @return false on failure
+     */
+    static bool capture(const std::string& path);
+};
+
+/** HTTP server, serving any number of endpoints from one event loop per shard. */
+class Server {
+public:
+    /**
+     * Create a new server.
+     * @param handler call back function for incoming request
+     */
+    Server(handler_t handler);
+
+    /** Destroy this server, closing all endpoints. */
+    ~Server();
+
+    /**
+     * Listen on a TCP port on all IPv4 addresses.
+     * @return false on failure
+     */
+    bool listen(unsigned port);
+
+    /**
+     * Listen on an endpoint: "8080" (all IPv4 addresses), "127.0.0.1:8080",
+     * "[::]:8080" (IPv6 only) or "unix:/path/to/socket".
+     * @return false on failure
+     */
+    bool listen(const std::string& endpoint);
+
+    /**
+     * Serve all endpoints.
+     * @return non-zero value on failure, 0 on termination by SIGINT.
+     */
+    int start();
+
+    /** Priority classes of requests, see classify(). */
+    enum Priority {
+        HIGH, NORMAL, LOW
+    };
+
+    /**
+     * Classify requests whose target starts with prefix, e.g. "/health".
+     * Rules are checked in the order they were added and the first match
+     * wins; other requests are NORMAL. Only takes effect with maxWorkers set.
+     * @param deadline milliseconds the request may wait for a worker, after
+     *        which it is answered with 503 before its handler runs, 0 for no
+     *        limit
+     */
+    void classify(const std::string& prefix, Priority priority, unsigned deadline = 0);
+
+    /**
+     * Classify requests carrying a header field with the given value, e.g.
+     * "X-Priority: batch". Field names are case insensitive, see above.
+     */
+    void classify(const std::string& field, const std::string& value, Priority priority, unsigned deadline = 0);
+
+    /**
+     * Seconds a client may take to send the complete request header,
+     * 10 by default. Until then, the connection does not occupy a worker.
+     */
+    unsigned headerTimeout;
+
+    /**
+     * Seconds a client may take to send the body, 10 by default. Counts the
+     * time the worker waits for data, not the time the handler takes.
+     */
+    unsigned bodyTimeout;
+
+    /** Seconds a HTTP/2 connection may wait for a request, 60 by default. */
+    unsigned idleTimeout;
+
+    /**
+     * Seconds a client may take to receive the response, 10 by default.
+     * Counts the time the worker waits for the client to take data, not the
+     * time the handler takes. Also applies to each write to clients
+     * subscribed to an EventHub.
+     */
+    unsigned writeTimeout;
+
+    /**
+     * Seconds the kernel may hold back a new TCP connection until its first
+     * data arrives (TCP_DEFER_ACCEPT), 0 (disabled) by default. Saves waking
+     * the server process for connections that have nothing to read yet.
+     */
+    unsigned deferAccept;
+
+    /**
+     * Length of the queue of pending TCP Fast Open requests, 0 (disabled) by
+     * default. Lets returning clients send the request along with the SYN,
+     * saving a round trip. The server side also has to be enabled in
+     * /proc/sys/net/ipv4/tcp_fastopen.
+     */
+    unsigned fastOpen;
+
+    /**
+     * Send data without waiting for outstanding acknowledgements, disabling
+     * Nagle's algorithm (TCP_NODELAY), true by default.
+     */
+    bool noDelay;
+
+    /**
+     * Let the kernel merge the response header with the start of the body,
+     * instead of sending it in a segment of its own (MSG_MORE), true by
+     * default.
+     */
+    bool cork;
+
+    /**
+     * Number of shards, 1 by default, 0 for one per CPU. With more than one,
+     * start() forks a server process per shard and pins each to a CPU the
+     * process may run on. TCP endpoints get a listening socket per shard
+     * (SO_REUSEPORT), Unix domain sockets are shared. Events published on an
+     * EventHub reach the subscribers of all shards.
+     */
+    unsigned shards;
+
+    /**
+     * Called in every shard before it serves requests, e.g. to set up
+     * Shard::data from memory of the local NUMA node. NULL by default.
+     */
+    void (*shardSetup)(Shard& shard);
+
+    /**
+     * Maximum number of workers serving requests at the same time, per shard,
+     * 0 (no limit) by default. Further requests wait in the server process,
+     * HIGH before NORMAL before LOW, and shards with idle workers take over
+     * requests waiting in other shards.
+     */
+    unsigned maxWorkers;
+
+private:
+    /** No copy constructor. */
+    Server(const Server&);
+
+    /** No copy assignment. */
+    Server operator=(const Server&);
+
+    class Implementation;
+    Implementation* const implementation;
+};
+
 /**
  * Start mhttpd server.
  * @param port local port to listen on
@@ -0,0 +1,903 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>    /* std::min() */
+#include <cerrno>       /* errno */
+#include <cstdio>       /* BUFSIZ */
+#include <cstdlib>      /* std::strtoul() */
+#include <cstring>      /* std::memcpy() */
+#include <deque>        /* std::deque */
+#include <map>          /* std::multimap */
+#include <sstream>      /* std::stringstream */
+#include <vector>       /* std::vector */
+
+#include <fcntl.h>      /* splice(), pipe2() */
+#include <netdb.h>      /* getaddrinfo() */
+#include <sys/socket.h> /* socket(), connect(), send(), recv() */
+#include <sys/un.h>     /* struct sockaddr_un */
+#include <unistd.h>     /* close() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Largest head of an upstream response. */
+static const size_t max_head = 65536;
+
+/** Bytes moved per splice(2) call. */
+static const size_t splice_chunk = 65536;
+
+static std::string lowercase(std::string s) {
+    for (std::string::iterator it = s.begin(); it != s.end(); ++it) {
+        if (*it >= 'A' && *it <= 'Z') {
+            *it = *it - 'A' + 'a';
+        }
+    }
+    return s;
+}
+
+/** Check for a token in a comma separated list, ignoring case. */
+static bool listed(const std::string& list, const std::string& token) {
+    const std::string lower = lowercase(list);
+    size_t pos = 0;
+
+    while (pos <= lower.size()) {
+        size_t end = lower.find(',', pos);
+        if (end == std::string::npos) {
+            end = lower.size();
+        }
+
+        size_t first = lower.find_first_not_of(" \t", pos);
+        size_t last = lower.find_last_not_of(" \t", end - 1);
+        if (first < end && last != std::string::npos && last >= first && lower.compare(first, last - first + 1, token) == 0) {
+            return true;
+        }
+
+        pos = end + 1;
+    }
+
+    return false;
+}
+
+/** Header fields that describe a single connection, see RFC 7230 section 6.1. */
+static bool hopbyhop(const std::string& lower) {
+    return lower == "connection" || lower == "keep-alive" || lower == "proxy-connection" || lower == "te" || lower == "trailer" || lower == "transfer-encoding" || lower == "upgrade";
+}
+
+class Idle;
+
+/** Upstream server. */
+struct Upstream {
+    std::string endpoint;
+
+    struct sockaddr_storage address;
+
+    socklen_t length;
+};
+
+/**
+ * State of a proxy. Upstreams are configured before the server starts, so
+ * workers inherit them; the balancing counters and idle connections live in
+ * the server process.
+ */
+class Pool {
+public:
+    Pool(const Proxy& proxy, Proxy::Balancing balancing);
+
+    ~Pool();
+
+    const Proxy& proxy;
+
+    const Proxy::Balancing balancing;
+
+    /** Index in pool_registry, identifies the pool in messages. */
+    size_t id;
+
+    std::vector<Upstream> upstreams;
+
+    /** Round robin position. */
+    size_t next;
+
+    /** Connections in use per upstream. */
+    std::vector<size_t> active;
+
+    /** Idle connections per upstream, most recently used last. */
+    std::vector<std::deque<Idle*> > idle;
+
+    /** Pick an upstream. */
+    size_t pick();
+};
+
+/** All pools, by id. Proxies are usually global, so avoid initialization order issues. */
+static std::vector<Pool*>& pool_registry() {
+    static std::vector<Pool*> registry;
+    return registry;
+}
+
+/** Upstream connections handed out to workers, by channel. */
+static std::multimap<int, std::pair<size_t, size_t> > pool_leases;
+
+/** Idle upstream connection, watched for the upstream closing it. */
+class Idle: public Watcher {
+public:
+    Idle(int fd, Pool& pool, size_t upstream) :
+            Watcher(fd), pool(pool), upstream(upstream) {
+        pool.idle[upstream].push_back(this);
+    }
+
+    ~Idle() {
+        detach();
+    }
+
+    void ready(short) {
+        /* upstream closed the connection or sent garbage, either way unusable */
+        detach();
+        Loop::remove(this);
+    }
+
+    void detach() {
+        std::deque<Idle*>& queue = pool.idle[upstream];
+        std::deque<Idle*>::iterator it = std::find(queue.begin(), queue.end(), this);
+        if (it != queue.end()) {
+            queue.erase(it);
+        }
+    }
+
+private:
+    Pool& pool;
+
+    const size_t upstream;
+};
+
+Pool::Pool(const Proxy& proxy, Proxy::Balancing balancing) :
+        proxy(proxy), balancing(balancing), id(pool_registry().size()), next(0) {
+    pool_registry().push_back(this);
+}
+
+Pool::~Pool() {
+    for (size_t i = 0; i < idle.size(); ++i) {
+        while (!idle[i].empty()) {
+            Idle* connection = idle[i].back();
+            connection->detach();
+            Loop::remove(connection);
+        }
+    }
+
+    pool_registry()[id] = NULL;
+}
+
+size_t Pool::pick() {
+    const size_t count = upstreams.size();
+    size_t best = next % count;
+
+    if (balancing == Proxy::LEAST_CONNECTIONS) {
+        /* start at the round robin position to spread ties */
+        for (size_t i = 1; i < count; ++i) {
+            const size_t candidate = (next + i) % count;
+            if (active[candidate] < active[best]) {
+                best = candidate;
+            }
+        }
+    }
+
+    next = best + 1;
+    return best;
+}
+
+static Pool* findpool(unsigned long id) {
+    if (id >= pool_registry().size()) {
+        return NULL;
+    }
+
+    return pool_registry()[id];
+}
+
+void proxyacquire(const std::string& message, int channel) {
+    size_t pos = 1;
+    unsigned long id;
+    Pool* pool;
+
+    if (!getnumber(message, pos, id) || (pool = findpool(id)) == NULL || pool->upstreams.empty()) {
+        supervisorreply(channel, std::string(1, MESSAGE_ACQUIRE));
+        return;
+    }
+
+    const size_t upstream = pool->pick();
+    std::string reply(1, MESSAGE_ACQUIRE);
+    putnumber(reply, upstream);
+
+    Idle* connection = NULL;
+    if (!pool->idle[upstream].empty()) {
+        connection = pool->idle[upstream].back();
+        connection->detach();
+    }
+
+    /* the kernel duplicates the passed descriptor, ours is closed on removal */
+    if (supervisorreply(channel, reply, connection ? connection->fd : -1)) {
+        pool->active[upstream] += 1;
+        pool_leases.insert(std::make_pair(channel, std::make_pair(pool->id, upstream)));
+    }
+
+    if (connection) {
+        Loop::remove(connection);
+    }
+}
+
+void proxyrelease(const std::string& message, int fd, int channel) {
+    size_t pos = 1;
+    unsigned long id;
+    unsigned long upstream;
+    Pool* pool = NULL;
+
+    if (!getnumber(message, pos, id) || !getnumber(message, pos, upstream) || (pool = findpool(id)) == NULL || upstream >= pool->upstreams.size()) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    typedef std::multimap<int, std::pair<size_t, size_t> >::iterator iterator;
+    std::pair<iterator, iterator> range = pool_leases.equal_range(channel);
+    bool leased = false;
+    for (iterator it = range.first; it != range.second; ++it) {
+        if (it->second.first == id && it->second.second == upstream) {
+            pool->active[upstream] -= 1;
+            pool_leases.erase(it);
+            leased = true;
+            break;
+        }
+    }
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (!leased) {
+        /* only connections leased to this very worker go back into the pool */
+        close(fd);
+        return;
+    }
+
+    if (pool->idle[upstream].size() >= pool->proxy.maxIdle) {
+        close(fd);
+        return;
+    }
+
+    Loop::add(new Idle(fd, *pool, upstream));
+}
+
+void proxyclosed(int channel) {
+    typedef std::multimap<int, std::pair<size_t, size_t> >::iterator iterator;
+    std::pair<iterator, iterator> range = pool_leases.equal_range(channel);
+
+    for (iterator it = range.first; it != range.second; ++it) {
+        Pool* pool = findpool(it->second.first);
+        if (pool) {
+            pool->active[it->second.second] -= 1;
+        }
+    }
+
+    pool_leases.erase(range.first, range.second);
+}
+
+class Proxy::Implementation: public Pool {
+public:
+    Implementation(const Proxy& proxy, Balancing balancing) :
+            Pool(proxy, balancing) {
+    }
+};
+
+/** Buffered reader for the upstream side of a connection. */
+class Reader {
+public:
+    Reader(int fd) :
+            fd(fd), pos(0), received(false), eof(false) {
+    }
+
+    const int fd;
+
+    std::string buffer;
+
+    size_t pos;
+
+    /** Set once anything was received from the upstream. */
+    bool received;
+
+    /** Set once the upstream closed the connection. */
+    bool eof;
+
+    size_t available() const {
+        return buffer.size() - pos;
+    }
+
+    bool fill() {
+        char data[BUFSIZ];
+        const ssize_t bytes = recv(fd, data, sizeof(data), 0);
+        if (bytes <= 0) {
+            eof = bytes == 0;
+            return false;
+        }
+
+        buffer.erase(0, pos);
+        pos = 0;
+        buffer.append(data, bytes);
+        received = true;
+        return true;
+    }
+
+    /** Read a line, without the trailing "\r\n". */
+    bool line(std::string& out) {
+        for (;;) {
+            const size_t end = buffer.find("\r\n", pos);
+            if (end != std::string::npos) {
+                out = buffer.substr(pos, end - pos);
+                pos = end + 2;
+                return true;
+            }
+
+            if (available() > max_head || !fill()) {
+                return false;
+            }
+        }
+    }
+};
+
+/** Moves data between sockets through a pipe, see splice(2). */
+class Relay {
+public:
+    Relay() {
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            pipefd[0] = pipefd[1] = -1;
+        }
+    }
+
+    ~Relay() {
+        if (pipefd[0] >= 0) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+    }
+
+    /**
+     * Move bytes from one socket to another.
+     * @param length number of bytes, ignored if untilEof is set
+     * @return false on error or if the data ended prematurely
+     */
+    bool move(int from, int to, size_t length, bool untilEof) {
+        while (untilEof || length > 0) {
+            const size_t chunk = untilEof ? splice_chunk : std::min(length, splice_chunk);
+            ssize_t bytes = -1;
+
+            if (pipefd[0] >= 0) {
+                bytes = splice(from, NULL, pipefd[1], NULL, chunk, SPLICE_F_MOVE);
+                if (bytes < 0 && errno == EINVAL) {
+                    /* socket type without splice support */
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    pipefd[0] = pipefd[1] = -1;
+                }
+            }
+
+            if (pipefd[0] >= 0) {
+                if (bytes <= 0) {
+                    return bytes == 0 && untilEof;
+                }
+
+                /* cork only while more data follows, the last segment must go out at once */
+                const unsigned flags = !untilEof && length > static_cast<size_t>(bytes) ? SPLICE_F_MOVE | SPLICE_F_MORE : SPLICE_F_MOVE;
+                for (ssize_t pending = bytes; pending > 0;) {
+                    const ssize_t out = splice(pipefd[0], NULL, to, NULL, pending, flags);
+                    if (out <= 0) {
+                        return false;
+                    }
+                    pending -= out;
+                }
+            } else {
+                char buffer[BUFSIZ];
+                bytes = recv(from, buffer, std::min(chunk, sizeof(buffer)), 0);
+                if (bytes <= 0) {
+                    return bytes == 0 && untilEof;
+                }
+
+                if (!sendall(to, buffer, bytes)) {
+                    return false;
+                }
+            }
+
+            if (!untilEof) {
+                length -= bytes;
+            }
+        }
+
+        return true;
+    }
+
+    static bool sendall(int fd, const char* buffer, size_t length) {
+        while (length > 0) {
+            const ssize_t bytes = send(fd, buffer, length, MSG_NOSIGNAL);
+            if (bytes <= 0) {
+                return false;
+            }
+            buffer += bytes;
+            length -= bytes;
+        }
+        return true;
+    }
+
+private:
+    int pipefd[2];
+};
+
+/** Destination of the response body: the client socket or the response. */
+class Output {
+public:
+    Output(Response& response) :
+            response(response), sock(-1) {
+        if (Access::of(response).sink == NULL && Access::of(response).sock >= 0) {
+            sock = Access::of(response).sock;
+        }
+    }
+
+    /** Pass on buffered data of the upstream. */
+    void write(const char* buffer, size_t length) {
+        response.write(buffer, length);
+    }
+
+    /** Pass on data still to be received from the upstream. */
+    bool move(Reader& reader, size_t length, bool untilEof) {
+        const size_t buffered = untilEof ? reader.available() : std::min(length, reader.available());
+        write(reader.buffer.data() + reader.pos, buffered);
+        reader.pos += buffered;
+        length -= untilEof ? 0 : buffered;
+
+        if (sock >= 0) {
+            /* plain HTTP/1.x client, hand the bytes over in the kernel */
+            Access::of(response).flush(response, true);
+            return relay.move(reader.fd, sock, length, untilEof);
+        }
+
+        while (untilEof || length > 0) {
+            if (!reader.fill()) {
+                return untilEof && reader.eof;
+            }
+
+            const size_t bytes = untilEof ? reader.available() : std::min(length, reader.available());
+            write(reader.buffer.data() + reader.pos, bytes);
+            reader.pos += bytes;
+            length -= untilEof ? 0 : bytes;
+        }
+
+        return true;
+    }
+
+private:
+    Response& response;
+
+    int sock;
+
+    Relay relay;
+};
+
+/** Connection to an upstream, as used by a worker. */
+class Lease {
+public:
+    Lease(const Pool& pool) :
+            pool(pool), upstream(0), fd(-1), pooled(false), supervised(false) {
+    }
+
+    ~Lease() {
+        release(false);
+    }
+
+    const Pool& pool;
+
+    size_t upstream;
+
+    int fd;
+
+    /** Set if the connection was used before. */
+    bool pooled;
+
+    /** Set if the server process accounts for this lease. */
+    bool supervised;
+
+    /** Pick an upstream, reusing an idle connection if available. */
+    void acquire() {
+        std::string message(1, MESSAGE_ACQUIRE);
+        putnumber(message, pool.id);
+
+        int passed = -1;
+        std::string reply;
+        size_t pos = 1;
+        unsigned long index;
+
+        if (supervisorsend(message) && supervisorreceive(reply, passed) && getnumber(reply, pos, index) && index < pool.upstreams.size()) {
+            upstream = index;
+            fd = passed;
+            pooled = fd >= 0;
+            supervised = true;
+            return;
+        }
+
+        if (passed >= 0) {
+            close(passed);
+        }
+
+        /* no server process to ask, e.g. called outside of Server::start() */
+        static size_t next = 0;
+        upstream = next++ % pool.upstreams.size();
+    }
+
+    /** Open a new connection to the upstream. */
+    bool connect() {
+        const Upstream& target = pool.upstreams[upstream];
+
+        fd = socket(target.address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        /* on Linux, SO_SNDTIMEO also limits connect(2) */
+        struct timeval timeval = {static_cast<time_t>(pool.proxy.timeout), 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeval, sizeof(timeval));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeval, sizeof(timeval));
+
+        if (::connect(fd, reinterpret_cast<const struct sockaddr*>(&target.address), target.length) < 0) {
+            Log() << "cannot connect to upstream " << target.endpoint;
+            close(fd);
+            fd = -1;
+            return false;
+        }
+
+        pooled = false;
+        return true;
+    }
+
+    /** Return the connection, keeping it open for later requests if reusable. */
+    void release(bool reusable) {
+        if (supervised) {
+            std::string message(1, MESSAGE_RELEASE);
+            putnumber(message, pool.id);
+            putnumber(message, upstream);
+            supervisorsend(message, reusable ? fd : -1);
+            supervised = false;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+/** Status line and header fields of an upstream response. */
+struct Head {
+    std::string version;
+
+    unsigned statusCode;
+
+    std::string statusMessage;
+
+    /** Fields with lower case names, for lookups. */
+    std::map<std::string, std::string> lower;
+
+    /** Fields as received. */
+    std::vector<std::pair<std::string, std::string> > fields;
+};
+
+static bool readhead(Reader& reader, Head& head) {
+    std::string line;
+    if (!reader.line(line)) {
+        return false;
+    }
+
+    const size_t first = line.find(' ');
+    if (first == std::string::npos || line.compare(0, 5, "HTTP/") != 0) {
+        return false;
+    }
+
+    const size_t second = line.find(' ', first + 1);
+    head.version = line.substr(0, first);
+    head.statusCode = std::strtoul(line.substr(first + 1, second - first - 1).c_str(), NULL, 10);
+    head.statusMessage = second == std::string::npos ? std::string() : line.substr(second + 1);
+
+    for (;;) {
+        if (!reader.line(line)) {
+            return false;
+        }
+
+        if (line.empty()) {
+            return true;
+        }
+
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+
+        const std::string name = line.substr(0, colon);
+        const size_t start = line.find_first_not_of(" \t", colon + 1);
+        const std::string value = start == std::string::npos ? std::string() : line.substr(start, line.find_last_not_of(" \t") - start + 1);
+
+        head.fields.push_back(std::make_pair(name, value));
+        std::string& merged = head.lower[lowercase(name)];
+        merged += merged.empty() ? value : ", " + value;
+    }
+}
+
+/** Pass on a chunked body, see RFC 7230 section 4.1. */
+static bool dechunk(Reader& reader, Output& output) {
+    std::string line;
+
+    for (;;) {
+        if (!reader.line(line)) {
+            return false;
+        }
+
+        char* end;
+        const size_t size = std::strtoul(line.c_str(), &end, 16);
+        if (end == line.c_str()) {
+            return false;
+        }
+
+        if (size == 0) {
+            /* skip trailer */
+            do {
+                if (!reader.line(line)) {
+                    return false;
+                }
+            } while (!line.empty());
+            return true;
+        }
+
+        if (!output.move(reader, size, false) || !reader.line(line) || !line.empty()) {
+            return false;
+        }
+    }
+}
+
+Proxy::Proxy(Balancing balancing) :
+        maxIdle(32), timeout(30), implementation(new Implementation(*this, balancing)) {
+}
+
+Proxy::~Proxy() {
+    delete implementation;
+}
+
+bool Proxy::addUpstream(const std::string& endpoint) {
+    Upstream upstream;
+    upstream.endpoint = endpoint;
+    upstream.address = sockaddr_storage();
+
+    if (endpoint.compare(0, 5, "unix:") == 0) {
+        const std::string path = endpoint.substr(5);
+        struct sockaddr_un* addr = reinterpret_cast<struct sockaddr_un*>(&upstream.address);
+
+        if (path.empty() || path.size() >= sizeof(addr->sun_path)) {
+            Log() << "invalid socket path: " << endpoint;
+            return false;
+        }
+
+        addr->sun_family = AF_UNIX;
+        path.copy(addr->sun_path, path.size());
+        upstream.length = sizeof(struct sockaddr_un);
+    } else {
+        /* "host:port" or "[host]:port" */
+        std::string host;
+        std::string port;
+        size_t pos;
+
+        if (!endpoint.empty() && endpoint[0] == '[' && (pos = endpoint.find("]:")) != std::string::npos) {
+            host = endpoint.substr(1, pos - 1);
+            port = endpoint.substr(pos + 2);
+        } else if ((pos = endpoint.rfind(':')) != std::string::npos) {
+            host = endpoint.substr(0, pos);
+            port = endpoint.substr(pos + 1);
+        }
+
+        struct addrinfo hints = addrinfo();
+        struct addrinfo* result;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+
+        const int error = host.empty() ? EAI_NONAME : getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+        if (error) {
+            Log() << "invalid upstream " << endpoint << ": " << gai_strerror(error);
+            return false;
+        }
+
+        std::memcpy(&upstream.address, result->ai_addr, result->ai_addrlen);
+        upstream.length = result->ai_addrlen;
+        freeaddrinfo(result);
+    }
+
+    implementation->upstreams.push_back(upstream);
+    implementation->active.push_back(0);
+    implementation->idle.push_back(std::deque<Idle*>());
+    return true;
+}
+
+void Proxy::forward(const Request& request, Response& response) const {
+    if (implementation->upstreams.empty()) {
+        response.statusCode = 502;
+        response.statusMessage = "Bad Gateway";
+        return;
+    }
+
+    /* request body, see RFC 7230 section 3.3.3 */
+    size_t length = 0;
+    std::string head;
+    std::string forwarded;
+    bool expect = false;
+    std::map<std::string, std::string>::const_iterator it;
+
+    for (it = request.fields.begin(); it != request.fields.end(); ++it) {
+        const std::string name = lowercase(it->first);
+        if (name == "transfer-encoding") {
+            response.statusCode = 411;
+            response.statusMessage = "Length Required";
+            return;
+        }
+
+        if (name == "content-length") {
+            length = std::strtoul(it->second.c_str(), NULL, 10);
+        } else if (name == "x-forwarded-for") {
+            forwarded = it->second + ", ";
+        } else if (name == "expect") {
+            /* answered here, the client waits for it before sending the body */
+            expect = listed(it->second, "100-continue");
+        } else if (!hopbyhop(name)) {
+            head += it->first + ": " + it->second + "\r\n";
+        }
+    }
+
+    /* bytes already received from the client, all of them for HTTP/2 */
+    const size_t buffered = Access::of(request).input.size() - Access::of(request).inputPos;
+    if (Access::of(request).sock < 0) {
+        length = buffered;
+    }
+
+    std::stringstream stream;
+    stream << request.type << " " << Access::of(request).target << " HTTP/1.1\r\n" << head;
+    stream << "X-Forwarded-For: " << forwarded << request.address << "\r\n";
+    if (length > 0 || request.fields.count("Content-Length")) {
+        stream << "Content-Length: " << length << "\r\n";
+    }
+    stream << "Connection: keep-alive\r\n\r\n";
+    head = stream.str();
+
+    Lease lease(*implementation);
+    lease.acquire();
+
+    Head answer;
+    Reader* reader = NULL;
+
+    for (;;) {
+        if (lease.fd < 0 && !lease.connect()) {
+            response.statusCode = 502;
+            response.statusMessage = "Bad Gateway";
+            return;
+        }
+
+        delete reader;
+        reader = new Reader(lease.fd);
+
+        bool sent = Relay::sendall(lease.fd, head.data(), head.size());
+
+        if (sent && length > 0) {
+            /* buffered part first, the rest moves from socket to socket */
+            Request& body = const_cast<Request&>(request);
+            size_t pending = std::min(length, buffered);
+            char buffer[BUFSIZ];
+
+            while (sent && pending > 0) {
+                const size_t bytes = body.read(buffer, std::min(pending, sizeof(buffer)));
+                sent = bytes > 0 && Relay::sendall(lease.fd, buffer, bytes);
+                pending -= bytes;
+            }
+
+            if (sent && buffered < length && expect) {
+                static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                sent = Relay::sendall(Access::of(request).sock, interim, sizeof(interim) - 1);
+                expect = false;
+            }
+
+            if (sent && buffered < length) {
+                Relay relay;
+                sent = relay.move(Access::of(request).sock, lease.fd, length - buffered, false);
+            }
+        }
+
+        bool received = sent && readhead(*reader, answer);
+        while (received && answer.statusCode >= 100 && answer.statusCode < 200) {
+            /* interim response, wait for the final one */
+            answer = Head();
+            received = readhead(*reader, answer);
+        }
+
+        if (received) {
+            break;
+        }
+
+        /* an idle connection may have been closed by the upstream meanwhile */
+        const bool retry = lease.pooled && !reader->received && length == 0;
+        lease.release(false);
+        if (!retry) {
+            delete reader;
+            response.statusCode = 502;
+            response.statusMessage = "Bad Gateway";
+            return;
+        }
+        lease.acquire();
+    }
+
+    response.version = "HTTP/1.1";
+    response.statusCode = answer.statusCode;
+    response.statusMessage = answer.statusMessage;
+
+    const std::string connection = answer.lower["connection"];
+    for (std::vector<std::pair<std::string, std::string> >::const_iterator field = answer.fields.begin(); field != answer.fields.end(); ++field) {
+        const std::string name = lowercase(field->first);
+        if (name == "content-type") {
+            response.contentType = field->second;
+        } else if (!hopbyhop(name) && !listed(connection, name)) {
+            /* repeated fields are combined, except for Set-Cookie, see RFC 7230 section 3.2.2 */
+            std::map<std::string, std::string>::iterator combined = response.fields.find(field->first);
+            if (combined == response.fields.end()) {
+                response.fields[field->first] = field->second;
+            } else {
+                combined->second += (name == "set-cookie" ? "\n" : ", ") + field->second;
+            }
+        }
+    }
+
+    bool reusable = answer.version == "HTTP/1.1" ? !listed(connection, "close") : listed(connection, "keep-alive");
+    bool complete;
+    Output output(response);
+
+    if (request.type == "HEAD" || answer.statusCode == 204 || answer.statusCode == 304) {
+        complete = true;
+    } else if (listed(answer.lower["transfer-encoding"], "chunked")) {
+        complete = dechunk(*reader, output);
+    } else if (answer.lower.count("content-length")) {
+        complete = output.move(*reader, std::strtoul(answer.lower["content-length"].c_str(), NULL, 10), false);
+    } else {
+        /* delimited by closing the connection */
+        complete = output.move(*reader, 0, true);
+        reusable = false;
+    }
+
+    /* the connection must be at a message boundary to be reused */
+    reusable = reusable && complete && reader->available() == 0;
+    delete reader;
+
+    Access::of(response).flush(response);
+    lease.release(reusable);
+}
+
+} /* namespace mhttpd */
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>       /* std::perror() */
+#include <cstring>      /* std::memchr() */
+#include <deque>        /* std::deque */
+#include <vector>       /* std::vector */
+
+#include <fcntl.h>      /* O_CLOEXEC */
+#include <strings.h>    /* strncasecmp() */
+#include <sys/mman.h>   /* mmap() */
+#include <sys/socket.h> /* getsockopt() */
+#include <time.h>       /* clock_gettime() */
+#include <unistd.h>     /* pipe2() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/*
+ * Workers are processes, so the server process of every shard keeps a queue
+ * per priority class and forks the next waiting request whenever one of its
+ * workers exits. A worker holds the write end of a pipe, the slot, which the
+ * kernel closes when the worker is gone, however it ends. Shards with idle
+ * workers steal waiting requests from the back of the busiest shard's queues:
+ * the connection is passed along with the request header over the sockets
+ * between shards (SCM_RIGHTS), so the thief serves it as if it had accepted
+ * it itself.
+ */
+
+/** Load of a shard, in memory shared by all shards. */
+struct ShardLoad {
+    /** Requests waiting for a worker. */
+    volatile int queued;
+
+    /** Workers not in use. */
+    volatile int idle;
+};
+
+/** Maximum number of workers per shard, 0 for no limit. */
+static unsigned scheduler_workers = 0;
+
+static std::vector<SchedulerRule> scheduler_rules;
+
+/** Workers running. */
+static unsigned scheduler_running = 0;
+
+/** Requests waiting for a worker, by priority. */
+static std::deque<Queued*> scheduler_queues[Server::LOW + 1];
+
+/** Number of requests in scheduler_queues. */
+static unsigned scheduler_queued = 0;
+
+/** Load of all shards, NULL without shards. */
+static ShardLoad* scheduler_loads = NULL;
+
+/** Number of entries in scheduler_loads. */
+static unsigned scheduler_shards = 0;
+
+/** Milliseconds to wait for the answer to MESSAGE_STEAL. */
+static const unsigned long scheduler_patience = 20;
+
+/** Answer to MESSAGE_STEAL outstanding, no further one is sent until then. */
+class Steal: public Timer {
+public:
+    void expired() {
+        schedulerbalance();
+    }
+};
+
+static Steal scheduler_steal;
+
+/** Update the entry of this shard in the load table. */
+static void schedulerpublish() {
+    if (scheduler_loads == NULL) {
+        return;
+    }
+
+    ShardLoad& load = scheduler_loads[Shard::current().index];
+    load.queued = scheduler_queued;
+    load.idle = scheduler_running < scheduler_workers ? scheduler_workers - scheduler_running : 0;
+}
+
+/** Take the next request to serve, NULL if none is waiting. */
+static Queued* schedulerpop() {
+    for (unsigned priority = Server::HIGH; priority <= Server::LOW; ++priority) {
+        if (!scheduler_queues[priority].empty()) {
+            Queued* request = scheduler_queues[priority].front();
+            scheduler_queues[priority].pop_front();
+            scheduler_queued -= 1;
+            return request;
+        }
+    }
+
+    return NULL;
+}
+
+/** Read end of a worker slot, hung up when the worker exits. */
+class Slot: public Watcher {
+public:
+    Slot(int fd) :
+            Watcher(fd) {
+    }
+
+    void ready(short) {
+        Loop::remove(this);
+        scheduler_running -= 1;
+
+        /* waiting requests first, in order of priority */
+        Queued* request;
+        while (scheduler_running < scheduler_workers && (request = schedulerpop()) != NULL) {
+            request->dispatch();
+        }
+
+        schedulerpublish();
+        schedulerbalance();
+    }
+};
+
+void schedulerconfigure(unsigned workers, const std::vector<SchedulerRule>& rules) {
+    scheduler_workers = workers;
+    scheduler_rules = rules;
+}
+
+bool schedulerprepare(unsigned count) {
+    if (scheduler_workers == 0 || count < 2) {
+        return true;
+    }
+
+    void* loads = mmap(NULL, count * sizeof(ShardLoad), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (loads == MAP_FAILED) {
+        std::perror("mmap(scheduler) failed");
+        return false;
+    }
+
+    scheduler_loads = static_cast<ShardLoad*>(loads);
+    scheduler_shards = count;
+    for (unsigned i = 0; i < count; ++i) {
+        scheduler_loads[i].queued = 0;
+        scheduler_loads[i].idle = scheduler_workers;
+    }
+
+    return true;
+}
+
+bool schedulerenabled() {
+    return scheduler_workers > 0;
+}
+
+unsigned long schedulernow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+/** Check a header field against a rule. */
+static bool schedulermatch(const char* line, const char* end, const SchedulerRule& rule) {
+    const char* colon = static_cast<const char*>(std::memchr(line, ':', end - line));
+    if (colon == NULL || static_cast<size_t>(colon - line) != rule.field.size() || strncasecmp(line, rule.field.data(), rule.field.size()) != 0) {
+        return false;
+    }
+
+    const char* value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        ++value;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+
+    return rule.value.compare(0, std::string::npos, value, end - value) == 0;
+}
+
+void schedulerclassify(const char* head, size_t length, Queued& request) {
+    const char* end = head + length;
+
+    /* request line "METHOD TARGET VERSION", followed by the header fields */
+    const char* fields = static_cast<const char*>(std::memchr(head, '\n', length));
+    fields = fields ? fields + 1 : end;
+    const char* target = static_cast<const char*>(std::memchr(head, ' ', fields - head));
+    target = target ? target + 1 : fields;
+    const char* after = static_cast<const char*>(std::memchr(target, ' ', fields - target));
+    after = after ? after : fields;
+
+    for (std::vector<SchedulerRule>::const_iterator it = scheduler_rules.begin(); it != scheduler_rules.end(); ++it) {
+        bool matched = false;
+
+        if (it->field.empty()) {
+            matched = static_cast<size_t>(after - target) >= it->prefix.size() && it->prefix.compare(0, std::string::npos, target, it->prefix.size()) == 0;
+        }
+
+        for (const char* line = fields; !it->field.empty() && !matched && line < end;) {
+            const char* next = static_cast<const char*>(std::memchr(line, '\n', end - line));
+            next = next ? next + 1 : end;
+            matched = schedulermatch(line, next - line >= 2 ? next - 2 : line, *it);
+            line = next;
+        }
+
+        if (matched) {
+            request.priority = it->priority;
+            request.deadline = it->deadline ? schedulernow() + it->deadline : 0;
+            return;
+        }
+    }
+
+    request.priority = Server::NORMAL;
+    request.deadline = 0;
+}
+
+int scheduleracquire() {
+    if (scheduler_running >= scheduler_workers) {
+        return -1;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        std::perror("pipe2() failed");
+        return -1;
+    }
+
+    Loop::add(new Slot(fds[0]));
+    scheduler_running += 1;
+    schedulerpublish();
+    return fds[1];
+}
+
+void schedulerqueue(Queued* request) {
+    scheduler_queues[request->priority].push_back(request);
+    scheduler_queued += 1;
+    schedulerpublish();
+
+    if (scheduler_loads == NULL) {
+        return;
+    }
+
+    /* wake up the shard with the most idle workers to come and take it */
+    unsigned idlest = scheduler_shards;
+    int idle = 0;
+    for (unsigned i = 0; i < scheduler_shards; ++i) {
+        if (i != Shard::current().index && scheduler_loads[i].idle > idle) {
+            idle = scheduler_loads[i].idle;
+            idlest = i;
+        }
+    }
+
+    if (idlest < scheduler_shards) {
+        shardsend(idlest, std::string(1, MESSAGE_QUEUED));
+    }
+}
+
+void schedulerunqueue(Queued* request) {
+    std::deque<Queued*>& queue = scheduler_queues[request->priority];
+
+    for (std::deque<Queued*>::iterator it = queue.begin(); it != queue.end(); ++it) {
+        if (*it == request) {
+            queue.erase(it);
+            scheduler_queued -= 1;
+            schedulerpublish();
+            return;
+        }
+    }
+}
+
+void schedulersteal(const std::string& message) {
+    size_t pos = 1;
+    unsigned long thief;
+
+    if (!getnumber(message, pos, thief) || thief >= scheduler_shards || thief == Shard::current().index) {
+        return;
+    }
+
+    /* the most urgent request that would otherwise wait the longest */
+    for (unsigned priority = Server::HIGH; priority <= Server::LOW; ++priority) {
+        std::deque<Queued*>& queue = scheduler_queues[priority];
+        if (queue.empty()) {
+            continue;
+        }
+
+        Queued* request = queue.back();
+        const unsigned long now = schedulernow();
+        std::string handoff(1, MESSAGE_HANDOFF);
+        putnumber(handoff, priority);
+        putnumber(handoff, request->deadline == 0 ? 0 : request->deadline > now ? request->deadline - now : 1);
+        const int fd = request->handoff(handoff);
+
+        if (fd >= 0 && handoff.size() <= max_message && shardsend(thief, handoff, fd)) {
+            queue.pop_back();
+            scheduler_queued -= 1;
+            schedulerpublish();
+            request->handedOff();
+        }
+        return;
+    }
+}
+
+void schedulerreceive(const std::string& message, int fd) {
+    size_t pos = 1;
+    unsigned long priority;
+    unsigned long remaining;
+    int type = 0;
+    socklen_t length = sizeof(type);
+
+    scheduler_steal.stop();
+
+    /* only a connection of a client is served, whatever else might be passed */
+    if (fd < 0 || getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0 || type != SOCK_STREAM || !getnumber(message, pos, priority) || priority > Server::LOW || !getnumber(message, pos, remaining)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    } else {
+        serveradopt(message, pos, fd, static_cast<Server::Priority>(priority), remaining);
+    }
+
+    schedulerbalance();
+}
+
+void schedulerbalance() {
+    if (scheduler_loads == NULL || scheduler_steal.running() || scheduler_queued > 0 || scheduler_running >= scheduler_workers) {
+        return;
+    }
+
+    unsigned busiest = scheduler_shards;
+    int queued = 0;
+    for (unsigned i = 0; i < scheduler_shards; ++i) {
+        if (i != Shard::current().index && scheduler_loads[i].queued > queued) {
+            queued = scheduler_loads[i].queued;
+            busiest = i;
+        }
+    }
+
+    if (busiest == scheduler_shards) {
+        return;
+    }
+
+    std::string message(1, MESSAGE_STEAL);
+    putnumber(message, Shard::current().index);
+    if (shardsend(busiest, message)) {
+        scheduler_steal.start(scheduler_patience);
+    }
+}
+
+} /* namespace mhttpd */
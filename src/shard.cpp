@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>       /* errno */
+#include <cstdio>       /* std::perror() */
+#include <vector>       /* std::vector */
+
+#include <linux/mempolicy.h> /* MPOL_LOCAL */
+#include <sched.h>      /* sched_getaffinity(), sched_setaffinity() */
+#include <sys/socket.h> /* socketpair() */
+#include <sys/syscall.h> /* SYS_set_mempolicy, SYS_getcpu */
+#include <unistd.h>     /* close(), syscall() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+static Shard shard_current = {0, 1, -1, -1, NULL};
+
+/**
+ * Receiving ends of the socket pairs carrying messages between shards, by
+ * shard index. Unnamed, so only the shards themselves can reach them.
+ */
+static std::vector<int> shard_sockets;
+
+/** Sending ends of the pairs, by index of the receiving shard, -1 for this shard. */
+static std::vector<int> shard_peers;
+
+/** Socket of this shard, -1 outside of a shard. */
+static int shard_socket = -1;
+
+/** Socket of this shard, receives events published on other shards. */
+class Sibling: public Watcher {
+public:
+    Sibling(int fd) :
+            Watcher(fd) {
+    }
+
+    void ready(short) {
+        std::string message;
+        int passed;
+
+        if (receivemessage(fd, message, passed, MSG_DONTWAIT) <= 0) {
+            return;
+        }
+
+        switch (message[0]) {
+        case MESSAGE_PUBLISH:
+            hubpublish(message);
+            break;
+
+        case MESSAGE_STEAL:
+            schedulersteal(message);
+            break;
+
+        case MESSAGE_HANDOFF:
+            schedulerreceive(message, passed);
+            passed = -1;
+            break;
+
+        case MESSAGE_QUEUED:
+            schedulerbalance();
+            break;
+        }
+
+        if (passed >= 0) {
+            close(passed);
+        }
+    }
+};
+
+Shard& Shard::current() {
+    return shard_current;
+}
+
+unsigned shardcpus() {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        return 1;
+    }
+
+    return CPU_COUNT(&set);
+}
+
+bool shardprepare(unsigned count) {
+    for (unsigned i = 0; i < count; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            std::perror("socketpair(shard) failed");
+            shardfinish();
+            return false;
+        }
+        shard_sockets.push_back(fds[0]);
+        shard_peers.push_back(fds[1]);
+    }
+
+    shard_current.count = count;
+    return true;
+}
+
+void shardfinish() {
+    for (std::vector<int>::const_iterator it = shard_sockets.begin(); it != shard_sockets.end(); ++it) {
+        close(*it);
+    }
+    shard_sockets.clear();
+
+    for (std::vector<int>::const_iterator it = shard_peers.begin(); it != shard_peers.end(); ++it) {
+        close(*it);
+    }
+    shard_peers.clear();
+}
+
+void shardenter(unsigned index) {
+    shard_current.index = index;
+
+    /* the n-th CPU the process may run on, so IRQ cores can be excluded with taskset(1) */
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        unsigned n = index % CPU_COUNT(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set) && n-- == 0) {
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+                    shard_current.cpu = cpu;
+                }
+                break;
+            }
+        }
+    }
+
+#ifdef SYS_set_mempolicy
+    /* allocate from the node of the CPU, overriding e.g. "numactl --interleave" */
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0 && errno != ENOSYS) {
+        std::perror("set_mempolicy() failed");
+    }
+#endif
+
+#ifdef SYS_getcpu
+    unsigned cpu;
+    unsigned node;
+    if (shard_current.cpu >= 0 && syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        shard_current.node = node;
+    }
+#endif
+
+    traceshard();
+
+    /* receive on the pair of this shard, send on the pairs of the others */
+    for (unsigned i = 0; i < shard_sockets.size(); ++i) {
+        if (i == index) {
+            shard_socket = shard_sockets[i];
+            Loop::add(new Sibling(shard_socket));
+            close(shard_peers[i]);
+            shard_peers[i] = -1;
+        } else {
+            close(shard_sockets[i]);
+        }
+    }
+    shard_sockets.clear();
+}
+
+void shardforward(const std::string& message) {
+    if (shard_socket < 0) {
+        return;
+    }
+
+    for (unsigned i = 0; i < shard_peers.size(); ++i) {
+        if (i != shard_current.index) {
+            /* a shard that does not keep up misses the event, like a slow subscriber */
+            shardsend(i, message);
+        }
+    }
+}
+
+bool shardsend(unsigned index, const std::string& message, int fd) {
+    if (shard_socket < 0 || index >= shard_peers.size() || shard_peers[index] < 0) {
+        return false;
+    }
+
+    return sendmessage(shard_peers[index], message, fd, MSG_DONTWAIT);
+}
+
+} /* namespace mhttpd */
@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>    /* std::max() */
+#include <cerrno>       /* EOWNERDEAD */
+#include <cstdio>       /* std::perror() */
+#include <cstring>      /* std::memcmp(), std::memcpy() */
+
+#include <pthread.h>    /* pthread_mutex_lock(), pthread_mutex_consistent() */
+#include <sys/mman.h>   /* mmap(), munmap() */
+#include <time.h>       /* clock_gettime() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/*
+ * All structures live in one shared mapping and refer to each other by
+ * offset, 0 standing for none. Memory is handed out to the stripes in pages,
+ * each page is cut into slabs of one size class.
+ */
+
+/** Size of a page. */
+static const size_t shared_page = 64 * 1024;
+
+/** Number of size classes, each about a quarter larger than the previous. */
+static const unsigned shared_classes = 32;
+
+/** Start of a page. */
+struct SharedPage {
+    /** Next page of the same stripe. */
+    unsigned long next;
+
+    unsigned long slabClass;
+};
+
+/** Entry, followed by key and value. */
+struct SharedItem {
+    /** Next item in the same bucket. */
+    unsigned long chain;
+
+    /** Neighbours in the list of the size class, newest first. */
+    unsigned long newer;
+    unsigned long older;
+
+    unsigned long hash;
+
+    /** Expiry in seconds of the monotonic clock, 0 for never. */
+    unsigned long expires;
+
+    unsigned long keyLength;
+
+    unsigned long valueLength;
+
+    unsigned long slabClass;
+
+    /** Set while the slab holds an item. */
+    unsigned long used;
+};
+
+/** Independently locked part of the store. */
+struct SharedStripe {
+    pthread_mutex_t lock;
+
+    /** First page of this stripe. */
+    unsigned long pages;
+
+    /** Free slabs by size class. */
+    unsigned long free[shared_classes];
+
+    /** Least recently used lists by size class. */
+    unsigned long newest[shared_classes];
+    unsigned long oldest[shared_classes];
+};
+
+/** Start of the mapping. */
+struct SharedRegion {
+    unsigned long stripes;
+
+    /** Buckets per stripe. */
+    unsigned long buckets;
+
+    unsigned long pages;
+
+    /** Pages handed out so far, grows atomically. */
+    volatile unsigned long used;
+
+    unsigned long bucketOffset;
+
+    unsigned long pageOffset;
+};
+
+const size_t SharedCache::maxEntry = shared_page - sizeof(SharedPage) - sizeof(SharedItem);
+
+/** Size of a slab of a size class. */
+static size_t shared_size(unsigned slabClass) {
+    size_t size = 64;
+    for (unsigned i = 0; i < slabClass; ++i) {
+        size = (size + size / 4 + 7) & ~static_cast<size_t>(7);
+    }
+
+    const size_t largest = shared_page - sizeof(SharedPage);
+    return slabClass + 1 == shared_classes || size > largest ? largest : size;
+}
+
+/** Smallest size class for an item of length bytes. */
+static unsigned shared_class(size_t length) {
+    unsigned slabClass = 0;
+    while (shared_size(slabClass) < length) {
+        slabClass += 1;
+    }
+    return slabClass;
+}
+
+/** FNV-1a. */
+static unsigned long shared_hash(const std::string& key) {
+    unsigned long hash = 14695981039346656037UL;
+    for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+        hash = (hash ^ static_cast<unsigned char>(*it)) * 1099511628211UL;
+    }
+    return hash;
+}
+
+static unsigned long shared_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+class SharedCache::Implementation {
+public:
+    Implementation(size_t size, unsigned stripes) :
+            size(size), base(NULL) {
+        if (stripes == 0) {
+            stripes = 1;
+        }
+
+        const unsigned long buckets = std::max(1UL, static_cast<unsigned long>(size / 512 / stripes));
+        const size_t bucketOffset = sizeof(SharedRegion) + stripes * sizeof(SharedStripe);
+        const size_t pageOffset = (bucketOffset + stripes * buckets * sizeof(unsigned long) + 63) & ~static_cast<size_t>(63);
+
+        if (size < pageOffset) {
+            Log() << "shared cache too small for its hash table";
+            return;
+        }
+
+        void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            std::perror("mmap(shared cache) failed");
+            return;
+        }
+
+        /* fresh anonymous memory is zeroed: no items, empty lists */
+        base = static_cast<char*>(memory);
+        SharedRegion& region = *at<SharedRegion>(0);
+        region.stripes = stripes;
+        region.buckets = buckets;
+        region.pages = (size - pageOffset) / shared_page;
+        region.bucketOffset = bucketOffset;
+        region.pageOffset = pageOffset;
+
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        for (unsigned i = 0; i < stripes; ++i) {
+            pthread_mutex_init(&stripe(i).lock, &attributes);
+        }
+        pthread_mutexattr_destroy(&attributes);
+    }
+
+    ~Implementation() {
+        if (base) {
+            munmap(base, size);
+        }
+    }
+
+    const size_t size;
+
+    /** Start of the mapping, NULL if mapping failed. */
+    char* base;
+
+    template<class T> T* at(unsigned long offset) {
+        return reinterpret_cast<T*>(base + offset);
+    }
+
+    SharedStripe& stripe(unsigned long index) {
+        return at<SharedStripe>(sizeof(SharedRegion))[index];
+    }
+
+    unsigned long& bucket(SharedStripe& stripe, unsigned long hash) {
+        const SharedRegion& region = *at<SharedRegion>(0);
+        const unsigned long index = &stripe - &this->stripe(0);
+        return at<unsigned long>(region.bucketOffset)[index * region.buckets + (hash / region.stripes) % region.buckets];
+    }
+
+    /** Lock the stripe responsible for hash. */
+    SharedStripe* lock(unsigned long hash) {
+        SharedStripe& stripe = this->stripe(hash % at<SharedRegion>(0)->stripes);
+
+        const int error = pthread_mutex_lock(&stripe.lock);
+        if (error == EOWNERDEAD) {
+            /* the previous owner died, maybe half way through a change */
+            reset(stripe);
+            pthread_mutex_consistent(&stripe.lock);
+        } else if (error != 0) {
+            return NULL;
+        }
+
+        return &stripe;
+    }
+
+    void unlock(SharedStripe* stripe) {
+        pthread_mutex_unlock(&stripe->lock);
+    }
+
+    /** Drop all items of a stripe, keeping its pages. */
+    void reset(SharedStripe& stripe) {
+        const SharedRegion& region = *at<SharedRegion>(0);
+        const unsigned long index = &stripe - &this->stripe(0);
+        for (unsigned long i = 0; i < region.buckets; ++i) {
+            at<unsigned long>(region.bucketOffset)[index * region.buckets + i] = 0;
+        }
+
+        for (unsigned i = 0; i < shared_classes; ++i) {
+            stripe.free[i] = 0;
+            stripe.newest[i] = 0;
+            stripe.oldest[i] = 0;
+        }
+
+        for (unsigned long page = stripe.pages; page; page = at<SharedPage>(page)->next) {
+            carve(stripe, page);
+        }
+    }
+
+    /** Cut a page into free slabs. */
+    void carve(SharedStripe& stripe, unsigned long page) {
+        const unsigned long slabClass = at<SharedPage>(page)->slabClass;
+        const size_t slab = shared_size(slabClass);
+
+        for (unsigned long offset = sizeof(SharedPage); offset + slab <= shared_page; offset += slab) {
+            SharedItem* item = at<SharedItem>(page + offset);
+            item->used = 0;
+            item->chain = stripe.free[slabClass];
+            stripe.free[slabClass] = page + offset;
+        }
+    }
+
+    SharedItem* find(SharedStripe& stripe, unsigned long hash, const std::string& key) {
+        for (unsigned long offset = bucket(stripe, hash); offset; offset = at<SharedItem>(offset)->chain) {
+            SharedItem* item = at<SharedItem>(offset);
+            if (item->hash == hash && item->keyLength == key.size() && std::memcmp(item + 1, key.data(), key.size()) == 0) {
+                return item;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned long offset(const SharedItem* item) {
+        return reinterpret_cast<const char*>(item) - base;
+    }
+
+    void link(SharedStripe& stripe, SharedItem* item) {
+        unsigned long& head = bucket(stripe, item->hash);
+        item->chain = head;
+        head = offset(item);
+
+        item->older = stripe.newest[item->slabClass];
+        item->newer = 0;
+        if (item->older) {
+            at<SharedItem>(item->older)->newer = offset(item);
+        } else {
+            stripe.oldest[item->slabClass] = offset(item);
+        }
+        stripe.newest[item->slabClass] = offset(item);
+    }
+
+    void unlink(SharedStripe& stripe, SharedItem* item) {
+        unsigned long* link = &bucket(stripe, item->hash);
+        while (*link != offset(item)) {
+            link = &at<SharedItem>(*link)->chain;
+        }
+        *link = item->chain;
+
+        if (item->newer) {
+            at<SharedItem>(item->newer)->older = item->older;
+        } else {
+            stripe.newest[item->slabClass] = item->older;
+        }
+
+        if (item->older) {
+            at<SharedItem>(item->older)->newer = item->newer;
+        } else {
+            stripe.oldest[item->slabClass] = item->newer;
+        }
+    }
+
+    /** Unlink an item and return its slab. */
+    void release(SharedStripe& stripe, SharedItem* item) {
+        unlink(stripe, item);
+        item->used = 0;
+        item->chain = stripe.free[item->slabClass];
+        stripe.free[item->slabClass] = offset(item);
+    }
+
+    /** Get a free slab: a free one, a fresh page or the slab of an evicted item. */
+    SharedItem* allocate(SharedStripe& stripe, unsigned long slabClass) {
+        if (!stripe.free[slabClass]) {
+            SharedRegion& region = *at<SharedRegion>(0);
+            const unsigned long index = region.used < region.pages ? __sync_fetch_and_add(&region.used, 1) : region.pages;
+
+            if (index < region.pages) {
+                const unsigned long page = region.pageOffset + index * shared_page;
+                at<SharedPage>(page)->next = stripe.pages;
+                at<SharedPage>(page)->slabClass = slabClass;
+                stripe.pages = page;
+                carve(stripe, page);
+            } else if (stripe.oldest[slabClass]) {
+                /* out of memory: an expired item among the oldest, or the oldest */
+                const unsigned long now = shared_clock();
+                SharedItem* victim = at<SharedItem>(stripe.oldest[slabClass]);
+                SharedItem* item = victim;
+                for (int i = 0; i < 16 && item; ++i) {
+                    if (item->expires && item->expires <= now) {
+                        victim = item;
+                        break;
+                    }
+                    item = item->newer ? at<SharedItem>(item->newer) : NULL;
+                }
+                release(stripe, victim);
+            } else if (!reclaim(stripe, slabClass)) {
+                return NULL;
+            }
+        }
+
+        SharedItem* item = at<SharedItem>(stripe.free[slabClass]);
+        stripe.free[slabClass] = item->chain;
+        item->used = 1;
+        return item;
+    }
+
+    /** Move the page of the stripe used longest ago to another size class, dropping its items. */
+    bool reclaim(SharedStripe& stripe, unsigned long slabClass) {
+        unsigned long* link = NULL;
+        for (unsigned long* it = &stripe.pages; *it; it = &at<SharedPage>(*it)->next) {
+            if (at<SharedPage>(*it)->slabClass != slabClass) {
+                link = it;
+            }
+        }
+
+        if (!link) {
+            return false;
+        }
+
+        const unsigned long page = *link;
+        SharedPage& header = *at<SharedPage>(page);
+        const size_t slab = shared_size(header.slabClass);
+
+        for (unsigned long offset = sizeof(SharedPage); offset + slab <= shared_page; offset += slab) {
+            SharedItem* item = at<SharedItem>(page + offset);
+            if (item->used) {
+                unlink(stripe, item);
+            }
+        }
+
+        for (unsigned long* it = &stripe.free[header.slabClass]; *it;) {
+            if (*it >= page && *it < page + shared_page) {
+                *it = at<SharedItem>(*it)->chain;
+            } else {
+                it = &at<SharedItem>(*it)->chain;
+            }
+        }
+
+        /* to the front, the next page to go is another one */
+        *link = header.next;
+        header.next = stripe.pages;
+        header.slabClass = slabClass;
+        stripe.pages = page;
+        carve(stripe, page);
+        return true;
+    }
+};
+
+SharedCache::SharedCache(size_t size, unsigned stripes) :
+        implementation(new Implementation(size, stripes)) {
+}
+
+SharedCache::~SharedCache() {
+    delete implementation;
+}
+
+bool SharedCache::set(const std::string& key, const std::string& value, unsigned ttl) {
+    const size_t length = sizeof(SharedItem) + key.size() + value.size();
+    if (!implementation->base || key.size() + value.size() > maxEntry) {
+        return false;
+    }
+
+    const unsigned long hash = shared_hash(key);
+    SharedStripe* stripe = implementation->lock(hash);
+    if (!stripe) {
+        return false;
+    }
+
+    SharedItem* item = implementation->find(*stripe, hash, key);
+    if (item) {
+        implementation->release(*stripe, item);
+    }
+
+    const unsigned long slabClass = shared_class(length);
+    item = implementation->allocate(*stripe, slabClass);
+    if (item) {
+        item->hash = hash;
+        item->expires = ttl ? shared_clock() + ttl : 0;
+        item->keyLength = key.size();
+        item->valueLength = value.size();
+        item->slabClass = slabClass;
+        std::memcpy(item + 1, key.data(), key.size());
+        std::memcpy(reinterpret_cast<char*>(item + 1) + key.size(), value.data(), value.size());
+        implementation->link(*stripe, item);
+    }
+
+    implementation->unlock(stripe);
+    return item != NULL;
+}
+
+bool SharedCache::get(const std::string& key, std::string& value) {
+    if (!implementation->base) {
+        return false;
+    }
+
+    const unsigned long hash = shared_hash(key);
+    SharedStripe* stripe = implementation->lock(hash);
+    if (!stripe) {
+        return false;
+    }
+
+    SharedItem* item = implementation->find(*stripe, hash, key);
+    if (item && item->expires && item->expires <= shared_clock()) {
+        implementation->release(*stripe, item);
+        item = NULL;
+    }
+
+    if (item) {
+        value.assign(reinterpret_cast<const char*>(item + 1) + item->keyLength, item->valueLength);
+
+        /* most recently used now */
+        implementation->unlink(*stripe, item);
+        implementation->link(*stripe, item);
+    }
+
+    implementation->unlock(stripe);
+    return item != NULL;
+}
+
+bool SharedCache::remove(const std::string& key) {
+    if (!implementation->base) {
+        return false;
+    }
+
+    const unsigned long hash = shared_hash(key);
+    SharedStripe* stripe = implementation->lock(hash);
+    if (!stripe) {
+        return false;
+    }
+
+    SharedItem* item = implementation->find(*stripe, hash, key);
+    if (item) {
+        implementation->release(*stripe, item);
+    }
+
+    implementation->unlock(stripe);
+    return item != NULL;
+}
+
+} /* namespace mhttpd */
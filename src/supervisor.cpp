@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>       /* errno */
+#include <cstdio>       /* std::perror() */
+#include <cstring>      /* std::memcpy() */
+
+#include <poll.h>       /* poll() */
+#include <sys/socket.h> /* socketpair(), sendmsg(), recvmsg() */
+#include <unistd.h>     /* close() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Channel of this worker to the server process, -1 outside of a worker. */
+static int control_channel = -1;
+
+bool sendmessage(int sock, const std::string& message, int fd, int flags) {
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov;
+    struct msghdr msg = msghdr();
+
+    iov.iov_base = const_cast<char*>(message.data());
+    iov.iov_len = message.size();
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    }
+
+    return sendmsg(sock, &msg, flags | MSG_NOSIGNAL) == static_cast<ssize_t>(message.size());
+}
+
+ssize_t receivemessage(int sock, std::string& message, int& fd, int flags) {
+    char buffer[max_message];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = msghdr();
+
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    fd = -1;
+
+    const ssize_t bytes = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); bytes >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+        }
+    }
+
+    if (bytes > 0 && (msg.msg_flags & MSG_TRUNC)) {
+        /* oversized message */
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        return -1;
+    }
+
+    message.assign(buffer, bytes > 0 ? bytes : 0);
+    return bytes;
+}
+
+/** Connection of a worker to the server process. */
+class Channel: public Watcher {
+public:
+    Channel(int fd) :
+            Watcher(fd) {
+    }
+
+    void ready(short) {
+        std::string message;
+        int passed;
+
+        const ssize_t bytes = receivemessage(fd, message, passed, MSG_DONTWAIT);
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+
+        if (bytes <= 0) {
+            /* worker is gone / oversized message */
+            if (passed >= 0) {
+                close(passed);
+            }
+            proxyclosed(fd);
+            cacheclosed(fd);
+            Loop::remove(this);
+            return;
+        }
+
+        switch (message[0]) {
+        case MESSAGE_SUBSCRIBE:
+            hubsubscribe(message, passed);
+            break;
+
+        case MESSAGE_PUBLISH:
+            hubpublish(message);
+            shardforward(message);
+            break;
+
+        case MESSAGE_ACQUIRE:
+            proxyacquire(message, fd);
+            break;
+
+        case MESSAGE_RELEASE:
+            proxyrelease(message, passed, fd);
+            break;
+
+        case MESSAGE_LOOKUP:
+            cachelookup(message, fd);
+            break;
+
+        case MESSAGE_STORE:
+            cachestore(message, fd);
+            break;
+
+        case MESSAGE_CANCEL:
+            cachecancel(fd);
+            break;
+
+        case MESSAGE_WEBSOCKET:
+            websocketadopt(message, passed);
+            break;
+
+        default:
+            if (passed >= 0) {
+                close(passed);
+            }
+            break;
+        }
+    }
+};
+
+int supervisorchannel() {
+    /* an unnamed pair, no other process can get hold of the server's end */
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        std::perror("socketpair(control) failed");
+        return -1;
+    }
+
+    Loop::add(new Channel(fds[0]));
+    return fds[1];
+}
+
+void supervisorenter(int channel) {
+    control_channel = channel;
+}
+
+bool supervisorsend(const std::string& message, int fd) {
+    if (control_channel < 0) {
+        return false;
+    }
+
+    return sendmessage(control_channel, message, fd, 0);
+}
+
+bool supervisorreceive(std::string& message, int& fd, int timeout) {
+    if (control_channel < 0) {
+        return false;
+    }
+
+    if (timeout >= 0) {
+        struct pollfd pollfd;
+        pollfd.fd = control_channel;
+        pollfd.events = POLLIN;
+        if (poll(&pollfd, 1, timeout) <= 0) {
+            fd = -1;
+            return false;
+        }
+    }
+
+    return receivemessage(control_channel, message, fd, 0) > 0;
+}
+
+bool supervisorreply(int channel, const std::string& message, int fd) {
+    /* never block the server process on a misbehaving worker */
+    return sendmessage(channel, message, fd, MSG_DONTWAIT);
+}
+
+void putnumber(std::string& message, unsigned long value) {
+    message += static_cast<char>((value >> 24) & 0xff);
+    message += static_cast<char>((value >> 16) & 0xff);
+    message += static_cast<char>((value >> 8) & 0xff);
+    message += static_cast<char>(value & 0xff);
+}
+
+bool getnumber(const std::string& message, size_t& pos, unsigned long& value) {
+    if (pos + 4 > message.size()) {
+        return false;
+    }
+
+    value = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        value = (value << 8) | static_cast<unsigned char>(message[pos + i]);
+    }
+    pos += 4;
+
+    return true;
+}
+
+void putstring(std::string& message, const std::string& s) {
+    putnumber(message, s.size());
+    message += s;
+}
+
+bool getstring(const std::string& message, size_t& pos, std::string& s) {
+    unsigned long length;
+    if (!getnumber(message, pos, length) || length > message.size() - pos) {
+        return false;
+    }
+
+    s = message.substr(pos, length);
+    pos += length;
+    return true;
+}
+
+} /* namespace mhttpd */
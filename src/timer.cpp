@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>       /* clock_gettime() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/*
+ * The wheel has a near level of 256 slots of one tick each and three far
+ * levels of 64 slots, each slot of a level spanning a full turn of the level
+ * below. Whenever a level completes a turn, the timers of the next slot of the
+ * level above are sorted into the levels below (cascaded). This covers about
+ * seven days, timers running longer are cascaded until they fit.
+ */
+
+/** Resolution of the wheel in milliseconds. */
+static const unsigned long timer_tick = 10;
+
+static const unsigned timer_near_bits = 8;
+static const unsigned timer_far_bits = 6;
+static const unsigned timer_far_levels = 3;
+
+static const unsigned long timer_near_size = 1UL << timer_near_bits;
+static const unsigned long timer_far_size = 1UL << timer_far_bits;
+
+static Timer* timer_near[timer_near_size];
+static Timer* timer_far[timer_far_levels][timer_far_size];
+
+/** Tick the wheel was last advanced to. */
+static unsigned long timer_now = 0;
+
+/** Number of running timers. */
+static unsigned long timer_count = 0;
+
+/** Current time in ticks. */
+static unsigned long timer_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000UL + now.tv_nsec / 1000000) / timer_tick;
+}
+
+Timer::~Timer() {
+    stop();
+}
+
+void Timer::start(unsigned long milliseconds) {
+    stop();
+
+    const unsigned long now = timer_clock();
+    if (timer_count == 0) {
+        /* nothing to expire in between */
+        timer_now = now;
+    }
+
+    /* round up, expiring early is not an option */
+    due = now + (milliseconds + timer_tick - 1) / timer_tick;
+    if (due <= timer_now) {
+        due = timer_now + 1;
+    }
+
+    timer_count += 1;
+    place();
+}
+
+void Timer::stop() {
+    if (slot == NULL) {
+        return;
+    }
+
+    if (before != NULL) {
+        before->after = after;
+    } else {
+        *slot = after;
+    }
+
+    if (after != NULL) {
+        after->before = before;
+    }
+
+    before = NULL;
+    after = NULL;
+    slot = NULL;
+    timer_count -= 1;
+}
+
+void Timer::place() {
+    const unsigned long delta = due - timer_now;
+
+    if (delta < timer_near_size) {
+        slot = &timer_near[due & (timer_near_size - 1)];
+    } else {
+        unsigned level = 0;
+        unsigned shift = timer_near_bits;
+        while (level + 1 < timer_far_levels && delta >= 1UL << (shift + timer_far_bits)) {
+            level += 1;
+            shift += timer_far_bits;
+        }
+
+        /* out of range, park in the last slot and cascade again from there */
+        unsigned long tick = due;
+        if (delta >= 1UL << (shift + timer_far_bits)) {
+            tick = timer_now + (1UL << (shift + timer_far_bits)) - 1;
+        }
+
+        slot = &timer_far[level][(tick >> shift) & (timer_far_size - 1)];
+    }
+
+    before = NULL;
+    after = *slot;
+    if (after != NULL) {
+        after->before = this;
+    }
+    *slot = this;
+}
+
+void Timer::cascade(Timer** slot) {
+    Timer* timer = *slot;
+    *slot = NULL;
+
+    while (timer != NULL) {
+        Timer* const after = timer->after;
+        timer->place();
+        timer = after;
+    }
+}
+
+int Timer::next() {
+    if (timer_count == 0) {
+        return -1;
+    }
+
+    /* the next occupied near slot, or the next turn, which may cascade */
+    unsigned long tick = timer_now + 1;
+    while (timer_near[tick & (timer_near_size - 1)] == NULL && (tick & (timer_near_size - 1)) != 0) {
+        tick += 1;
+    }
+
+    const unsigned long now = timer_clock();
+    return tick <= now ? 0 : static_cast<int>((tick - now) * timer_tick);
+}
+
+void Timer::run() {
+    const unsigned long now = timer_clock();
+
+    while (timer_now < now) {
+        if (timer_count == 0) {
+            timer_now = now;
+            break;
+        }
+
+        timer_now += 1;
+
+        /* on a full turn, cascade the levels above, starting at the top */
+        if ((timer_now & (timer_near_size - 1)) == 0) {
+            unsigned levels = 1;
+            while (levels < timer_far_levels && ((timer_now >> (timer_near_bits + (levels - 1) * timer_far_bits)) & (timer_far_size - 1)) == 0) {
+                levels += 1;
+            }
+
+            while (levels > 0) {
+                levels -= 1;
+                cascade(&timer_far[levels][(timer_now >> (timer_near_bits + levels * timer_far_bits)) & (timer_far_size - 1)]);
+            }
+        }
+
+        /* expired timers may start or stop others, so take one at a time */
+        Timer** const slot = &timer_near[timer_now & (timer_near_size - 1)];
+        while (*slot != NULL) {
+            Timer* const timer = *slot;
+            timer->stop();
+            timer->expired();
+        }
+    }
+}
+
+} /* namespace mhttpd */
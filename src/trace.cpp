@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iomanip>      /* std::setw() */
+#include <sstream>      /* std::ostringstream */
+
+#include <sys/mman.h>   /* mmap(), munmap() */
+#include <time.h>       /* clock_gettime() */
+#include <unistd.h>     /* getpid() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/** Recorded span or point in time. */
+struct TraceEvent {
+    /** Index in the ring plus one once complete, 0 while being written. */
+    volatile unsigned long sequence;
+
+    unsigned long request;
+
+    /** Start in nanoseconds. */
+    unsigned long begin;
+
+    /** Duration in nanoseconds, 0 for a point in time. */
+    unsigned long duration;
+
+    int pid;
+
+    int point;
+};
+
+/** Ring buffer in shared memory, written to by a server process and its workers. */
+struct TraceRing {
+    /** Index of the next event, the ring wraps around. */
+    volatile unsigned long head;
+
+    unsigned long capacity;
+};
+
+static const char* const trace_names[] = {
+    "accept", "header", "parse", "handler", "first byte", "last byte"
+};
+
+static TraceRing* trace_ring = NULL;
+
+unsigned long trace_request = 0;
+
+/** Process recording events, cached to save a system call per event. */
+static int trace_pid = 0;
+
+static size_t trace_size(size_t capacity) {
+    return sizeof(TraceRing) + capacity * sizeof(TraceEvent);
+}
+
+static TraceEvent* trace_events() {
+    return reinterpret_cast<TraceEvent*>(trace_ring + 1);
+}
+
+static TraceRing* trace_map(size_t capacity) {
+    void* memory = mmap(NULL, trace_size(capacity), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    /* fresh anonymous memory is zeroed, so all events read as incomplete */
+    TraceRing* ring = static_cast<TraceRing*>(memory);
+    ring->capacity = capacity;
+    return ring;
+}
+
+static unsigned long trace_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static void trace_record(TracePoint point, unsigned long request, unsigned long begin, unsigned long duration) {
+    /* claim a slot, writers of one shard share a CPU, so this hardly contends */
+    const unsigned long index = __sync_fetch_and_add(&trace_ring->head, 1);
+    TraceEvent& event = trace_events()[index % trace_ring->capacity];
+
+    event.sequence = 0;
+    __sync_synchronize();
+    event.request = request;
+    event.begin = begin;
+    event.duration = duration;
+    event.pid = trace_pid;
+    event.point = point;
+    __sync_synchronize();
+    event.sequence = index + 1;
+}
+
+unsigned long tracebegin() {
+    return trace_ring ? trace_clock() : 0;
+}
+
+void tracespan(TracePoint point, unsigned long request, unsigned long begin) {
+    if (trace_ring && begin) {
+        trace_record(point, request, begin, trace_clock() - begin);
+    }
+}
+
+void tracepoint(TracePoint point, unsigned long request) {
+    if (trace_ring) {
+        trace_record(point, request, trace_clock(), 0);
+    }
+}
+
+void traceshard() {
+    if (trace_ring) {
+        const size_t capacity = trace_ring->capacity;
+        munmap(trace_ring, trace_size(capacity));
+        trace_ring = trace_map(capacity);
+        trace_pid = getpid();
+    }
+}
+
+void traceworker(unsigned long request) {
+    trace_request = request;
+    trace_pid = getpid();
+}
+
+/** Append nanoseconds as microseconds, the unit of the trace event format. */
+static void trace_micros(std::ostringstream& stream, unsigned long nanos) {
+    stream << nanos / 1000 << '.' << std::setw(3) << std::setfill('0') << nanos % 1000 << std::setfill(' ');
+}
+
+bool Trace::enable(size_t capacity) {
+    if (trace_ring || capacity == 0) {
+        return trace_ring != NULL;
+    }
+
+    trace_ring = trace_map(capacity);
+    trace_pid = getpid();
+    return trace_ring != NULL;
+}
+
+std::string Trace::json() {
+    const unsigned shard = Shard::current().index;
+    std::ostringstream stream;
+
+    stream << "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << shard << ",\"args\":{\"name\":\"shard " << shard << "\"}}";
+
+    if (trace_ring) {
+        const unsigned long head = trace_ring->head;
+        const unsigned long capacity = trace_ring->capacity;
+
+        for (unsigned long index = head > capacity ? head - capacity : 0; index < head; ++index) {
+            const TraceEvent& slot = trace_events()[index % capacity];
+
+            /* copy, then make sure no writer got in between */
+            const unsigned long sequence = slot.sequence;
+            __sync_synchronize();
+            const TraceEvent event = {0, slot.request, slot.begin, slot.duration, slot.pid, slot.point};
+            __sync_synchronize();
+            if (sequence != index + 1 || slot.sequence != sequence || event.point < TRACE_ACCEPT || event.point > TRACE_LAST_BYTE) {
+                continue;
+            }
+
+            stream << ",{\"name\":\"" << trace_names[event.point] << "\",\"cat\":\"request\",\"ph\":\"" << (event.duration ? "X" : "i");
+            stream << "\",\"ts\":";
+            trace_micros(stream, event.begin);
+            if (event.duration) {
+                stream << ",\"dur\":";
+                trace_micros(stream, event.duration);
+            } else {
+                stream << ",\"s\":\"t\"";
+            }
+            stream << ",\"pid\":" << shard << ",\"tid\":" << event.request << ",\"args\":{\"pid\":" << event.pid << "}}";
+        }
+    }
+
+    stream << "],\"displayTimeUnit\":\"ms\"}\n";
+    return stream.str();
+}
+
+} /* namespace mhttpd */
@@ -0,0 +1,1014 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>    /* std::min() */
+#include <cerrno>       /* errno */
+#include <cstdio>       /* BUFSIZ, std::perror() */
+#include <cstdlib>      /* std::exit() */
+#include <cstring>      /* std::memcpy() */
+
+#include <fcntl.h>      /* O_CLOEXEC */
+#include <netdb.h>      /* send(), recv() */
+#include <poll.h>       /* poll() */
+#include <stdint.h>     /* uint32_t, uint64_t */
+#include <strings.h>    /* strncasecmp() */
+#include <unistd.h>     /* pipe2(), dup(), close() */
+
+#include "mhttpd.h"
+#include "internal.h"
+
+namespace mhttpd {
+
+/* opcodes, see RFC 6455 section 5.2 */
+enum {
+    OPCODE_CONTINUATION = 0x0,
+    OPCODE_TEXT = 0x1,
+    OPCODE_BINARY = 0x2,
+    OPCODE_CLOSE = 0x8,
+    OPCODE_PING = 0x9,
+    OPCODE_PONG = 0xa
+};
+
+/* status codes, see RFC 6455 section 7.4.1 */
+enum {
+    CLOSE_NORMAL = 1000,
+    CLOSE_PROTOCOL_ERROR = 1002,
+    CLOSE_INVALID_DATA = 1007,
+    CLOSE_TOO_BIG = 1009
+};
+
+/** Appended to Sec-WebSocket-Key, see RFC 6455 section 1.3. */
+static const char websocket_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static uint32_t rotate(uint32_t value, unsigned bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/** SHA-1 digest, see RFC 3174. */
+static std::string sha1(const std::string& message) {
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    const uint64_t bits = static_cast<uint64_t>(message.size()) * 8;
+    std::string data = message;
+
+    data += '\x80';
+    while (data.size() % 64 != 56) {
+        data += '\0';
+    }
+
+    for (int i = 7; i >= 0; --i) {
+        data += static_cast<char>((bits >> (8 * i)) & 0xff);
+    }
+
+    for (size_t chunk = 0; chunk < data.size(); chunk += 64) {
+        uint32_t w[80];
+
+        for (size_t i = 0; i < 16; ++i) {
+            w[i] = 0;
+            for (size_t j = 0; j < 4; ++j) {
+                w[i] = (w[i] << 8) | static_cast<unsigned char>(data[chunk + 4 * i + j]);
+            }
+        }
+
+        for (size_t i = 16; i < 80; ++i) {
+            w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (size_t i = 0; i < 80; ++i) {
+            uint32_t f, k;
+
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+
+            const uint32_t temp = rotate(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotate(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    std::string digest;
+    for (size_t i = 0; i < 5; ++i) {
+        for (int j = 3; j >= 0; --j) {
+            digest += static_cast<char>((h[i] >> (8 * j)) & 0xff);
+        }
+    }
+
+    return digest;
+}
+
+static std::string base64encode(const std::string& in) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+
+    for (size_t i = 0; i < in.size(); i += 3) {
+        uint32_t value = static_cast<unsigned char>(in[i]) << 16;
+        if (i + 1 < in.size()) {
+            value |= static_cast<unsigned char>(in[i + 1]) << 8;
+        }
+        if (i + 2 < in.size()) {
+            value |= static_cast<unsigned char>(in[i + 2]);
+        }
+
+        out += alphabet[(value >> 18) & 0x3f];
+        out += alphabet[(value >> 12) & 0x3f];
+        out += i + 1 < in.size() ? alphabet[(value >> 6) & 0x3f] : '=';
+        out += i + 2 < in.size() ? alphabet[value & 0x3f] : '=';
+    }
+
+    return out;
+}
+
+/** Case insensitive search for a token in a comma separated field value. */
+static bool hastoken(const std::string& value, const std::string& token) {
+    size_t begin = 0;
+
+    while (begin <= value.size()) {
+        size_t end = value.find(',', begin);
+        if (end == std::string::npos) {
+            end = value.size();
+        }
+
+        /* optional whitespace around the token */
+        size_t first = begin;
+        size_t last = end;
+        while (first < last && (value[first] == ' ' || value[first] == '\t')) {
+            ++first;
+        }
+        while (last > first && (value[last - 1] == ' ' || value[last - 1] == '\t')) {
+            --last;
+        }
+
+        if (last - first == token.size() && strncasecmp(value.data() + first, token.data(), token.size()) == 0) {
+            return true;
+        }
+
+        begin = end + 1;
+    }
+
+    return false;
+}
+
+/**
+ * Unmask a payload, see RFC 6455 section 5.3. Works on eight bytes at a time,
+ * which the compiler turns into vector instructions where available.
+ */
+static void unmask(char* data, size_t length, const unsigned char key[4]) {
+    unsigned char pattern[8];
+    uint64_t mask;
+    size_t i = 0;
+
+    for (size_t j = 0; j < sizeof(pattern); ++j) {
+        pattern[j] = key[j % 4];
+    }
+    std::memcpy(&mask, pattern, sizeof(mask));
+
+    for (; i + sizeof(mask) <= length; i += sizeof(mask)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        word ^= mask;
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+
+    for (; i < length; ++i) {
+        data[i] ^= key[i % 4];
+    }
+}
+
+/** Check for well-formed UTF-8, see RFC 3629. */
+static bool validutf8(const std::string& s) {
+    const uint64_t high = ~static_cast<uint64_t>(0) / 0xff * 0x80;
+    const size_t n = s.size();
+    size_t i = 0;
+
+    while (i < n) {
+        /* skip ascii eight bytes at a time */
+        uint64_t word;
+        if (i + sizeof(word) <= n) {
+            std::memcpy(&word, s.data() + i, sizeof(word));
+            if (!(word & high)) {
+                i += sizeof(word);
+                continue;
+            }
+        }
+
+        const unsigned char c = s[i];
+        size_t length;
+        uint32_t codepoint;
+
+        if (c < 0x80) {
+            i += 1;
+            continue;
+        } else if ((c & 0xe0) == 0xc0) {
+            length = 2;
+            codepoint = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            length = 3;
+            codepoint = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+            length = 4;
+            codepoint = c & 0x07;
+        } else {
+            return false;
+        }
+
+        if (i + length > n) {
+            return false;
+        }
+
+        for (size_t j = 1; j < length; ++j) {
+            const unsigned char cc = s[i + j];
+            if ((cc & 0xc0) != 0x80) {
+                return false;
+            }
+            codepoint = (codepoint << 6) | (cc & 0x3f);
+        }
+
+        /* overlong encodings, surrogates and values beyond unicode */
+        if ((length == 2 && codepoint < 0x80) || (length == 3 && codepoint < 0x800) || (length == 4 && codepoint < 0x10000) || codepoint > 0x10ffff || (codepoint >= 0xd800 && codepoint <= 0xdfff)) {
+            return false;
+        }
+
+        i += length;
+    }
+
+    return true;
+}
+
+/**
+ * Check a frame header, see RFC 6455 section 5.2.
+ * @param buffered bytes of the current message received so far
+ * @return status code to close the connection with, 0 if the frame is fine
+ */
+static unsigned short checkframe(unsigned char first, unsigned char second, uint64_t length, size_t buffered, size_t maxMessageSize) {
+    /* no extensions are negotiated and clients must mask */
+    if ((first & 0x70) || !(second & 0x80)) {
+        return CLOSE_PROTOCOL_ERROR;
+    }
+
+    const bool control = first & 0x8;
+    if (control && (!(first & 0x80) || length > 125)) {
+        return CLOSE_PROTOCOL_ERROR;
+    }
+
+    if (!control && length > maxMessageSize - buffered) {
+        return CLOSE_TOO_BIG;
+    }
+
+    return 0;
+}
+
+/** Header of an unmasked frame sent by the server. */
+static std::string frameheader(unsigned char opcode, size_t length) {
+    std::string header;
+    header += static_cast<char>(0x80 | opcode);
+
+    if (length < 126) {
+        header += static_cast<char>(length);
+    } else if (length <= 0xffff) {
+        header += static_cast<char>(126);
+        header += static_cast<char>((length >> 8) & 0xff);
+        header += static_cast<char>(length & 0xff);
+    } else {
+        header += static_cast<char>(127);
+        for (int i = 7; i >= 0; --i) {
+            header += static_cast<char>((static_cast<uint64_t>(length) >> (8 * i)) & 0xff);
+        }
+    }
+
+    return header;
+}
+
+class WebSocket::Implementation {
+public:
+    Implementation() :
+            sock(-1), open(false), pingSent(false), response(NULL) {
+    }
+
+    /** Unix socket of the connection. */
+    int sock;
+
+    /** Set while the connection is open. */
+    bool open;
+
+    /** Set if a ping is still waiting for its pong. */
+    bool pingSent;
+
+    /**
+     * Response to the upgrade request, NULL in the workers of a detached
+     * connection, which leave closing it to the server process.
+     */
+    Response* response;
+
+    /** Received along with the upgrade request, read before the socket. */
+    std::string input;
+
+    bool receiveAll(char* buffer, size_t length) {
+        size_t offset = std::min(length, input.size());
+        input.copy(buffer, offset);
+        input.erase(0, offset);
+
+        while (offset < length) {
+            ssize_t bytes = recv(sock, buffer + offset, length - offset, 0);
+            if (bytes <= 0) {
+                /* closed / timeout / another error */
+                open = false;
+                return false;
+            }
+            capturedata(trace_request, buffer + offset, bytes);
+            offset += bytes;
+        }
+
+        return true;
+    }
+
+    bool sendAll(const char* buffer, size_t length, int flags) {
+        size_t offset = 0;
+        while (offset < length) {
+            ssize_t bytes = ::send(sock, buffer + offset, length - offset, flags);
+            if (bytes < 0) {
+                open = false;
+                return false;
+            }
+            offset += bytes;
+        }
+
+        return true;
+    }
+
+    bool sendFrame(unsigned char opcode, const char* payload, size_t length) {
+        std::string header = frameheader(opcode, length);
+
+        if (length < BUFSIZ) {
+            /* small frame => single send */
+            header.append(payload, length);
+            return sendAll(header.data(), header.size(), 0);
+        }
+
+        return sendAll(header.data(), header.size(), MSG_MORE) && sendAll(payload, length, 0);
+    }
+
+    /** Wait for input, sending pings while idle. */
+    bool wait(unsigned interval) {
+        if (!input.empty()) {
+            return true;
+        }
+
+        struct pollfd fd;
+        fd.fd = sock;
+        fd.events = POLLIN;
+
+        for (;;) {
+            const int ready = poll(&fd, 1, interval ? static_cast<int>(interval * 1000) : -1);
+            if (ready > 0) {
+                return true;
+            }
+
+            if (ready < 0 || pingSent) {
+                /* error / no pong within interval */
+                open = false;
+                return false;
+            }
+
+            pingSent = true;
+            if (!sendFrame(OPCODE_PING, NULL, 0)) {
+                return false;
+            }
+        }
+    }
+};
+
+WebSocket::WebSocket(const Request& request, Response& response) :
+        pingInterval(30), maxMessageSize(16 * 1024 * 1024), implementation(new Implementation) {
+    const int sock = Access::of(request).sock;
+    std::map<std::string, std::string>::const_iterator upgrade = request.fields.find("Upgrade");
+    std::map<std::string, std::string>::const_iterator connection = request.fields.find("Connection");
+    std::map<std::string, std::string>::const_iterator version = request.fields.find("Sec-WebSocket-Version");
+    std::map<std::string, std::string>::const_iterator key = request.fields.find("Sec-WebSocket-Key");
+
+    /* see RFC 6455 section 4.2.1, HTTP/2 streams have no socket of their own */
+    if (sock < 0 || request.type != "GET" || request.version != "HTTP/1.1" || upgrade == request.fields.end() || !hastoken(upgrade->second, "websocket") || connection == request.fields.end() || !hastoken(connection->second, "upgrade") || version == request.fields.end() || version->second != "13" || key == request.fields.end() || key->second.empty()) {
+        response.statusCode = 400;
+        response.statusMessage = "Bad Request";
+        response.fields["Sec-WebSocket-Version"] = "13";
+        return;
+    }
+
+    std::string handshake = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n";
+    handshake += "Sec-WebSocket-Accept: " + base64encode(sha1(key->second + websocket_guid)) + "\r\n";
+
+    for (std::map<std::string, std::string>::const_iterator it = response.fields.begin(); it != response.fields.end(); ++it) {
+        handshake += it->first + ": " + it->second + "\r\n";
+    }
+
+    handshake += "\r\n";
+
+    /* bypass the response, its header would say "Connection: Close" */
+    Access::of(response).headerSent = true;
+    implementation->sock = sock;
+    implementation->open = true;
+    implementation->response = &response;
+    implementation->input = Access::of(request).input.substr(Access::of(request).inputPos);
+    implementation->sendAll(handshake.data(), handshake.size(), 0);
+}
+
+WebSocket::WebSocket(int sock) :
+        pingInterval(0), maxMessageSize(0), implementation(new Implementation) {
+    implementation->sock = sock;
+    implementation->open = true;
+}
+
+WebSocket::~WebSocket() {
+    if (implementation->response != NULL) {
+        close(CLOSE_NORMAL);
+    }
+    delete implementation;
+}
+
+bool WebSocket::isOpen() const {
+    return implementation->open;
+}
+
+bool WebSocket::receive(std::string& message) {
+    Type type;
+    return receive(message, type);
+}
+
+bool WebSocket::receive(std::string& message, Type& type) {
+    bool fragmented = false;
+    message.clear();
+
+    while (implementation->open) {
+        if (!implementation->wait(pingInterval)) {
+            return false;
+        }
+
+        unsigned char header[2];
+        if (!implementation->receiveAll(reinterpret_cast<char*>(header), sizeof(header))) {
+            return false;
+        }
+
+        const bool fin = header[0] & 0x80;
+        const unsigned char opcode = header[0] & 0x0f;
+        uint64_t length = header[1] & 0x7f;
+
+        if (length >= 126) {
+            unsigned char extended[8];
+            const size_t bytes = length == 126 ? 2 : 8;
+            if (!implementation->receiveAll(reinterpret_cast<char*>(extended), bytes)) {
+                return false;
+            }
+
+            length = 0;
+            for (size_t i = 0; i < bytes; ++i) {
+                length = (length << 8) | extended[i];
+            }
+        }
+
+        const unsigned short error = checkframe(header[0], header[1], length, message.size(), maxMessageSize);
+        if (error) {
+            close(error);
+            return false;
+        }
+
+        unsigned char key[4];
+        if (!implementation->receiveAll(reinterpret_cast<char*>(key), sizeof(key))) {
+            return false;
+        }
+
+        std::string controlPayload;
+        std::string& payload = opcode & 0x8 ? controlPayload : message;
+        const size_t offset = payload.size();
+        payload.resize(offset + length);
+        if (length && !implementation->receiveAll(&payload[offset], length)) {
+            return false;
+        }
+        unmask(&payload[0] + offset, length, key);
+
+        implementation->pingSent = false;
+
+        switch (opcode) {
+        case OPCODE_CONTINUATION:
+            if (!fragmented) {
+                close(CLOSE_PROTOCOL_ERROR);
+                return false;
+            }
+            break;
+
+        case OPCODE_TEXT:
+        case OPCODE_BINARY:
+            if (fragmented) {
+                close(CLOSE_PROTOCOL_ERROR);
+                return false;
+            }
+            fragmented = true;
+            type = static_cast<Type>(opcode);
+            break;
+
+        case OPCODE_CLOSE:
+            /* echo the status code, see RFC 6455 section 5.5.1 */
+            implementation->sendFrame(OPCODE_CLOSE, controlPayload.data(), std::min(controlPayload.size(), static_cast<size_t>(2)));
+            implementation->open = false;
+            return false;
+
+        case OPCODE_PING:
+            implementation->sendFrame(OPCODE_PONG, controlPayload.data(), controlPayload.size());
+            continue;
+
+        case OPCODE_PONG:
+            continue;
+
+        default:
+            close(CLOSE_PROTOCOL_ERROR);
+            return false;
+        }
+
+        if (fin) {
+            if (type == TEXT && !validutf8(message)) {
+                close(CLOSE_INVALID_DATA);
+                return false;
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool WebSocket::send(const std::string& message, Type type) {
+    if (!implementation->open) {
+        return false;
+    }
+
+    return implementation->sendFrame(type, message.data(), message.size());
+}
+
+void WebSocket::close(unsigned short code) {
+    if (!implementation->open) {
+        return;
+    }
+
+    const char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+    implementation->sendFrame(OPCODE_CLOSE, payload, sizeof(payload));
+    implementation->open = false;
+}
+
+bool WebSocket::detach(callback_t callback) {
+    if (!implementation->open || implementation->response == NULL) {
+        return false;
+    }
+
+    std::string message(1, static_cast<char>(MESSAGE_WEBSOCKET));
+    putstring(message, std::string(reinterpret_cast<const char*>(&callback), sizeof(callback)));
+    putnumber(message, pingInterval);
+    putnumber(message, std::min(maxMessageSize, static_cast<size_t>(0xffffffffUL)));
+    putstring(message, implementation->input);
+    if (!supervisorsend(message, implementation->sock)) {
+        return false;
+    }
+
+    Access::of(*implementation->response).detached = true;
+    implementation->open = false;
+    return true;
+}
+
+/**
+ * Pass a message of a detached connection to its callback, in a freshly
+ * forked worker. Tells the server process through done if the callback
+ * closed the connection.
+ */
+static void websocket_worker(int sock, int done, WebSocket::callback_t callback, const std::string& message, WebSocket::Type type) {
+    WebSocket* socket = Access::wrap(sock);
+    callback(*socket, message, type);
+
+    if (!socket->isOpen()) {
+        const char closed = 1;
+        if (write(done, &closed, sizeof(closed)) != sizeof(closed)) {
+            std::perror("write() failed");
+        }
+    }
+
+    delete socket;
+}
+
+class Detached;
+
+/** Read end of a pipe held by the worker of a detached connection. */
+class Finished: public Watcher {
+public:
+    Finished(int fd, Detached* connection) :
+            Watcher(fd), connection(connection) {
+    }
+
+    ~Finished();
+
+    void ready(short);
+
+    /** Connection the worker handles a message of, NULL once it is gone. */
+    Detached* connection;
+};
+
+/**
+ * WebSocket handed over to the server process, see WebSocket::detach(). The
+ * server process answers control frames and sends pings while the connection
+ * is idle. Each complete message is passed to a worker of its own; the
+ * connection is not read from until the worker exits, so messages are
+ * handled in order and frames sent by the server process and the worker do
+ * not interleave.
+ */
+class Detached: public Watcher, public Timer, public Queued {
+public:
+    Detached(int fd, WebSocket::callback_t callback, unsigned pingInterval, size_t maxMessageSize, const std::string& input) :
+            Watcher(fd), done(NULL), callback(callback), pingInterval(pingInterval), maxMessageSize(maxMessageSize), input(input), type(WebSocket::TEXT), fragmented(false), pingSent(false), state(READING) {
+    }
+
+    ~Detached() {
+        if (done != NULL) {
+            done->connection = NULL;
+        }
+    }
+
+    short events() {
+        /* not read from while a message is handled, only hang ups matter */
+        return state == READING ? POLLIN : 0;
+    }
+
+    void ready(short revents) {
+        if (state != READING) {
+            if (state != CLOSED && (revents & (POLLHUP | POLLERR))) {
+                close();
+            }
+            return;
+        }
+
+        char buffer[BUFSIZ];
+        const ssize_t bytes = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+
+        if (bytes <= 0) {
+            /* connection closed / another error */
+            close();
+            return;
+        }
+
+        input.append(buffer, bytes);
+        proceed();
+    }
+
+    void expired() {
+        if (pingSent || !reply(OPCODE_PING, NULL, 0)) {
+            /* no pong within interval / client not reading */
+            close();
+            return;
+        }
+
+        pingSent = true;
+        start(pingInterval * 1000UL);
+    }
+
+    void dispatch() {
+        serve(scheduleracquire());
+    }
+
+    int handoff(std::string&) {
+        /* the callback and the message stay with this shard */
+        return -1;
+    }
+
+    void handedOff() {
+    }
+
+    /** Handle the complete frames received so far. */
+    void proceed() {
+        size_t pos = 0;
+
+        while (state == READING && input.size() - pos >= 2) {
+            const unsigned char first = input[pos];
+            const unsigned char second = input[pos + 1];
+            uint64_t length = second & 0x7f;
+            const size_t extended = length == 126 ? 2 : length == 127 ? 8 : 0;
+            const size_t header = 2 + extended + 4;
+
+            if (input.size() - pos < header) {
+                break;
+            }
+
+            if (extended) {
+                length = 0;
+                for (size_t i = 0; i < extended; ++i) {
+                    length = (length << 8) | static_cast<unsigned char>(input[pos + 2 + i]);
+                }
+            }
+
+            const unsigned short error = checkframe(first, second, length, message.size(), maxMessageSize);
+            if (error) {
+                fail(error);
+                return;
+            }
+
+            if (input.size() - pos - header < length) {
+                break;
+            }
+
+            char* payload = &input[pos + header];
+            unmask(payload, length, reinterpret_cast<const unsigned char*>(payload - 4));
+            pos += header + length;
+            pingSent = false;
+
+            switch (first & 0x0f) {
+            case OPCODE_CONTINUATION:
+                if (!fragmented) {
+                    fail(CLOSE_PROTOCOL_ERROR);
+                    return;
+                }
+                break;
+
+            case OPCODE_TEXT:
+            case OPCODE_BINARY:
+                if (fragmented) {
+                    fail(CLOSE_PROTOCOL_ERROR);
+                    return;
+                }
+                fragmented = true;
+                type = static_cast<WebSocket::Type>(first & 0x0f);
+                break;
+
+            case OPCODE_CLOSE:
+                /* echo the status code, see RFC 6455 section 5.5.1 */
+                reply(OPCODE_CLOSE, payload, std::min(length, static_cast<uint64_t>(2)));
+                close();
+                return;
+
+            case OPCODE_PING:
+                if (!reply(OPCODE_PONG, payload, length)) {
+                    close();
+                    return;
+                }
+                continue;
+
+            case OPCODE_PONG:
+                continue;
+
+            default:
+                fail(CLOSE_PROTOCOL_ERROR);
+                return;
+            }
+
+            message.append(payload, length);
+
+            if (first & 0x80) {
+                if (type == WebSocket::TEXT && !validutf8(message)) {
+                    fail(CLOSE_INVALID_DATA);
+                    return;
+                }
+
+                fragmented = false;
+                schedule();
+            }
+        }
+
+        input.erase(0, pos);
+
+        if (state == READING && pingInterval) {
+            start(pingInterval * 1000UL);
+        }
+    }
+
+    /** The worker handling the last message exited. */
+    void finished(bool open) {
+        done = NULL;
+
+        if (!open) {
+            /* closed by the callback */
+            close();
+            return;
+        }
+
+        state = READING;
+        proceed();
+    }
+
+    /** Worker handling the current message, NULL if none. */
+    Finished* done;
+
+private:
+    const WebSocket::callback_t callback;
+
+    const unsigned pingInterval;
+
+    const size_t maxMessageSize;
+
+    /** Received, but not handled yet. */
+    std::string input;
+
+    /** Message being received. */
+    std::string message;
+
+    WebSocket::Type type;
+
+    /** Set while a fragmented message is received. */
+    bool fragmented;
+
+    /** Set if a ping is still waiting for its pong. */
+    bool pingSent;
+
+    enum {
+        READING, QUEUED, BUSY, CLOSED
+    } state;
+
+    /** Stop serving the connection. */
+    void close() {
+        if (state == QUEUED) {
+            schedulerunqueue(this);
+        }
+
+        state = CLOSED;
+        stop();
+        Loop::remove(this);
+    }
+
+    /** Close the connection with a status code. */
+    void fail(unsigned short code) {
+        const char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+        reply(OPCODE_CLOSE, payload, sizeof(payload));
+        close();
+    }
+
+    /** Send a control frame without blocking. */
+    bool reply(unsigned char opcode, const char* payload, size_t length) {
+        const std::string frame = frameheader(opcode, length) + std::string(payload, length);
+        return send(fd, frame.data(), frame.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == static_cast<ssize_t>(frame.size());
+    }
+
+    /** Fork a worker for the message if one is available, wait for one otherwise. */
+    void schedule() {
+        stop();
+
+        if (!schedulerenabled()) {
+            serve(-1);
+            return;
+        }
+
+        const int slot = scheduleracquire();
+        if (slot >= 0) {
+            serve(slot);
+            return;
+        }
+
+        state = QUEUED;
+        schedulerqueue(this);
+    }
+
+    /**
+     * Fork a worker for the message.
+     * @param slot worker slot to hand to the worker, see scheduleracquire(),
+     *        -1 if the number of workers is not limited
+     */
+    void serve(int slot) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            std::perror("pipe2() failed");
+            if (slot >= 0) {
+                ::close(slot);
+            }
+            close();
+            return;
+        }
+
+        /* for the callback handing work back to this process */
+        const int channel = supervisorchannel();
+
+        switch (serverfork()) {
+        case -1:
+            /* error */
+            ::close(fds[0]);
+            ::close(fds[1]);
+            if (slot >= 0) {
+                ::close(slot);
+            }
+            if (channel >= 0) {
+                ::close(channel);
+            }
+            close();
+            return;
+
+        case 0: {
+            /* worker, drop the file descriptors of the server process */
+            const int sock = dup(fd);
+            const WebSocket::callback_t function = callback;
+            const WebSocket::Type kind = type;
+            std::string payload;
+            payload.swap(message);
+            ::close(fds[0]);
+            Loop::clear();
+            supervisorenter(channel);
+            websocket_worker(sock, fds[1], function, payload, kind);
+            ::close(sock);
+            std::exit(0);
+        }
+
+        default:
+            /* parent, reading resumes once the worker exits */
+            ::close(fds[1]);
+            if (slot >= 0) {
+                ::close(slot);
+            }
+            if (channel >= 0) {
+                ::close(channel);
+            }
+            message.clear();
+            state = BUSY;
+            done = new Finished(fds[0], this);
+            Loop::add(done);
+        }
+    }
+};
+
+Finished::~Finished() {
+    if (connection != NULL) {
+        connection->done = NULL;
+    }
+}
+
+void Finished::ready(short) {
+    char closed;
+    const bool open = read(fd, &closed, sizeof(closed)) != sizeof(closed);
+
+    Loop::remove(this);
+    if (connection != NULL) {
+        connection->finished(open);
+        connection = NULL;
+    }
+}
+
+void websocketadopt(const std::string& message, int fd) {
+    size_t pos = 1;
+    std::string callback;
+    unsigned long pingInterval;
+    unsigned long maxMessageSize;
+    std::string input;
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (!getstring(message, pos, callback) || callback.size() != sizeof(WebSocket::callback_t) || !getnumber(message, pos, pingInterval) || !getnumber(message, pos, maxMessageSize) || !getstring(message, pos, input)) {
+        close(fd);
+        return;
+    }
+
+    WebSocket::callback_t function;
+    std::memcpy(&function, callback.data(), sizeof(function));
+
+    Detached* connection = new Detached(fd, function, pingInterval, maxMessageSize, input);
+    Loop::add(connection);
+    connection->proceed();
+}
+
+} /* namespace mhttpd */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Starts a server with two shards on one port and checks that connections
+ * reach both of them, i.e. that the shards share the port via SO_REUSEPORT.
+ */
+
+#include <cerrno>       /* errno */
+#include <cstdio>       /* std::perror(), std::printf() */
+#include <cstring>      /* std::memset() */
+#include <string>       /* std::string */
+
+#include <arpa/inet.h>  /* htonl(), htons(), ntohs() */
+#include <netinet/in.h> /* struct sockaddr_in */
+#include <signal.h>     /* kill() */
+#include <sys/socket.h> /* socket(), bind(), connect(), getsockname() */
+#include <sys/wait.h>   /* waitpid() */
+#include <unistd.h>     /* fork(), _exit(), close(), usleep() */
+
+#include <mhttpd.h>
+
+/** Connections to try before giving up on reaching both shards. */
+#define ATTEMPTS 256
+
+static void handle(const mhttpd::Request&, mhttpd::Response& r) {
+    r.statusCode = 200;
+    r.statusMessage = "OK";
+    r.contentType = "text/plain";
+    r << static_cast<int>(mhttpd::Shard::current().index);
+}
+
+/** Find a free port on the loopback interface, 0 on failure. */
+static unsigned short freeport() {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t length = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr*) &addr, &length) < 0) {
+        std::perror("freeport() failed");
+        addr.sin_port = 0;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * Ask the server which shard accepted a new connection.
+ * @return index of the shard, -1 on failure
+ */
+static int ask(unsigned short port) {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const std::string request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    std::string reply;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 && send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size())) {
+        char buffer[BUFSIZ];
+        ssize_t bytes;
+        while ((bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            reply.append(buffer, bytes);
+        }
+    }
+    close(fd);
+
+    const size_t body = reply.find("\r\n\r\n");
+    if (body == std::string::npos || body + 5 != reply.size()) {
+        return -1;
+    }
+
+    return reply[body + 4] - '0';
+}
+
+int main() {
+    const unsigned short port = freeport();
+    if (port == 0) {
+        return 1;
+    }
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork() failed");
+        return 1;
+    }
+
+    if (pid == 0) {
+        mhttpd::Server server(handle);
+        server.shards = 2;
+        if (!server.listen(port)) {
+            _exit(1);
+        }
+        _exit(server.start());
+    }
+
+    bool reached[2] = {false, false};
+    for (int attempt = 0; attempt < ATTEMPTS && !(reached[0] && reached[1]); ++attempt) {
+        const int index = ask(port);
+        if (index == 0 || index == 1) {
+            reached[index] = true;
+        } else {
+            /* still starting up */
+            usleep(10000);
+        }
+    }
+
+    kill(pid, SIGINT);
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    std::printf("shard 0 %s, shard 1 %s\n", reached[0] ? "reached" : "not reached", reached[1] ? "reached" : "not reached");
+    return reached[0] && reached[1] ? 0 : 1;
+}
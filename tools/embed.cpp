@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mhttpd-embed: compile static files into a C++ source file, see
+ * mhttpd::Assets. Each file is stored together with its content type, an
+ * entity tag, the precomputed HTTP/1.1 response header and, if zlib is
+ * available and it pays off, a gzip compressed copy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>    /* std::sort() */
+#include <cstdio>       /* std::perror() */
+#include <cstring>      /* std::memset() */
+#include <fstream>      /* std::ifstream, std::ofstream */
+#include <iostream>     /* std::cerr */
+#include <sstream>      /* std::stringstream */
+#include <string>       /* std::string */
+#include <vector>       /* std::vector */
+
+#include <dirent.h>     /* opendir() */
+#include <sys/stat.h>   /* stat() */
+#include <unistd.h>     /* getopt() */
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>       /* deflate() */
+#endif
+
+/** A file to embed. */
+struct File {
+    /** Path on disk. */
+    std::string source;
+
+    /** Request path the file is served at, starting with "/". */
+    std::string path;
+
+    bool operator<(const File& other) const {
+        return path < other.path;
+    }
+};
+
+/** Content types by file name extension. */
+static const char* const types[][2] = {
+    { ".htm", "text/html" },
+    { ".html", "text/html" },
+    { ".shtml", "text/html" },
+    { ".xhtml", "application/xhtml+xml" },
+    { ".xml", "text/xml" },
+    { ".css", "text/css" },
+    { ".js", "text/javascript" },
+    { ".mjs", "text/javascript" },
+    { ".json", "application/json" },
+    { ".map", "application/json" },
+    { ".txt", "text/plain" },
+    { ".pdf", "application/pdf" },
+    { ".jpg", "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".jpe", "image/jpeg" },
+    { ".gif", "image/gif" },
+    { ".png", "image/png" },
+    { ".webp", "image/webp" },
+    { ".svg", "image/svg+xml" },
+    { ".ico", "image/x-icon" },
+    { ".woff", "font/woff" },
+    { ".woff2", "font/woff2" },
+    { ".ttf", "font/ttf" },
+    { ".wasm", "application/wasm" }
+};
+
+static std::string contenttype(const std::string& path) {
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        const std::string suffix(types[i][0]);
+        if (path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            return types[i][1];
+        }
+    }
+
+    return "application/octet-stream";
+}
+
+/** Collect a file, or all files below a directory. */
+static bool collect(const std::string& source, const std::string& path, std::vector<File>& files) {
+    struct stat buf;
+    if (stat(source.c_str(), &buf) != 0) {
+        std::perror(source.c_str());
+        return false;
+    }
+
+    if (S_ISREG(buf.st_mode)) {
+        File file;
+        file.source = source;
+        file.path = path;
+        files.push_back(file);
+        return true;
+    }
+
+    if (!S_ISDIR(buf.st_mode)) {
+        std::cerr << source << ": not a file or directory" << std::endl;
+        return false;
+    }
+
+    DIR* dir = opendir(source.c_str());
+    if (dir == NULL) {
+        std::perror(source.c_str());
+        return false;
+    }
+
+    bool result = true;
+    for (struct dirent* entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        const std::string name(entry->d_name);
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        result = collect(source + "/" + name, path + "/" + name, files) && result;
+    }
+
+    closedir(dir);
+    return result;
+}
+
+static bool readfile(const std::string& source, std::string& content) {
+    std::ifstream file(source.c_str(), std::ios::binary);
+    if (!file) {
+        std::perror(source.c_str());
+        return false;
+    }
+
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+/** Compress content to gzip format, returns false if zlib is not available. */
+static bool compress(const std::string& content, std::string& compressed) {
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    compressed.resize(deflateBound(&stream, content.size()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+    stream.avail_in = content.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    stream.avail_out = compressed.size();
+
+    const int result = deflate(&stream, Z_FINISH);
+    compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+#else
+    (void) content;
+    (void) compressed;
+    return false;
+#endif
+}
+
+/** Quoted entity tag of the length and a FNV-1a hash of the content. */
+static std::string etag(const std::string& content) {
+    unsigned long hash = 2166136261UL;
+    for (std::string::const_iterator it = content.begin(); it != content.end(); ++it) {
+        hash ^= static_cast<unsigned char>(*it);
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+
+    std::stringstream result;
+    result << "\"" << std::hex << content.size() << "-" << hash << "\"";
+    return result.str();
+}
+
+/** Response header as Response::Implementation::sendHeader() would send it. */
+static std::string header(const std::string& type, size_t length, const std::string& tag, bool gzip, bool vary) {
+    std::stringstream result;
+    result << "HTTP/1.1 200 OK\r\n";
+    result << "Content-Type: " << type << "\r\n";
+    result << "Connection: Close\r\n";
+    if (gzip) {
+        result << "Content-Encoding: gzip\r\n";
+    }
+    result << "Content-Length: " << length << "\r\n";
+    result << "ETag: " << tag << "\r\n";
+    if (vary) {
+        result << "Vary: Accept-Encoding\r\n";
+    }
+    result << "\r\n";
+    return result.str();
+}
+
+/** C string literal of arbitrary content. */
+static std::string literal(const std::string& content) {
+    std::string result("\"");
+    for (std::string::const_iterator it = content.begin(); it != content.end(); ++it) {
+        switch (*it) {
+        case '\r':
+            result += "\\r";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '"':
+        case '\\':
+            result += '\\';
+            result += *it;
+            break;
+        default:
+            result += *it;
+        }
+    }
+
+    return result + "\"";
+}
+
+/** Emit content as an array of bytes named name. */
+static void array(std::ostream& out, const std::string& name, const std::string& content) {
+    static const char digits[] = "0123456789abcdef";
+
+    out << "static const unsigned char " << name << "[] = {";
+    if (content.empty()) {
+        out << "0";
+    }
+
+    for (size_t i = 0; i < content.size(); ++i) {
+        const unsigned char c = content[i];
+        out << (i % 16 == 0 ? "\n    " : " ") << "0x" << digits[c >> 4] << digits[c & 15] << (i + 1 < content.size() ? "," : "");
+    }
+
+    out << "\n};\n\n";
+}
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [-n NAME] [-C DIRECTORY] OUTPUT FILE|DIRECTORY..." << std::endl;
+    std::cerr << "  -n NAME       name of the generated table, default \"assets\"" << std::endl;
+    std::cerr << "  -C DIRECTORY  serve files relative to DIRECTORY" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string name("assets");
+    std::string base;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:C:")) != -1) {
+        switch (option) {
+        case 'n':
+            name = optarg;
+            break;
+        case 'C':
+            base = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const std::string output(argv[optind]);
+
+    std::vector<File> files;
+    for (int i = optind + 1; i < argc; ++i) {
+        std::string path(argv[i]);
+        while (path.size() > 1 && path[path.size() - 1] == '/') {
+            path.erase(path.size() - 1);
+        }
+
+        while (path.compare(0, 2, "./") == 0) {
+            path.erase(0, 2);
+        }
+
+        const std::string source(base.empty() ? path : base + "/" + path);
+        const std::string served(path == "." ? "" : "/" + path);
+        if (!collect(source, served, files)) {
+            return 1;
+        }
+    }
+
+    std::sort(files.begin(), files.end());
+    for (size_t i = 1; i < files.size(); ++i) {
+        if (files[i].path == files[i - 1].path) {
+            std::cerr << files[i].path << ": given more than once" << std::endl;
+            return 1;
+        }
+    }
+
+    std::stringstream out;
+    out << "/* Generated by mhttpd-embed, do not edit. */\n\n";
+    out << "#include <mhttpd.h>\n\n";
+
+    std::stringstream table;
+    for (size_t i = 0; i < files.size(); ++i) {
+        std::string content;
+        if (!readfile(files[i].source, content)) {
+            return 1;
+        }
+
+        std::string compressed;
+        const bool gzip = compress(content, compressed) && compressed.size() + compressed.size() / 8 < content.size();
+        const std::string type(contenttype(files[i].path));
+        const std::string tag(etag(content));
+
+        std::stringstream id;
+        id << name << "_" << i;
+
+        out << "/* " << files[i].path << " */\n";
+        array(out, id.str(), content);
+        if (gzip) {
+            array(out, id.str() + "_gzip", compressed);
+        }
+
+        table << "    { " << literal(files[i].path) << ", " << literal(type) << ", " << literal(tag) << ",\n";
+        table << "        " << literal(header(type, content.size(), tag, false, gzip)) << ",\n";
+        table << "        " << id.str() << ", " << content.size() << ",\n";
+        if (gzip) {
+            table << "        " << literal(header(type, compressed.size(), tag, true, true)) << ",\n";
+            table << "        " << id.str() << "_gzip, " << compressed.size() << " }";
+        } else {
+            table << "        NULL, NULL, 0 }";
+        }
+        table << (i + 1 < files.size() ? ",\n" : "\n");
+    }
+
+    out << "extern const mhttpd::Asset " << name << "[] = {\n";
+    if (files.empty()) {
+        out << "    { NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, 0 }\n";
+    }
+    out << table.str() << "};\n\n";
+    out << "extern const size_t " << name << "_count = " << files.size() << ";\n";
+
+    std::ofstream file(output.c_str(), std::ios::binary);
+    file << out.str();
+    if (!file.flush()) {
+        std::perror(output.c_str());
+        return 1;
+    }
+
+    return 0;
+}
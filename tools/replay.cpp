@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2015, Tim Wiederhake
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mhttpd-replay: replay traffic captured with mhttpd::Traffic against a
+ * server, at the original rate, scaled or as fast as possible, and report
+ * throughput and latency. See src/capture.cpp for the format of the log.
+ */
+
+#include <algorithm>    /* std::sort() */
+#include <cerrno>       /* errno */
+#include <cstdio>       /* std::perror(), std::printf() */
+#include <cstdlib>      /* std::strtod(), std::strtoul() */
+#include <cstring>      /* std::memcmp() */
+#include <fstream>      /* std::ifstream */
+#include <iostream>     /* std::cerr */
+#include <map>          /* std::map */
+#include <string>       /* std::string */
+#include <vector>       /* std::vector */
+
+#include <fcntl.h>      /* fcntl() */
+#include <netdb.h>      /* getaddrinfo() */
+#include <poll.h>       /* poll() */
+#include <sys/socket.h> /* socket(), connect(), send(), recv() */
+#include <sys/un.h>     /* struct sockaddr_un */
+#include <time.h>       /* clock_gettime() */
+#include <unistd.h>     /* getopt(), close() */
+
+/** Bytes sent by the client, at a time relative to the start of the connection. */
+struct Chunk {
+    double time;
+    std::string data;
+};
+
+/** A captured connection. */
+struct Connection {
+    /** Time the connection was accepted, in seconds since the capture started. */
+    double start;
+
+    std::vector<Chunk> chunks;
+
+    bool operator<(const Connection& other) const {
+        return start < other.start;
+    }
+};
+
+/** A connection being replayed. */
+struct Replay {
+    const Connection* connection;
+
+    int fd;
+
+    /** Chunk and offset within it to send next. */
+    size_t chunk;
+    size_t offset;
+
+    /** Times in seconds since the replay started. */
+    double started;
+    double firstSent;
+    double firstReceived;
+
+    unsigned long received;
+};
+
+/** Results of the connections replayed. */
+struct Results {
+    Results() :
+            connections(0), errors(0), timeouts(0), sent(0), received(0) {
+    }
+
+    unsigned long connections;
+    unsigned long errors;
+    unsigned long timeouts;
+    unsigned long sent;
+    unsigned long received;
+
+    /** Seconds from the first byte sent to the first byte received. */
+    std::vector<double> firstByte;
+
+    /** Seconds from the first byte sent to the end of the response. */
+    std::vector<double> complete;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long number(const unsigned char* input, size_t count) {
+    unsigned long value = 0;
+    for (size_t i = count; i > 0; --i) {
+        value = (value << 8) | input[i - 1];
+    }
+    return value;
+}
+
+/** Read a capture log, grouping its records into connections. */
+static bool load(const std::string& path, std::vector<Connection>& connections) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    char magic[8];
+    if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, "mhttpdc1", sizeof(magic)) != 0) {
+        std::cerr << path << ": not a capture log" << std::endl;
+        return false;
+    }
+
+    /* connections by shard and number */
+    std::map<std::pair<unsigned long, unsigned long>, size_t> open;
+
+    unsigned char header[20];
+    while (file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        const unsigned long length = number(header, 4);
+        const std::pair<unsigned long, unsigned long> key(number(header + 4, 2), number(header + 8, 4));
+        const int type = header[6];
+        const double time = number(header + 12, 8) / 1e9;
+
+        std::string data(length, '\0');
+        if (length > 0 && !file.read(&data[0], length)) {
+            /* the capture was cut off */
+            break;
+        }
+
+        std::map<std::pair<unsigned long, unsigned long>, size_t>::iterator it = open.find(key);
+        if (type == 1) {
+            Connection connection;
+            connection.start = time;
+            open[key] = connections.size();
+            connections.push_back(connection);
+        } else if (type == 2 && it != open.end()) {
+            Chunk chunk;
+            chunk.time = time - connections[it->second].start;
+            chunk.data.swap(data);
+            connections[it->second].chunks.push_back(chunk);
+        } else if (type == 3 && it != open.end()) {
+            open.erase(it);
+        }
+    }
+
+    std::stable_sort(connections.begin(), connections.end());
+    return true;
+}
+
+/** Resolve "host:port", "[host]:port" or "unix:/path". */
+static bool resolve(const std::string& target, struct sockaddr_storage& address, socklen_t& length) {
+    address = sockaddr_storage();
+
+    if (target.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un* un = reinterpret_cast<struct sockaddr_un*>(&address);
+        const std::string path = target.substr(5);
+        if (path.size() >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        path.copy(un->sun_path, path.size());
+        length = sizeof(struct sockaddr_un);
+        return true;
+    }
+
+    const size_t colon = target.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+
+    std::string host = target.substr(0, colon);
+    if (host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    struct addrinfo hints = addrinfo();
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* result = NULL;
+    if (getaddrinfo(host.c_str(), target.c_str() + colon + 1, &hints, &result) != 0 || result == NULL) {
+        return false;
+    }
+
+    std::memcpy(&address, result->ai_addr, result->ai_addrlen);
+    length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static double percentile(std::vector<double>& values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+}
+
+static void report(const char* name, std::vector<double>& values) {
+    std::printf("%-12s p50 %9.3f  p90 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f ms\n", name, percentile(values, 0.5) * 1e3, percentile(values, 0.9) * 1e3, percentile(values, 0.99) * 1e3, percentile(values, 0.999) * 1e3, percentile(values, 1) * 1e3);
+}
+
+static void usage(const char* name) {
+    std::cerr << "Usage: " << name << " [-s SPEED | -m] [-c CONNECTIONS] [-t SECONDS] LOG HOST:PORT|unix:PATH" << std::endl;
+    std::cerr << "  -s SPEED        replay SPEED times as fast as captured, default 1" << std::endl;
+    std::cerr << "  -m              replay as fast as possible" << std::endl;
+    std::cerr << "  -c CONNECTIONS  limit concurrent connections, default 64 with -m" << std::endl;
+    std::cerr << "  -t SECONDS      give up on a response after SECONDS, default 10" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    double speed = 1;
+    bool maximum = false;
+    size_t limit = 0;
+    double timeout = 10;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:mc:t:")) != -1) {
+        switch (option) {
+        case 's':
+            speed = std::strtod(optarg, NULL);
+            break;
+        case 'm':
+            maximum = true;
+            break;
+        case 'c':
+            limit = std::strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            timeout = std::strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2 || speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (maximum && limit == 0) {
+        limit = 64;
+    }
+
+    std::vector<Connection> connections;
+    if (!load(argv[optind], connections)) {
+        return 1;
+    }
+
+    struct sockaddr_storage address;
+    socklen_t length;
+    if (!resolve(argv[optind + 1], address, length)) {
+        std::cerr << argv[optind + 1] << ": cannot resolve" << std::endl;
+        return 1;
+    }
+
+    Results results;
+    std::vector<Replay> active;
+    size_t next = 0;
+    const double first = connections.empty() ? 0 : connections[0].start;
+    const double begin = now();
+
+    while (next < connections.size() || !active.empty()) {
+        const double elapsed = now() - begin;
+
+        /* open the connections that are due */
+        while (next < connections.size() && (limit == 0 || active.size() < limit) && (maximum || (connections[next].start - first) / speed <= elapsed)) {
+            Replay replay = Replay();
+            replay.connection = &connections[next++];
+            replay.started = elapsed;
+            replay.firstSent = -1;
+            replay.firstReceived = -1;
+            replay.fd = socket(address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (replay.fd < 0 || connect(replay.fd, reinterpret_cast<struct sockaddr*>(&address), length) < 0) {
+                if (replay.fd >= 0) {
+                    close(replay.fd);
+                }
+                results.errors += 1;
+                continue;
+            }
+
+            fcntl(replay.fd, F_SETFL, fcntl(replay.fd, F_GETFL) | O_NONBLOCK);
+            if (replay.connection->chunks.empty()) {
+                /* the client never sent anything */
+                shutdown(replay.fd, SHUT_WR);
+            }
+            active.push_back(replay);
+        }
+
+        /* wait for the sockets, or the next chunk or connection that is due */
+        double wake = elapsed + 0.1;
+        if (next < connections.size() && !maximum && (limit == 0 || active.size() < limit)) {
+            wake = std::min(wake, (connections[next].start - first) / speed);
+        }
+
+        std::vector<struct pollfd> fds(active.size());
+        for (size_t i = 0; i < active.size(); ++i) {
+            const Replay& replay = active[i];
+            fds[i].fd = replay.fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+
+            if (replay.chunk < replay.connection->chunks.size()) {
+                const double due = maximum ? 0 : replay.started + replay.connection->chunks[replay.chunk].time / speed;
+                if (due <= elapsed) {
+                    fds[i].events |= POLLOUT;
+                } else {
+                    wake = std::min(wake, due);
+                }
+            }
+
+            wake = std::min(wake, replay.started + timeout);
+        }
+
+        const int wait = wake > elapsed ? static_cast<int>((wake - elapsed) * 1e3) + 1 : 0;
+        if (poll(fds.empty() ? NULL : &fds[0], fds.size(), wait) < 0 && errno != EINTR) {
+            std::perror("poll() failed");
+            return 1;
+        }
+
+        const double current = now() - begin;
+        for (size_t i = active.size(); i > 0; --i) {
+            Replay& replay = active[i - 1];
+            const struct pollfd& pfd = fds[i - 1];
+            bool done = false;
+            bool failed = false;
+
+            if (pfd.revents & POLLOUT) {
+                /* send what is due of the current chunk */
+                const std::string& data = replay.connection->chunks[replay.chunk].data;
+                const ssize_t bytes = send(replay.fd, data.data() + replay.offset, data.size() - replay.offset, MSG_NOSIGNAL);
+                if (bytes > 0) {
+                    if (replay.firstSent < 0) {
+                        replay.firstSent = current;
+                    }
+                    results.sent += bytes;
+                    replay.offset += bytes;
+                    if (replay.offset == data.size()) {
+                        replay.chunk += 1;
+                        replay.offset = 0;
+                    }
+
+                    if (replay.chunk == replay.connection->chunks.size()) {
+                        /* the end of the requests, e.g. for HTTP/2 connections */
+                        shutdown(replay.fd, SHUT_WR);
+                    }
+                } else if (bytes < 0 && errno != EAGAIN) {
+                    failed = true;
+                }
+            }
+
+            if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[65536];
+                const ssize_t bytes = recv(replay.fd, buffer, sizeof(buffer), 0);
+                if (bytes > 0) {
+                    if (replay.firstReceived < 0) {
+                        replay.firstReceived = current;
+                    }
+                    replay.received += bytes;
+                } else if (bytes == 0) {
+                    done = true;
+                } else if (errno != EAGAIN) {
+                    failed = true;
+                }
+            }
+
+            if (!done && !failed && current - replay.started > timeout) {
+                results.timeouts += 1;
+                failed = true;
+            }
+
+            if (!done && !failed) {
+                continue;
+            }
+
+            results.connections += 1;
+            results.received += replay.received;
+            if (failed) {
+                results.errors += 1;
+            } else if (replay.firstSent >= 0 && replay.firstReceived >= 0) {
+                results.firstByte.push_back(replay.firstReceived - replay.firstSent);
+                results.complete.push_back(current - replay.firstSent);
+            }
+
+            close(replay.fd);
+            active.erase(active.begin() + (i - 1));
+        }
+    }
+
+    const double duration = now() - begin;
+    std::printf("%lu connections in %.3f s, %lu failed (%lu timed out)\n", results.connections, duration, results.errors, results.timeouts);
+    std::printf("throughput   %.1f connections/s, %.1f KiB/s sent, %.1f KiB/s received\n", results.connections / duration, results.sent / duration / 1024, results.received / duration / 1024);
+    report("first byte", results.firstByte);
+    report("complete", results.complete);
+    return results.errors > 0 ? 2 : 0;
+}